@@ -0,0 +1,264 @@
+/*
+Benchmark of the fan-out of one chat message to N peers over UDP on loopback.
+
+It compares the ways a peer can send one message to all the other peers:
+- socket:   a new socket and a sendto for every peer (the old client_thread, here the sockets are closed)
+- sendto:   one persistent socket and a sendto for every peer
+- sendmmsg: one persistent socket and a single sendmmsg for all the peers (multicast() of peer.c, -f mesh)
+- relay:    one write to a TCP connection of a relay thread, which writes what it read to a TCP connection
+            of every peer with one write each (relay() of server.c, -f relay); the rate is what it passed on
+- tree:     a sendmmsg to TREE_CHILDREN peers, what one peer of -f tree sends (or passes on) for a message
+
+Every receiver is a bound UDP socket and a TCP connection, a thread drains them so the queues do not fill up.
+The result is messages/sec (one message = N datagrams or N relayed copies) for every number of peers.
+
+compile: gcc bench_fanout.c -o bench_fanout -lpthread
+Run: ./bench_fanout [seconds per test] [max peers]
+*/
+#define _GNU_SOURCE // sendmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "proto.h"
+
+#define SIZE 256
+#define MAX_PEERS 1024
+#define TREE_CHILDREN 4 // peer -k
+
+int receivers[MAX_PEERS], number_of_peers;
+int relay_out[MAX_PEERS], relay_in[MAX_PEERS], relay_sock; // relay thread -> peers, and the sender -> relay thread
+struct sockaddr_in dest_addr[MAX_PEERS];
+volatile int running;
+volatile long relayed; // bytes the relay thread wrote to every peer
+
+// reads and drops everything the receivers get
+void *drain(void *arg)
+{   int epfd, i, n;
+    struct epoll_event ev, events[64];
+    char buffer[SIZE*2];
+
+    epfd = epoll_create1(0);
+    for (i = 0; i < number_of_peers; i++) {
+        ev.events = EPOLLIN;
+        ev.data.fd = receivers[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, receivers[i], &ev);
+        ev.data.fd = relay_in[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, relay_in[i], &ev);
+    }
+    while (running) {
+        n = epoll_wait(epfd, events, 64, 100);
+        for (i = 0; i < n; i++) {
+            while (recv(events[i].data.fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+                ;
+        }
+    }
+    close(epfd);
+    return NULL;
+}
+
+// the server of -f relay: what the sender wrote goes to every peer, one write each per read
+void *relay_thread(void *arg)
+{   int i, n, w, off;
+    char buffer[1 << 16];
+
+    while (running) {
+        n = recv(relay_sock, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+            break;
+        for (i = 0; i < number_of_peers; i++) {
+            for (off = 0; off < n; off += w) {
+                w = write(relay_out[i], buffer + off, n - off);
+                if (w < 0) {
+                    perror("Error on relay write");
+                    exit(1);
+                }
+            }
+        }
+        relayed += n;
+    }
+    return NULL;
+}
+
+double now()
+{   struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// sends one message to every peer, the way of mode
+void fan_out(int mode, int sock, int relay_from, const char *frame, int len, struct mmsghdr *msgs)
+{   int i, s, sent = 0, n;
+
+    if (mode == 0) {
+        for (i = 0; i < number_of_peers; i++) {
+            s = socket(AF_INET, SOCK_DGRAM, 0);
+            sendto(s, frame, len, 0, (struct sockaddr *) &dest_addr[i], sizeof(dest_addr[i]));
+            close(s);
+        }
+    }
+    else if (mode == 1) {
+        for (i = 0; i < number_of_peers; i++)
+            sendto(sock, frame, len, 0, (struct sockaddr *) &dest_addr[i], sizeof(dest_addr[i]));
+    }
+    else if (mode == 3) {
+        if (write(relay_from, frame, len) != len) {
+            perror("Error on writing to the relay");
+            exit(1);
+        }
+    }
+    else {
+        int count = mode == 4 && number_of_peers > TREE_CHILDREN ? TREE_CHILDREN : number_of_peers;
+        while (sent < count) {
+            n = sendmmsg(sock, msgs + sent, count - sent, 0);
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                perror("Error on sendmmsg");
+                exit(1);
+            }
+            sent += n;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{   int i, n, mode, sock, len, max_peers = 256, listener, relay_from, one = 1;
+    double seconds = 1.0, start, elapsed, rate[5];
+    long messages;
+    char frame[SIZE], text[] = "a chat message of the benchmark";
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    struct mmsghdr msgs[MAX_PEERS];
+    struct iovec iov;
+    struct proto_out o;
+    pthread_t drain_id, relay_id;
+    const char *names[5] = { "socket", "sendto", "sendmmsg", "relay", "tree" };
+
+    if (argc > 1)
+        seconds = atof(argv[1]);
+    if (argc > 2)
+        max_peers = atoi(argv[2]);
+    if (max_peers > MAX_PEERS)
+        max_peers = MAX_PEERS;
+
+    /* the frame of a chat message as peer.c sends it */
+    proto_init_out(&o, frame, sizeof(frame));
+    proto_begin(&o, PROTO_CHAT, 0);
+    proto_put_u16(&o, 9000);
+    proto_put_u64(&o, 1);
+    proto_put_str(&o, text, strlen(text));
+    len = proto_end(&o);
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("Error on opening socket");
+        exit(1);
+    }
+
+    printf("peers");
+    for (mode = 0; mode < 5; mode++)
+        printf(" %s_msgs_per_sec", names[mode]);
+    printf(" sendmmsg_datagrams_per_sec\n");
+
+    for (number_of_peers = 1; number_of_peers <= max_peers; number_of_peers *= 2) {
+        /* receivers on ephemeral ports of loopback */
+        for (i = 0; i < number_of_peers; i++) {
+            receivers[i] = socket(AF_INET, SOCK_DGRAM, 0);
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+            if (receivers[i] < 0 || bind(receivers[i], (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+                perror("Error on binding receiver");
+                exit(1);
+            }
+            addrlen = sizeof(dest_addr[i]);
+            getsockname(receivers[i], (struct sockaddr *) &dest_addr[i], &addrlen);
+        }
+        iov.iov_base = frame;
+        iov.iov_len = len;
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < number_of_peers; i++) {
+            msgs[i].msg_hdr.msg_name = &dest_addr[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(dest_addr[i]);
+            msgs[i].msg_hdr.msg_iov = &iov;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        /* the relay: a TCP connection from the sender and one to every peer, like the server */
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        addrlen = sizeof(addr);
+        if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listener, 64) < 0
+            || getsockname(listener, (struct sockaddr *) &addr, &addrlen) < 0) {
+            perror("Error on opening the relay");
+            exit(1);
+        }
+        for (i = 0; i <= number_of_peers; i++) {
+            n = socket(AF_INET, SOCK_STREAM, 0);
+            if (n < 0 || connect(n, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+                perror("Error on connecting to the relay");
+                exit(1);
+            }
+            setsockopt(n, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (i < number_of_peers)
+                relay_in[i] = n;
+            else
+                relay_from = n;
+            n = accept(listener, NULL, NULL);
+            setsockopt(n, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (i < number_of_peers)
+                relay_out[i] = n;
+            else
+                relay_sock = n;
+        }
+        close(listener);
+
+        running = 1;
+        relayed = 0;
+        pthread_create(&drain_id, NULL, drain, NULL);
+        pthread_create(&relay_id, NULL, relay_thread, NULL);
+        for (mode = 0; mode < 5; mode++) {
+            messages = 0;
+            start = now();
+            do {
+                for (n = 0; n < 16; n++)
+                    fan_out(mode, sock, relay_from, frame, len, msgs);
+                messages += 16;
+                elapsed = now() - start;
+            } while (elapsed < seconds);
+            if (mode == 3) { // the writes return once the relay has them, count what it passed on
+                messages = relayed / len;
+                close(relay_from); // the relay thread ends after the backlog
+                pthread_join(relay_id, NULL);
+            }
+            rate[mode] = messages / elapsed;
+        }
+        running = 0;
+        pthread_join(drain_id, NULL);
+
+        printf("%d %.0f %.0f %.0f %.0f %.0f %.0f\n", number_of_peers, rate[0], rate[1], rate[2], rate[3], rate[4],
+               rate[2] * number_of_peers);
+        fflush(stdout);
+        for (i = 0; i < number_of_peers; i++) {
+            close(receivers[i]);
+            close(relay_in[i]);
+            close(relay_out[i]);
+        }
+        close(relay_sock);
+    }
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,413 @@
+/*
+Load generator and end-to-end benchmark of the chat.
+
+It starts ./server and N ./peer processes on loopback in a scratch directory and drives them through
+their stdin like users would, with the real commands:
+- /msg at a fixed rate per peer, the text carries the sender and the time it was typed
+- /edit of a random existing entry at a fixed rate per peer
+- /GO or /ABORT (a given share of the votes) when a peer asks for a vote
+- /list once a second per peer
+The stdout of every peer is read back: the time a chat message is printed by a peer is the time it was
+written to its DB, so delivery latency = printed - typed, for every peer that delivers it. Commit latency
+is from /edit to the coordinator printing the new version of the entry.
+
+At the end the peers /exit (which dumps their DB to <port>.txt) and the dumps are compared: Total Order
+Multicast and 2 PC must leave every peer with the same entries in the same order.
+
+The result is one JSON object on stdout (progress goes to stderr), e.g. to keep with a version:
+    ./bench_load -n 8 -r 50 -d 10 >> results.jsonl
+
+compile: gcc bench_load.c -o bench_load
+Run: ./bench_load [-n peers] [-r msgs/sec per peer] [-e edits/sec per peer] [-a abort %] [-d seconds]
+                  [-w settle seconds] (wait after the last peer started, default 1, hundreds of peers need more)
+                  [-l loss %] (datagrams every peer drops, peer -l) [-b batch us] (coalescing of the peers, peer -b)
+                  [-f mesh|relay|tree] [-k children] (fan-out of the peers, peer -f and -k)
+                  [-s server] [-p peer] (binaries, default ./server and ./peer)
+                  [-T trace file] (the server records its traffic there, for ./replay)
+                  [-L hop directory] (every peer writes <port>.hops there, peer -L, for ./hopstat)
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include "samples.h"
+
+#define SIZE 256
+#define MAX_PEERS 1024
+#define PORT 9000
+
+struct peer { /*a scripted peer*/
+    pid_t pid;
+    int in, out; // its stdin and stdout
+    char buf[SIZE*16]; // stdout not yet split into lines
+    int len;
+    long delivered; // chat messages written to its DB
+    long sent, edits;
+    long long *edit_start; // us, by edit number, until the commit line
+    int edit_cap;
+    double next_msg, next_edit, next_list;
+};
+
+struct peer peers[MAX_PEERS];
+int number_of_peers = 4;
+double msg_rate = 20, edit_rate = 1, duration = 5, settle = 1;
+int abort_percent = 10;
+long long t0; // us, time 0 of the message stamps
+struct samples delivery, commit;
+long commits, aborts, votes_go, votes_abort, lists;
+pid_t server_pid;
+
+long long now_us()
+{   struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// starts a program with its stdin and stdout on pipes (out NULL = stdout to log), returns its pid
+pid_t spawn(char **argv, int *in, int *out, const char *log)
+{   int to[2], from[2];
+    pid_t pid;
+
+    if (pipe(to) < 0 || pipe(from) < 0) {
+        perror("Error on pipe");
+        exit(1);
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("Error on fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        dup2(to[0], 0);
+        if (out == NULL) // nobody reads it, it must not fill the pipe
+            from[1] = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(from[1], 1);
+        dup2(from[1], 2);
+        close(to[0]); close(to[1]); close(from[0]); close(from[1]);
+        execv(argv[0], argv);
+        perror("Error on exec");
+        _exit(1);
+    }
+    close(to[0]);
+    close(from[1]);
+    *in = to[1];
+    if (out == NULL) {
+        close(from[0]);
+        return pid;
+    }
+    *out = from[0];
+    fcntl(*out, F_SETFL, O_NONBLOCK);
+    return pid;
+}
+
+void command(struct peer *p, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// types a command on the stdin of a peer
+void command(struct peer *p, const char *fmt, ...)
+{   char line[SIZE];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    line[n++] = '\n';
+    if (write(p->in, line, n) != n)
+        fprintf(stderr, "peer %d does not take commands\n", (int) (p - peers));
+}
+
+// one line printed by peer i
+void peer_line(int i, char *line, long long now)
+{   struct peer *p = &peers[i];
+    int sender, entry;
+    long seq, edit;
+    long long stamp;
+    unsigned long long txn;
+    char *s;
+
+    if (line[0] == '-' && sscanf(line, "-L%d.%ld.%lld", &sender, &seq, &stamp) == 3) { // delivered chat
+        sample_add(&delivery, (double) (now - t0 - stamp));
+        p->delivered++;
+    }
+    else if (sscanf(line, "Entry %d edited by %*d: E%d.%ld", &entry, &sender, &edit) == 3) {
+        if (sender == i && edit < p->edit_cap && p->edit_start[edit] != 0) { // our edit, on our own DB
+            sample_add(&commit, (double) (now - p->edit_start[edit]));
+            p->edit_start[edit] = 0;
+            commits++;
+        }
+    }
+    else if (strncmp(line, "Edit Aborted", 12) == 0)
+        aborts++;
+    else if ((s = strstr(line, "Type /ABORT or /GO (")) != NULL && sscanf(s + 20, "%llx", &txn) == 1) {
+        if (rand() % 100 < abort_percent) {
+            command(p, "/ABORT %llx", txn);
+            votes_abort++;
+        }
+        else {
+            command(p, "/GO %llx", txn);
+            votes_go++;
+        }
+    }
+}
+
+// reads what the peers printed, splits it in lines
+void read_peers(int timeout_ms)
+{   struct pollfd pfds[MAX_PEERS];
+    int i, n;
+    char *line, *end;
+    long long now;
+
+    for (i = 0; i < number_of_peers; i++) {
+        pfds[i].fd = peers[i].out;
+        pfds[i].events = POLLIN;
+    }
+    if (poll(pfds, number_of_peers, timeout_ms) <= 0)
+        return;
+    now = now_us();
+    for (i = 0; i < number_of_peers; i++) {
+        struct peer *p = &peers[i];
+        if (!(pfds[i].revents & (POLLIN | POLLHUP)))
+            continue;
+        while ((n = read(p->out, p->buf + p->len, sizeof(p->buf) - 1 - p->len)) > 0) {
+            p->len += n;
+            p->buf[p->len] = '\0';
+            line = p->buf;
+            while ((end = strchr(line, '\n')) != NULL) {
+                *end = '\0';
+                peer_line(i, line, now);
+                line = end + 1;
+            }
+            p->len -= line - p->buf;
+            memmove(p->buf, line, p->len);
+            if (p->len == sizeof(p->buf) - 1) // a line longer than the buffer
+                p->len = 0;
+        }
+    }
+}
+
+// CPU seconds (user + system) of a process so far
+double cpu_seconds(pid_t pid)
+{   char path[SIZE], buf[SIZE*4], *s;
+    unsigned long utime, stime;
+    FILE *f;
+    int n;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n > 0 ? n : 0] = '\0';
+    s = strrchr(buf, ')'); // the name may contain spaces
+    if (s == NULL || sscanf(s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return 0;
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// 1 when every peer dumped the same DB
+int consistent_dumps()
+{   char path[SIZE], *first = NULL, *data;
+    long size, first_size = 0;
+    int i, same = 1;
+    FILE *f;
+
+    for (i = 0; i < number_of_peers; i++) {
+        snprintf(path, sizeof(path), "%d.txt", PORT + i);
+        f = fopen(path, "rb");
+        if (f == NULL)
+            return 0;
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        rewind(f);
+        data = malloc(size + 1);
+        if (data == NULL || fread(data, 1, size, f) != (size_t) size)
+            size = -1;
+        fclose(f);
+        if (i == 0) {
+            first = data;
+            first_size = size;
+            continue;
+        }
+        if (size != first_size || memcmp(data, first, size) != 0)
+            same = 0;
+        free(data);
+    }
+    free(first);
+    return same;
+}
+
+int main(int argc, char *argv[])
+{   int i, n, opt, in, entry;
+    char server_bin[PATH_MAX] = "./server", peer_bin[PATH_MAX] = "./peer";
+    char dir[] = "/tmp/bench_load.XXXXXX", port[16], timeout[16], loss[16] = "0", batch[16] = "-1", path[PATH_MAX];
+    char fanout[16] = "mesh", children[16] = "4", trace[PATH_MAX] = "", hop_dir[PATH_MAX] = "", hop_file[PATH_MAX+16];
+    char *server_argv[] = { server_bin, "-s", "0", NULL, NULL, NULL };
+    char *peer_argv[] = { peer_bin, port, "-p", "manual", "-t", timeout, "-l", loss, "-b", batch, "-f", fanout, "-k", children, NULL, NULL, NULL };
+    double now, end, elapsed, cpu_server, cpu_peers = 0, cpu_max = 0, cpu;
+    long sent = 0, delivered = 0, quiet;
+    long long start;
+
+    while ((opt = getopt(argc, argv, "n:r:e:a:d:w:l:b:f:k:s:p:T:L:")) != -1) {
+        switch (opt) {
+        case 'n': number_of_peers = atoi(optarg); break;
+        case 'r': msg_rate = atof(optarg); break;
+        case 'e': edit_rate = atof(optarg); break;
+        case 'a': abort_percent = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'w': settle = atof(optarg); break;
+        case 'l': snprintf(loss, sizeof(loss), "%d", atoi(optarg)); break;
+        case 'b': snprintf(batch, sizeof(batch), "%d", atoi(optarg)); break;
+        case 'f': snprintf(fanout, sizeof(fanout), "%s", optarg); break;
+        case 'k': snprintf(children, sizeof(children), "%d", atoi(optarg)); break;
+        case 's': snprintf(server_bin, sizeof(server_bin), "%s", optarg); break;
+        case 'p': snprintf(peer_bin, sizeof(peer_bin), "%s", optarg); break;
+        case 'T': snprintf(trace, sizeof(trace), "%s", optarg); break;
+        case 'L': snprintf(hop_dir, sizeof(hop_dir), "%s", optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n peers] [-r msgs/sec] [-e edits/sec] [-a abort %%] [-d seconds] [-w settle seconds] [-l loss %%] [-b batch us] [-f mesh|relay|tree] [-k children] [-s server] [-p peer] [-T trace file] [-L hop directory]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (number_of_peers < 1 || number_of_peers > MAX_PEERS) {
+        fprintf(stderr, "1 to %d peers\n", MAX_PEERS);
+        exit(1);
+    }
+    /* the programs run in a scratch directory, their DBs and dumps stay out of the way */
+    if (realpath(server_bin, path) == NULL || snprintf(server_bin, sizeof(server_bin), "%s", path) < 0
+        || realpath(peer_bin, path) == NULL || snprintf(peer_bin, sizeof(peer_bin), "%s", path) < 0) {
+        perror("Error on finding server and peer");
+        exit(1);
+    }
+    if (trace[0] != '\0') { // written by the server in the scratch directory, the path must stay valid
+        if (trace[0] != '/' && (getcwd(path, sizeof(path)) == NULL
+                                || snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%s", trace) < 0)) {
+            perror("Error on finding trace file");
+            exit(1);
+        }
+        if (trace[0] != '/')
+            snprintf(trace, sizeof(trace), "%s", path);
+        server_argv[3] = "-T";
+        server_argv[4] = trace;
+    }
+    if (hop_dir[0] != '\0') { // like the trace, outside the scratch directory
+        if (realpath(hop_dir, path) == NULL) {
+            perror("Error on finding hop directory");
+            exit(1);
+        }
+        snprintf(hop_dir, sizeof(hop_dir), "%s", path);
+        peer_argv[14] = "-L";
+        peer_argv[15] = hop_file;
+    }
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+        perror("Error on creating scratch directory");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    srand(getpid());
+
+    server_pid = spawn(server_argv, &in, NULL, "server.log");
+    usleep(300000);
+    snprintf(timeout, sizeof(timeout), "%d", 2000);
+    for (i = 0; i < number_of_peers; i++) {
+        snprintf(port, sizeof(port), "%d", PORT + i);
+        snprintf(hop_file, sizeof(hop_file), "%s/%d.hops", hop_dir, PORT + i);
+        peers[i].pid = spawn(peer_argv, &peers[i].in, &peers[i].out, NULL);
+        usleep(50000);
+    }
+    for (n = 0; n < settle * 20; n++) // the last one joined, every peer has the members (a join is N² acks)
+        read_peers(50);
+    fprintf(stderr, "%d peers, %.0f msgs/sec and %.1f edits/sec each for %.0f s\n", number_of_peers, msg_rate, edit_rate, duration);
+
+    /* load: every peer types at its own rate */
+    t0 = start = now_us();
+    end = duration;
+    for (i = 0; i < number_of_peers; i++) {
+        peers[i].next_msg = (double) i / number_of_peers / msg_rate; // spread over the first period
+        peers[i].next_edit = 1.0 + (double) i / number_of_peers / edit_rate;
+        peers[i].next_list = 1.0;
+    }
+    while ((now = (now_us() - start) / 1e6) < end) {
+        for (i = 0; i < number_of_peers; i++) {
+            struct peer *p = &peers[i];
+            while (msg_rate > 0 && p->next_msg <= now) {
+                command(p, "/msg L%d.%ld.%lld", i, p->sent++, now_us() - t0);
+                p->next_msg += 1.0 / msg_rate;
+            }
+            while (edit_rate > 0 && p->next_edit <= now) {
+                p->next_edit += 1.0 / edit_rate;
+                if (p->delivered == 0)
+                    continue;
+                if (p->edits == p->edit_cap) {
+                    p->edit_cap = p->edit_cap ? p->edit_cap * 2 : 256;
+                    p->edit_start = realloc(p->edit_start, p->edit_cap * sizeof(*p->edit_start));
+                }
+                entry = rand() % p->delivered;
+                p->edit_start[p->edits] = now_us();
+                command(p, "/edit E%d.%ld - %d", i, p->edits++, entry);
+            }
+            if (p->next_list <= now) {
+                command(p, "/list");
+                lists++;
+                p->next_list += 1.0;
+            }
+        }
+        read_peers(1);
+    }
+    elapsed = (now_us() - start) / 1e6;
+
+    /* drain: wait until nothing is printed for a second */
+    for (quiet = 0; quiet < 1000; ) {
+        long before = delivery.n + commits + aborts;
+        read_peers(100);
+        quiet = (delivery.n + commits + aborts == before) ? quiet + 100 : 0;
+    }
+
+    cpu_server = cpu_seconds(server_pid);
+    for (i = 0; i < number_of_peers; i++) {
+        cpu = cpu_seconds(peers[i].pid);
+        cpu_peers += cpu;
+        if (cpu > cpu_max)
+            cpu_max = cpu;
+        sent += peers[i].sent;
+        delivered += peers[i].delivered;
+        command(&peers[i], "/exit");
+    }
+    for (i = 0; i < number_of_peers; i++)
+        waitpid(peers[i].pid, NULL, 0);
+    kill(server_pid, trace[0] != '\0' ? SIGINT : SIGKILL); // SIGINT: the server writes the rest of the trace
+    waitpid(server_pid, NULL, 0);
+
+    qsort(delivery.v, delivery.n, sizeof(double), compare_double);
+    qsort(commit.v, commit.n, sizeof(double), compare_double);
+    printf("{\"peers\":%d,\"msg_rate\":%.1f,\"edit_rate\":%.1f,\"abort_percent\":%d,\"loss_percent\":%s,\"batch_us\":%s,\"fanout\":\"%s\",\"children\":%s,\"seconds\":%.2f,"
+           "\"sent\":%ld,\"delivered\":%ld,\"msgs_per_sec\":%.1f,\"deliveries_per_sec\":%.1f,"
+           "\"delivery_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f},"
+           "\"commits\":%ld,\"aborts\":%ld,\"votes_go\":%ld,\"votes_abort\":%ld,\"lists\":%ld,"
+           "\"commit_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f},"
+           "\"cpu_server_pct\":%.1f,\"cpu_peer_avg_pct\":%.1f,\"cpu_peer_max_pct\":%.1f,\"consistent\":%s}\n",
+           number_of_peers, msg_rate, edit_rate, abort_percent, loss, batch, fanout, children, elapsed,
+           sent, delivered, sent / elapsed, delivered / elapsed,
+           percentile(&delivery, 50), percentile(&delivery, 99), percentile(&delivery, 99.9), percentile(&delivery, 100),
+           commits, aborts, votes_go, votes_abort, lists,
+           percentile(&commit, 50), percentile(&commit, 99), percentile(&commit, 99.9), percentile(&commit, 100),
+           100 * cpu_server / elapsed, 100 * cpu_peers / number_of_peers / elapsed, 100 * cpu_max / elapsed,
+           consistent_dumps() ? "true" : "false");
+    if (delivered != sent * number_of_peers)
+        fprintf(stderr, "%ld of %ld deliveries missing\n", sent * number_of_peers - delivered, sent * number_of_peers);
+
+    snprintf(path, sizeof(path), "rm -rf '%s'", dir);
+    if (chdir("/") == 0 && system(path) != 0)
+        fprintf(stderr, "scratch directory %s left behind\n", dir);
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*
+Hop-by-hop latency of the chat messages of a peer (-L file), read by hopstat.c.
+
+A chat message is known everywhere by its trace id: the port of its sender and its Lamport TS, which every
+PROTO_CHAT already carries (hop_id). Each stage a message passes records (id, stage, ns of CLOCK_MONOTONIC)
+into the ring of the thread that runs it: the ring has one writer, its thread, and one reader, hop_flush,
+so a record is a store and a release of the head, with no lock and no syscall. A thread gets its ring the
+first time it records (the only time the mutex is taken). hop_tick writes the rings to the file once a
+second, or sooner when the ring of the calling thread is half full; a full ring drops the record and counts it.
+
+The file is HOP_MAGIC, u16 port of the peer and records of u64 id, u64 ns, u8 stage (host order). The clock
+is the same for all the programs of one host, so the files of the peers of a host can be put side by side.
+*/
+#ifndef HOPS_H
+#define HOPS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#define HOP_MAGIC "P2PHOP1\n"
+#define HOP_FILE_HEADER 10 // magic, port
+#define HOP_RECORD 17 // id, ns, stage
+#define HOP_RING 65536 // records of a thread between two flushes (power of 2)
+
+enum hop_stage {
+    HOP_TYPED = 1,  // the sender: the line came from stdin
+    HOP_PARSED,     // the sender: the event loop took the command, the message has its TS
+    HOP_SENT,       // the sender: the frame is handed to the socket (or to the batch, -b)
+    HOP_REPORTED,   // the sender: its state report went to the server
+    HOP_RECEIVED,   // every other peer: the frame came out of the reliable channel
+    HOP_DELIVERED,  // every peer: written to the DB, in the total order
+    HOP_STAGES
+};
+
+struct hop_rec {
+    uint64_t id, ns;
+    uint8_t stage;
+};
+
+struct hop_ring { /*the records of one thread*/
+    struct hop_rec recs[HOP_RING];
+    uint64_t head, tail; // head: written by the thread, tail: by hop_flush
+    struct hop_ring *next;
+};
+
+struct hop_log { /*a hop file being written, fd -1 = off*/
+    int fd;
+    pthread_mutex_t lock; // the list of rings and the flushes
+    struct hop_ring *rings;
+    uint64_t dropped, flushed; // records lost to a full ring, ns of the last flush
+};
+
+static __thread struct hop_ring *hop_mine; // the ring of this thread
+
+static inline uint64_t hop_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// the trace id of the chat message TS of the peer on port
+static inline uint64_t hop_id(int port, uint64_t ts)
+{
+    return ((uint64_t) port << 48) | (ts & 0xffffffffffffull);
+}
+
+// starts writing the hops of the peer on port to path, -1 on error
+static inline int hop_open(struct hop_log *l, const char *path, uint16_t port)
+{
+    char header[HOP_FILE_HEADER];
+
+    if (pthread_mutex_init(&l->lock, NULL) != 0)
+        return -1;
+    l->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (l->fd < 0)
+        return -1;
+    memcpy(header, HOP_MAGIC, 8);
+    memcpy(header + 8, &port, 2);
+    l->flushed = hop_now_ns();
+    return write(l->fd, header, sizeof(header)) == sizeof(header) ? 0 : -1;
+}
+
+// stage of message id at ns (0 = now), from any thread
+static inline void hop_record(struct hop_log *l, int stage, uint64_t id, uint64_t ns)
+{
+    struct hop_ring *r = hop_mine;
+    struct hop_rec *rec;
+    uint64_t head;
+
+    if (l->fd < 0)
+        return;
+    if (r == NULL) { // the first record of this thread
+        if ((r = calloc(1, sizeof(*r))) == NULL)
+            return;
+        pthread_mutex_lock(&l->lock);
+        r->next = l->rings;
+        l->rings = r;
+        pthread_mutex_unlock(&l->lock);
+        hop_mine = r;
+    }
+    head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == HOP_RING) {
+        __atomic_fetch_add(&l->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec = &r->recs[head & (HOP_RING - 1)];
+    rec->id = id;
+    rec->ns = ns ? ns : hop_now_ns();
+    rec->stage = stage;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// writes the records of every ring to the file
+static inline void hop_flush(struct hop_log *l)
+{
+    char buf[HOP_RECORD * 1024];
+    struct hop_ring *r;
+    struct hop_rec *rec;
+    uint64_t tail, head;
+    int n;
+
+    if (l->fd < 0)
+        return;
+    pthread_mutex_lock(&l->lock);
+    for (r = l->rings; r != NULL; r = r->next) {
+        tail = r->tail;
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (tail < head) {
+            for (n = 0; tail < head && n < 1024; n++, tail++) {
+                rec = &r->recs[tail & (HOP_RING - 1)];
+                memcpy(buf + n * HOP_RECORD, &rec->id, 8);
+                memcpy(buf + n * HOP_RECORD + 8, &rec->ns, 8);
+                buf[n * HOP_RECORD + 16] = rec->stage;
+            }
+            if (write(l->fd, buf, n * HOP_RECORD) != n * HOP_RECORD)
+                perror("Error on writing hops");
+            __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE); // the writer may use the slots again
+        }
+    }
+    l->flushed = hop_now_ns();
+    pthread_mutex_unlock(&l->lock);
+}
+
+// from the loop of the program: a flush once a second, or when the ring of this thread is half full
+static inline void hop_tick(struct hop_log *l)
+{
+    struct hop_ring *r = hop_mine;
+
+    if (l->fd < 0)
+        return;
+    if (hop_now_ns() - l->flushed >= 1000000000ull
+        || (r != NULL && r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= HOP_RING / 2))
+        hop_flush(l);
+}
+
+// writes what the rings hold and stops
+static inline void hop_close(struct hop_log *l)
+{
+    if (l->fd < 0)
+        return;
+    hop_flush(l);
+    close(l->fd);
+    l->fd = -1;
+}
+
+#endif
@@ -0,0 +1,227 @@
+/*
+Where the time of a chat message goes: reads the hop files (hops.h) that the peers wrote with -L and puts the
+stages of every message side by side, by its trace id (port of the sender, Lamport TS).
+
+The hops of a message:
+- input: typed -> parsed, the line waited for the event loop of the sender
+- send: parsed -> sent, the frame was built and went to the socket (with -b to the batch)
+- report: sent -> reported, the state report of the sender to the server
+- network: sent -> received by another peer, the reliable channel (and the batch of -b, the server of
+  -f relay, the peers of -f tree)
+- holdback: received -> delivered by that peer, the wait for the acks of the total order
+- end_to_end: typed (parsed for a message that was not typed) -> delivered, at every peer (the sender too)
+The network hop compares the clocks of two peers, so the files must come from peers of one host.
+
+The result is one JSON object like bench_load: count, p50, p99 and max in ms of every hop and the -n slowest
+messages (until the last peer delivered them) with the hop where each one lost most of its time.
+-f prints instead one line per message and hop in the folded format of flamegraph.pl (sender:ts;hop;peer us),
+e.g. ./hopstat -f *.hops | flamegraph.pl > hops.svg
+
+compile: gcc hopstat.c -o hopstat
+Run: ./hopstat [-n slowest] [-f] hop file...
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hops.h"
+#include "samples.h"
+
+enum hop_kind { H_INPUT, H_SEND, H_REPORT, H_NETWORK, H_HOLDBACK, H_END_TO_END, H_COUNT };
+const char *hop_names[H_COUNT] = { "input", "send", "report", "network", "holdback", "end_to_end" };
+
+struct hop { /*a record of a file*/
+    uint64_t id, ns;
+    uint16_t peer;
+    uint8_t stage;
+};
+
+struct slow { /*a message and the time until the last peer delivered it*/
+    uint64_t id;
+    double us, worst_us;
+    int worst;
+};
+
+struct hop *hops;
+long number_of_hops, hops_cap;
+struct samples samples[H_COUNT];
+struct slow *slowest;
+int number_of_slowest, slowest_cap = 10, folded;
+
+// (id, peer, stage, ns): the records of a message together, the stages of a peer in order
+int compare_hop(const void *a, const void *b)
+{
+    const struct hop *x = a, *y = b;
+
+    if (x->id != y->id)
+        return (x->id > y->id) - (x->id < y->id);
+    if (x->peer != y->peer)
+        return x->peer - y->peer;
+    if (x->stage != y->stage)
+        return x->stage - y->stage;
+    return (x->ns > y->ns) - (x->ns < y->ns);
+}
+
+// appends the records of one hop file, -1 when it is not one
+int load(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    char header[HOP_FILE_HEADER], rec[HOP_RECORD];
+    uint16_t port;
+
+    if (f == NULL)
+        return -1;
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, HOP_MAGIC, 8) != 0) {
+        fclose(f);
+        return -1;
+    }
+    memcpy(&port, header + 8, 2);
+    while (fread(rec, 1, sizeof(rec), f) == sizeof(rec)) { // a record cut short by a kill is left out
+        if (number_of_hops == hops_cap) {
+            hops_cap = hops_cap ? hops_cap * 2 : 65536;
+            hops = realloc(hops, hops_cap * sizeof(*hops));
+            if (hops == NULL) {
+                perror("Error on allocating hops");
+                exit(1);
+            }
+        }
+        memcpy(&hops[number_of_hops].id, rec, 8);
+        memcpy(&hops[number_of_hops].ns, rec + 8, 8);
+        hops[number_of_hops].stage = rec[16];
+        hops[number_of_hops].peer = port;
+        number_of_hops++;
+    }
+    fclose(f);
+    return 0;
+}
+
+// one hop of message id at peer, from..to in ns (0 = the stage is not in the files)
+void hop_add(uint64_t id, int peer, int kind, uint64_t from, uint64_t to, struct slow *s)
+{
+    double us;
+
+    if (from == 0 || to == 0 || to < from)
+        return;
+    us = (to - from) / 1000.0;
+    sample_add(&samples[kind], us);
+    if (kind != H_END_TO_END && us > s->worst_us) {
+        s->worst_us = us;
+        s->worst = kind;
+    }
+    if (folded && kind != H_END_TO_END)
+        printf("%d:%llu;%s;%d %.0f\n", (int) (id >> 48), (unsigned long long) (id & 0xffffffffffffull),
+               hop_names[kind], peer, us);
+}
+
+// keeps the slowest_cap slowest messages, slowest first
+void slow_add(struct slow *s)
+{
+    int i;
+
+    if (number_of_slowest == slowest_cap && s->us <= slowest[number_of_slowest - 1].us)
+        return;
+    if (number_of_slowest < slowest_cap)
+        number_of_slowest++;
+    for (i = number_of_slowest - 1; i > 0 && slowest[i - 1].us < s->us; i--)
+        slowest[i] = slowest[i - 1];
+    slowest[i] = *s;
+}
+
+// the hops of the records [first, last) of one message
+void message(long first, long last)
+{
+    uint64_t id = hops[first].id, at[HOP_STAGES], sent = 0, start = 0, end = 0;
+    int sender = id >> 48, peer;
+    struct slow s = { .id = id, .worst = -1 };
+    long i, j;
+
+    for (i = first; i < last; i++) { // the stages of the sender first, the others start from them
+        if (hops[i].peer != sender)
+            continue;
+        if (hops[i].stage == HOP_TYPED && start == 0)
+            start = hops[i].ns;
+        else if (hops[i].stage == HOP_PARSED && start == 0)
+            start = hops[i].ns;
+        else if (hops[i].stage == HOP_SENT && sent == 0)
+            sent = hops[i].ns;
+    }
+    for (i = first; i < last; i = j) {
+        peer = hops[i].peer;
+        memset(at, 0, sizeof(at));
+        for (j = i; j < last && hops[j].peer == peer; j++) { // the first time of every stage at this peer
+            if (hops[j].stage < HOP_STAGES && at[hops[j].stage] == 0)
+                at[hops[j].stage] = hops[j].ns;
+        }
+        if (peer == sender) {
+            hop_add(id, peer, H_INPUT, at[HOP_TYPED], at[HOP_PARSED], &s);
+            hop_add(id, peer, H_SEND, at[HOP_PARSED], at[HOP_SENT], &s);
+            hop_add(id, peer, H_REPORT, at[HOP_SENT], at[HOP_REPORTED], &s);
+        }
+        else {
+            hop_add(id, peer, H_NETWORK, sent, at[HOP_RECEIVED], &s);
+            hop_add(id, peer, H_HOLDBACK, at[HOP_RECEIVED], at[HOP_DELIVERED], &s);
+        }
+        hop_add(id, peer, H_END_TO_END, start, at[HOP_DELIVERED], &s);
+        if (at[HOP_DELIVERED] > end)
+            end = at[HOP_DELIVERED];
+    }
+    if (start != 0 && end >= start) {
+        s.us = (end - start) / 1000.0;
+        slow_add(&s);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    long i, j, messages = 0;
+    int n, k, files = 0;
+
+    while ((n = getopt(argc, argv, "n:f")) != -1) {
+        if (n == 'n' && atoi(optarg) >= 0)
+            slowest_cap = atoi(optarg);
+        else if (n == 'f')
+            folded = 1;
+        else {
+            fprintf(stderr, "usage: %s [-n slowest] [-f] hop file...\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-n slowest] [-f] hop file...\n", argv[0]);
+        exit(1);
+    }
+    for (; optind < argc; optind++, files++) {
+        if (load(argv[optind]) < 0) {
+            fprintf(stderr, "Not a hop file: %s\n", argv[optind]);
+            exit(1);
+        }
+    }
+    slowest = calloc(slowest_cap + 1, sizeof(*slowest));
+    if (slowest == NULL) {
+        perror("Error on allocating slowest");
+        exit(1);
+    }
+
+    qsort(hops, number_of_hops, sizeof(*hops), compare_hop);
+    for (i = 0; i < number_of_hops; i = j, messages++) {
+        for (j = i; j < number_of_hops && hops[j].id == hops[i].id; j++)
+            ;
+        message(i, j);
+    }
+    if (folded)
+        return 0;
+
+    printf("{\"files\":%d,\"records\":%ld,\"messages\":%ld,\"hops\":{", files, number_of_hops, messages);
+    for (k = 0; k < H_COUNT; k++) {
+        qsort(samples[k].v, samples[k].n, sizeof(double), compare_double);
+        printf("%s\"%s\":{\"count\":%ld,\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}", k ? "," : "", hop_names[k],
+               samples[k].n, percentile(&samples[k], 50), percentile(&samples[k], 99), percentile(&samples[k], 100));
+    }
+    printf("},\"slowest\":[");
+    for (k = 0; k < number_of_slowest; k++)
+        printf("%s{\"sender\":%d,\"ts\":%llu,\"ms\":%.3f,\"worst_hop\":\"%s\",\"worst_ms\":%.3f}", k ? "," : "",
+               (int) (slowest[k].id >> 48), (unsigned long long) (slowest[k].id & 0xffffffffffffull), slowest[k].us / 1000,
+               slowest[k].worst >= 0 ? hop_names[slowest[k].worst] : "", slowest[k].worst_us / 1000);
+    printf("]}\n");
+    return 0;
+}
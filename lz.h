@@ -0,0 +1,140 @@
+/*
+Small LZ77 codec for the state transfer of the peers (the block format of LZ4).
+
+A block is a list of sequences: a token (literal length in the high 4 bits, match length - 4 in
+the low 4 bits, 15 = more length bytes follow, each 255 = keep adding), the literals, and a
+2 byte offset (little endian) back into the output where the match is copied from. The last
+sequence has only literals. Compression is greedy with a hash table of the 4 byte sequences seen,
+so it is fast and has no dependency; the DB entries (numbers, versions and chat text, which repeat
+a lot) shrink to a third or less.
+*/
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// the most bytes lz_compress writes for n bytes of input
+static inline int lz_bound(int n)
+{
+    return n + n / 255 + 16;
+}
+
+static inline uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *lz_put_length(uint8_t *op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+// a sequence: lit literals from src, then a match of len bytes at off back (len 0 = the last one)
+static inline uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *src, int lit, int off, int len)
+{
+    uint8_t *token = op++;
+
+    *token = (uint8_t) ((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15)
+        op = lz_put_length(op, lit - 15);
+    memcpy(op, src, lit);
+    op += lit;
+    if (len == 0)
+        return op;
+    *op++ = (uint8_t) off;
+    *op++ = (uint8_t) (off >> 8);
+    len -= LZ_MIN_MATCH;
+    *token |= (uint8_t) (len < 15 ? len : 15);
+    if (len >= 15)
+        op = lz_put_length(op, len - 15);
+    return op;
+}
+
+// compresses n bytes of src into dst (room for lz_bound(n) bytes), returns the bytes written
+static inline int lz_compress(const char *src, int n, char *dst)
+{
+    static __thread int table[1 << LZ_HASH_BITS]; // last position of every hash
+    const uint8_t *in = (const uint8_t *) src;
+    uint8_t *op = (uint8_t *) dst;
+    int i = 0, anchor = 0, ref, len;
+    uint32_t h;
+
+    memset(table, -1, sizeof(table));
+    while (i + LZ_MIN_MATCH <= n) {
+        h = lz_hash(in + i);
+        ref = table[h];
+        table[h] = i;
+        if (ref < 0 || i - ref > LZ_MAX_OFFSET || memcmp(in + ref, in + i, LZ_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        for (len = LZ_MIN_MATCH; i + len < n && in[ref + len] == in[i + len]; len++)
+            ;
+        op = lz_put_sequence(op, in + anchor, i - anchor, i - ref, len);
+        i += len;
+        anchor = i;
+    }
+    op = lz_put_sequence(op, in + anchor, n - anchor, 0, 0);
+    return (int) (op - (uint8_t *) dst);
+}
+
+// decompresses n bytes of src into dst (cap bytes), returns the bytes written or -1 on a bad block
+static inline int lz_decompress(const char *src, int n, char *dst, int cap)
+{
+    const uint8_t *ip = (const uint8_t *) src, *end = ip + n;
+    uint8_t *op = (uint8_t *) dst, *oend = op + cap;
+    int token, lit, len, off;
+
+    while (ip < end) {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= end)
+                    return -1;
+                lit += *ip;
+            } while (*ip++ == 255);
+        }
+        if (lit > end - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == end) // the last sequence has no match
+            break;
+        if (end - ip < 2)
+            return -1;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        len = token & 15;
+        if (len == 15) {
+            do {
+                if (ip >= end)
+                    return -1;
+                len += *ip;
+            } while (*ip++ == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if (off == 0 || off > op - (uint8_t *) dst || len > oend - op)
+            return -1;
+        while (len-- > 0) { // the match may overlap what it writes
+            *op = op[-off];
+            op++;
+        }
+    }
+    return (int) (op - (uint8_t *) dst);
+}
+
+#endif
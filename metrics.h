@@ -0,0 +1,165 @@
+/*
+Counters, gauges and histograms of the server and the peers.
+
+A metric is a struct in a table of the program, updated with relaxed atomic adds: no lock, no
+syscall, a few ns on the hot path. Histograms have one bucket per power of 2 of the value (ns for
+the latencies), so an observation is a count leading zeros and two adds.
+
+The table is read in two ways:
+- metrics_summary: short text for /stats (counters, gauges, p50/p99 of the histograms)
+- metrics_text: Prometheus text format, written to whoever connects to the Unix socket of
+  metrics_listen (e.g. socat - UNIX-CONNECT:/tmp/server.metrics), one dump per connection
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define METRIC_COUNTER 0
+#define METRIC_GAUGE 1
+#define METRIC_HISTOGRAM 2
+#define METRIC_BUCKETS 40 // 2^0 .. 2^39 ns (about 9 minutes)
+
+struct metric { /*one named value, or a histogram when type is METRIC_HISTOGRAM*/
+    const char *name, *help;
+    int type;
+    int64_t value; // counter, gauge or count of observations
+    uint64_t sum; // of the observations
+    uint64_t buckets[METRIC_BUCKETS]; // observations below 2^(i+1)
+};
+
+static inline void metric_add(struct metric *m, int64_t n)
+{
+    __atomic_fetch_add(&m->value, n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(struct metric *m, int64_t n)
+{
+    __atomic_store_n(&m->value, n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_observe(struct metric *m, uint64_t v)
+{
+    int i = v ? 63 - __builtin_clzll(v) : 0;
+
+    if (i >= METRIC_BUCKETS)
+        i = METRIC_BUCKETS - 1;
+    __atomic_fetch_add(&m->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->sum, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->value, 1, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metric_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// upper bound of the bucket that holds the p-th percentile (0-100)
+static inline uint64_t metric_percentile(struct metric *m, double p)
+{
+    uint64_t count = __atomic_load_n(&m->value, __ATOMIC_RELAXED), seen = 0;
+    int i;
+
+    if (count == 0)
+        return 0;
+    for (i = 0; i < METRIC_BUCKETS; i++) {
+        seen += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+        if (seen * 100.0 >= p * count)
+            break;
+    }
+    return i >= 63 ? UINT64_MAX : (2ULL << i) - 1;
+}
+
+// /stats: one line per metric, returns the bytes written to buf
+static inline int metrics_summary(struct metric *table, int n, char *buf, int size)
+{
+    int i, len = 0;
+    struct metric *m;
+
+    for (i = 0; i < n && len < size; i++) {
+        m = &table[i];
+        if (m->type == METRIC_HISTOGRAM)
+            len += snprintf(buf + len, size - len, "%s: %lld, p50 < %.3f ms, p99 < %.3f ms\n", m->name,
+                            (long long) m->value, metric_percentile(m, 50) / 1e6, metric_percentile(m, 99) / 1e6);
+        else
+            len += snprintf(buf + len, size - len, "%s: %lld\n", m->name, (long long) m->value);
+    }
+    return len < size ? len : size - 1;
+}
+
+// Prometheus text format, histograms in seconds, returns the bytes written to buf
+static inline int metrics_text(const char *prefix, struct metric *table, int n, char *buf, int size)
+{
+    int i, b, len = 0;
+    uint64_t cumulative;
+    struct metric *m;
+
+    for (i = 0; i < n && len < size; i++) {
+        m = &table[i];
+        len += snprintf(buf + len, size - len, "# HELP %s_%s %s\n# TYPE %s_%s %s\n", prefix, m->name, m->help,
+                        prefix, m->name, m->type == METRIC_COUNTER ? "counter" : m->type == METRIC_GAUGE ? "gauge" : "histogram");
+        if (m->type != METRIC_HISTOGRAM) {
+            len += snprintf(buf + len, size - len, "%s_%s %lld\n", prefix, m->name, (long long) m->value);
+            continue;
+        }
+        cumulative = 0;
+        for (b = 0; b < METRIC_BUCKETS && len < size; b++) {
+            cumulative += m->buckets[b];
+            len += snprintf(buf + len, size - len, "%s_%s_bucket{le=\"%.9g\"} %llu\n", prefix, m->name,
+                            (double) (2ULL << b) / 1e9, (unsigned long long) cumulative);
+        }
+        len += snprintf(buf + len, size - len, "%s_%s_bucket{le=\"+Inf\"} %lld\n%s_%s_sum %.9f\n%s_%s_count %lld\n",
+                        prefix, m->name, (long long) m->value, prefix, m->name, m->sum / 1e9,
+                        prefix, m->name, (long long) m->value);
+    }
+    return len < size ? len : size - 1;
+}
+
+// listening Unix socket at path for the Prometheus dump, -1 on error
+static inline int metrics_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path); // left by an old run
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+// answers the pending connections of the metrics socket with a dump
+static inline void metrics_serve(int fd, const char *prefix, struct metric *table, int n)
+{
+    static char buf[1 << 17];
+    int client, len, off, w;
+
+    while ((client = accept(fd, NULL, NULL)) >= 0) {
+        len = metrics_text(prefix, table, n, buf, sizeof(buf));
+        for (off = 0; off < len; off += w) { // a small dump, the client reads it at once
+            w = write(client, buf + off, len - off);
+            if (w <= 0)
+                break;
+        }
+        close(client);
+    }
+}
+
+#endif
@@ -6,486 +6,4582 @@ The peer can:
 3) edit an entry of the DB
 
 The peer is built using:
-- 4 threads: 1 for sending messages to the server and editiing a DB entry, 1 for sending messages to 
-other peers, 1 for receiving messages from other peers, 1 for receiving server messages.
+- 3 threads: 1 reading the commands from stdin, 1 for sending the edits and votes to other peers (started once,
+fed by a bounded lock-free queue, -q says what a full queue does; one sendmmsg on the peer socket for all of
+them, to the addresses kept up to date by the server) and 1 event loop
+(epoll) that waits on the server socket, the peer socket and an eventfd for stdin lines and the shutdown.
+An idle peer sleeps in epoll_wait instead of spinning on recv.
 - signals for exiting are implemented
-- locking of keys for DB entry editing
+- locking of keys for DB entry editing: 2 PC transactions with ids, a lock per entry and vote timeouts,
+edits of different entries run in parallel
+- Total Order Multicast: Lamport clocks (port breaks ties), a hold-back queue and acks, every peer
+writes the chat messages to its DB in the same order
+- Chandy-Lamport snapshots: on a marker the peer reports its DB (what changed since the last report) and the
+chat in flight to the server, a peer that lost its DB gets it back from the server on connect
+- reliable UDP: sequence numbers per pair of peers, selective acks, retransmits with backoff, no copies and a
+window, so the protocols above do not lose a frame (-l drops received datagrams to test it)
+- coalescing (-b): chat messages and acks of a burst share datagrams, a delivery is one writev to the DB
+- state transfer: a late joiner streams the DB of a member over TCP in compressed, checksummed chunks
+(lz.h), the chat that comes meanwhile is held back and the part already in the DB dropped
+- fan-out (-f): mesh (default, a datagram to every peer), relay (one frame to the server, which writes it to
+all the peers) or tree (to -k peers, each passes it on to its part of the others)
+- addressing: the peer binds -a (all addresses by default) and tells the server, which gives every peer the
+address and port of the others; -S is the server (host[:port], 127.0.0.1:6000 by default). The port is still
+the id of a peer in the chat, so it is unique among the members
+- cluster: -S may list the servers of a cluster (host:port,host:port...), the peer connects to the first that answers
+and follows PROTO_REDIRECT to the one that owns its port; when its server goes away it says hello to another one
+of the list (without blocking the event loop), the chat and the DB stay as they are
+- trace (-T file, trace.h): the frames of the server, the datagrams and the commands with their time, for replay.c
+- shared memory (-M, shm.h): the peers of this host write their datagrams to a ring of ours in shared memory
+instead of the UDP socket (a futex wakes us when we sleep), the others and a full ring still go by UDP
+- hops (-L file, hops.h): when each chat message was typed, sent, reported, received and delivered, by its
+trace id (port of the sender, Lamport TS), for hopstat.c
+- full-text search (/search words): an inverted index of the words of the entries, kept with every write and
+saved to <port>.db/search.idx on /exit, the entries with all the words ranked by tf-idf
 
-menu of commands: /help --> /msg (message), /edit (message) - (number of entry you want to edit), /list, /exit
-All users must be active since the beggining.
-The DB is implemented using local txt files. The connections are made using Stream and Datagram sockets.
-Before sending messages to the chat, or editing you have to run /list from the menu.
+menu of commands: /help --> /msg (message), /edit (message) - (number of entry you want to edit), /list, /dump, /exit,
+/GO [txn], /ABORT [txn], /txn (open edits and committed edits/sec), /policy manual|auto|deny, /stats (metrics),
+/search (words)
+A user may join at any time, it gets the DB of the others before it writes the new messages.
+The DB is an append-only log of segments in <port>.db/ with an index of the entries in memory,
+an edit is a new version of the entry, /dump (and /exit) writes the entries to <port>.txt. The connections are made using Stream and Datagram sockets.
+Peers and server exchange the binary frames of proto.h, the commands on stdin are still text.
+The server sends the members on connect and pushes every join and leave (a delta with an epoch number), so the
+destinations are always current without /list; a missed epoch asks for the whole list again.
 
 Protocols used: Total Order Multicast (chat) , 2 PC (edit), consistent global states (server)
 Technologies used: Ubuntu 18.04, gcc 7.5, Coded in C
-compile: gcc peer.c -o peer -lpthread
-Run: ./peer 9000 (...9256)
+compile: gcc peer.c -o peer -lpthread -lrt
+Run: ./peer 9000 (...10023) [-p manual|auto|deny] [-t vote timeout ms] [-m metrics socket] [-l loss %] [-b batch us]
+[-f mesh|relay|tree] [-k children] [-q block|drop|reject] [-a address] [-S server[:port],...] [-T trace file]
+[-L hop file] [-M]
 */
+#define _GNU_SOURCE // sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <time.h>
+#include <dirent.h>
+#include <limits.h>
 
-#define PORT 9000 // first user ever to entry
+#include "proto.h"
+#include "metrics.h"
+#include "lz.h"
+#include "trace.h"
+#include "hops.h"
+#include "shm.h"
+
+#define SERVER_PORT 6000 // of the server when -S has no :port
+#define SERVER_MAX 16 // servers in -S
+#define MOVE_CONNECT 1000 // ms a server of -S has to take our connection when we move
+#define MOVE_ROUNDS 5 // rounds of -S when ours went away (the others need a moment to see it is gone)
+#define MOVE_PAUSE 200 // ms between them
 #define SIZE 256
+#define MAX_PEERS 1024 // members of the chat
 
-void edit_wrapper(int critical);
-void *server_peer(void*);
-void *client_thread(void*);
+struct txn;
+void edit_decide(struct txn *t, int decision);
+void server_peer();
+void peer_messages(int sock);
+void peer_frame(struct proto_frame *f);
+void peer_batch(struct proto_frame *f);
+void *sender_thread(void*);
+void sender_init();
+int send_push(int port, const char *frame, int len, int keep);
+int send_pop(int send);
+int send_post(int port, const char *frame, int len, int policy);
+void build_destinations();
+void multicast(const char *frame, int len);
 void parsed_args(int argc, char **argv);
-void chat(int argc, char **argv, char message[SIZE]);
-void edit_DB_entry(int argc, char **argv, char message[SIZE]);
-void DB_write();
-void update();
-void DB_write_edit();
-void *get_messages(void*);
+int chat(const char *frame, int len, int policy);
+void send_chat(char *message);
+void edit_DB_entry(char message[SIZE]);
+void send_vote(struct txn *t, int vote);
+void vote_command(char *message, int vote);
+void set_policy(char *name);
+int policy_manual(struct txn *t);
+int policy_auto(struct txn *t);
+int policy_deny(struct txn *t);
+long long now_ms();
+void edit_prepare(int port, uint64_t id, int entry, char *message);
+void edit_vote(int port, uint64_t id, int vote);
+void edit_finish(int port, uint64_t id, int decision, int entry, char *message);
+void edit_timers();
+int edit_next_timeout();
+void txn_status();
+void db_open();
+void segment_roll();
+int DB_write(const char *text);
+int DB_write_edit(int entry, const char *text);
+int DB_read(int entry, char *buf, int size);
+void DB_dump();
+void search_add(uint32_t entry, uint32_t version, const char *text, uint32_t len);
+void search_command(char *query);
+void search_load();
+void search_save();
+void *compact_thread(void*);
+int get_messages(int sock);
+void server_frame(struct proto_frame *f);
+void send_server(const char *frame, int len);
+void *event_loop(void*);
+void post_input(char *line);
+void handle_input(char *buffer);
+int set_nonblocking(int fd);
 void *send_message(char *msg);
 void signal_handler(int);
-void consistent(char* message, char* entry, int options);
+void trace_end();
+void hops_end();
+void shm_end();
+void *shm_thread(void*);
+void shm_messages();
+void peer_datagram(char *buffer, int n, int from);
+void holdback_push(uint64_t ts, int port, const char *text);
+void holdback_pop();
+void clock_seen(int port, uint64_t ts);
+void deliver();
+void send_ack(int flags);
+void consistent(char* message, int entry, int options);
+void snapshot_state(int full);
+void snapshot_record(int port, uint64_t ts, const char *text);
+void snapshot_marker(int port, uint32_t snap_id, int full, uint32_t last_complete);
+int snapshot_recording(int port);
+void snapshot_finish();
+int snapshot_next_timeout();
+void sync_frame(struct proto_frame *f);
+void member_delta(uint32_t member_epoch, int op, int member_id, int port, uint32_t addr);
+int DB_apply(uint32_t entry, uint32_t version, const char *text, uint32_t len);
+void rel_forget(int port);
+struct rel_peer *rel_peer_get(int port, int create);
+void rel_unicast(int port, const char *frame, int len);
+void rel_receive(int port, uint32_t inc, uint32_t base, uint32_t seq, const char *frame, uint32_t len);
+void rel_ack(int port, uint32_t inc, uint32_t next, const uint32_t *bitmap, uint32_t wnd);
+void rel_send_acks();
+int shm_send(struct rel_peer *p, struct iovec *iov, int iovcnt);
+void rel_timers();
+int rel_next_timeout();
+void batch_multicast(const char *frame, int len);
+void batch_flush();
+void batch_timers();
+int batch_next_timeout();
+int DB_write_batch(char **texts, int n);
+int DB_apply_chunk(const char *data, uint32_t len);
+uint32_t crc32_update(uint32_t crc, const char *data, uint32_t n);
+void xfer_listen();
+void xfer_accept();
+void xfer_join();
+void xfer_join_ack(int port, uint64_t ts);
+int xfer_covered(uint64_t ts, int port);
+void xfer_read();
+void xfer_connected();
+void xfer_serve();
+void xfer_timers();
+int xfer_next_timeout();
+void relay_send(const char *frame, int len);
+void tree_multicast(const char *frame, int len);
+void tree_send(int origin, const char *below, int n, const char *frame, int len);
+void set_departed(int port, int gone);
+int server_address(const char *host, struct sockaddr_in *addr);
+void server_list();
+int server_socket();
+int server_connect();
+int server_hello(int fd, int flags);
+int server_write(const char *frame, int len);
+int server_reconnect(struct sockaddr_in *to);
+int server_move_next();
+int server_moved();
+int server_move_timers();
+int server_move_timeout();
+uint32_t peer_addr(int port);
 
-char mess[SIZE], DB[SIZE][SIZE], file_name[SIZE][2], edit_mess[SIZE], sec[SIZE], serv_message[SIZE], locked_key[SIZE] = "locked: ";
-int sockfd, ports[SIZE], number_of_users, serv_port, id, key =0, edit=0, edit_port, k;
-pthread_mutex_t lock, lock_edit;
-FILE * fp[SIZE];
+char db_dir[SIZE];
+const char *server_host; // -S host[:port],host[:port]... (the servers of a cluster)
+struct sockaddr_in redirect_to; // from PROTO_REDIRECT, port 0 = none
+struct sockaddr_in servers[SERVER_MAX]; // -S, resolved once: a move does not wait for DNS
+int number_of_servers;
+struct { /*the move to another server of the cluster, the event loop goes on meanwhile*/
+    int active, fd; // fd: connecting, -1 = none (waiting for the next round)
+    struct sockaddr_in first; // of PROTO_REDIRECT, tried before -S, port 0 = none
+    int next, rounds; // the server of -S to try next, rounds of -S done
+    long long deadline; // ms, of the connect or of the pause before the next round
+    char *held; // frames for the server while we move, sent after the hello (lock_server)
+    uint32_t held_len, held_cap;
+} move = { .fd = -1 };
+int sockfd, udp_sock, event_fd, epfd, ports[MAX_PEERS], number_of_users, serv_port, id, key =0;
+int number_of_dests; // entries of dest_addr
+uint32_t epoch; // of the membership in ports[], from the server
+struct sockaddr_in dest_addr[MAX_PEERS]; // cached addresses of the peers, one UDP socket sends to all
+uint32_t addrs[MAX_PEERS]; // IPv4 address of ports[i] (network order), as the peer told the server
+struct in_addr local_addr; // -a: the address we bind and advertise, INADDR_ANY lets the server see it
+uint16_t tree_ports[MAX_PEERS]; // the other peers by port after ours (network order), the tree of our frames
+int number_of_tree;
+uint8_t departed[65536 / 8]; // bit per port: the peer left, a tree from an older list skips it
+int greeted; // the welcome line of the server was read, frames follow
+struct proto_reader server_in; // bytes of the server not yet parsed
+volatile int shutting_down;
+pthread_mutex_t lock, lock_input, lock_db, lock_server; // lock_server: writes to sockfd, from the event loop and sender_thread
+pthread_cond_t compact_cond; // wakes the compaction when versions die
 time_t seconds;
-pthread_t client_id;
+pthread_t sender_id;
+
+#define SEGMENT_SIZE (4 << 20) // bytes of a DB segment before a new one is started
+
+struct db_record { /*header of a record in a segment, the text follows*/
+    uint32_t crc; // of the rest of the header and the text
+    uint32_t entry;
+    uint32_t version; // 1 for a chat message, +1 for every edit
+    uint16_t len;
+    uint16_t flags;
+};
+
+struct db_location { /*where the newest version of an entry is*/
+    uint32_t slot, offset, version;
+    uint16_t len;
+    uint8_t dirty; // changed since the last snapshot report
+};
+
+struct db_segment { /*a log file <port>.db/seg-N.log*/
+    uint32_t id;
+    int fd;
+    uint32_t size, live; // bytes written, bytes of newest versions
+    int removed; // compacted away
+};
+
+struct { /*the DB of this peer*/
+    struct db_segment *segments;
+    int nsegments, segments_cap, active;
+    uint32_t next_id;
+    struct db_location *index; // by entry number
+    uint32_t index_cap;
+} db;
+
+#define SEARCH_MAX_WORD 32 // longer words are cut
+#define SEARCH_RESULTS 10 // entries /search prints
+#define SEARCH_TERMS 8 // words of a query
+#define SEARCH_MAGIC 0x58444953 // "SIDX", the index file <port>.db/search.idx
+
+struct search_posting { /*an entry a word is in, for the version that was indexed*/
+    uint32_t entry;
+    uint32_t version : 24; // low bits, the posting counts while the entry still has this version
+    uint32_t tf : 8; // times the word is in the text
+};
+
+struct search_term { /*a word of the DB and the entries with it, in entry order up to sorted*/
+    uint32_t word, len; // in search.words
+    uint32_t n, cap, sorted;
+    struct search_posting *postings;
+};
+
+struct { /*inverted index of the entries for /search, guarded by lock_db like the DB*/
+    struct search_term *terms;
+    uint32_t nterms, terms_cap;
+    uint32_t *table, table_cap; // open addressing on the hash of the word: term + 1, 0 = empty
+    char *words;
+    uint32_t words_len, words_cap;
+    uint32_t *version, version_cap; // the version of every entry in the index, 0 = none
+    uint64_t postings;
+} search;
+
+struct held_msg { /*a chat message waiting for its turn*/
+    uint64_t ts;
+    int port;
+    char *text;
+    uint64_t since; // ns, when it was held back
+};
+
+struct { /*hold-back queue, a min-heap on (ts, port)*/
+    struct held_msg *heap;
+    int n, cap;
+} holdback;
+
+uint64_t lamport; // Lamport clock of this peer
+uint64_t peer_ts[MAX_PEERS]; // newest TS received from ports[i]
+uint64_t delivered_ts; // (TS, port) of the last message written to the DB
+int delivered_port;
+
+#define VOTE_ASK -1 // vote_policy leaves the vote to the user
+#define LOCK_BUCKETS 256
+
+struct txn { /*an edit (2 PC transaction), as coordinator or as participant*/
+    uint64_t id;
+    int port; // of the coordinator
+    int entry;
+    char text[SIZE];
+    int votes, votes_needed, voters[MAX_PEERS]; // coordinator: ports that voted /GO
+    int voted, decided;
+    long long start, deadline; // ms
+    struct txn *next;
+};
+
+struct entry_lock { /*entry locked by a transaction*/
+    int entry;
+    uint64_t txn;
+    struct entry_lock *next;
+};
+
+struct txn *coordinated, *participating;
+struct entry_lock *entry_locks[LOCK_BUCKETS];
+uint32_t txn_counter;
+int vote_timeout = 10000; // ms to wait for the votes
+int (*vote_policy)(struct txn *t); // decides the vote of this peer
+long edits_committed, edits_aborted;
+long long first_commit;
+
+#define SNAP_WAIT 3000 // ms to wait for the markers of the other peers
+#define SNAP_CHUNK 60000 // bytes of entries in one PROTO_SNAP_STATE frame
+
+struct snap_msg { /*a chat message recorded for a snapshot*/
+    int port;
+    uint64_t ts;
+    char *text;
+};
+
+struct { /*the snapshot this peer is recording*/
+    int active;
+    uint32_t id;
+    int waiting[MAX_PEERS], nwaiting; // ports whose marker did not come yet
+    long long deadline;
+    struct snap_msg *channel;
+    int nchannel, channel_cap;
+} snap;
+uint32_t snap_reported; // last snapshot this peer reported its state to
+
+#define REL_WINDOW 256 // frames in flight to one peer, and kept out of order from one
+#define REL_BUCKETS 256
+#define REL_HEADER (PROTO_HEADER + 14) // PROTO_REL envelope before the frame
+#define REL_RTO 100 // ms before the first retransmit, until the round trip is measured
+#define REL_RTO_MIN 20
+#define REL_ACK_DELAY 5 // ms an ack may wait to cover more frames
+#define REL_ACK_EVERY 16 // frames that are acked at once
+#define REL_RTO_MAX 2000
+
+struct rel_body { /*a frame sent reliably, shared by the windows of all the peers*/
+    int refs, len;
+    char data[];
+};
+
+struct rel_out { /*a frame in flight, not acked yet*/
+    uint32_t seq;
+    struct rel_body *body; // NULL once acked
+    long long sent; // ms
+    int tries;
+};
+
+struct rel_in { /*a frame that came before its turn*/
+    uint32_t len;
+    char data[];
+};
+
+struct rel_queued { /*a frame waiting for room in the window*/
+    struct rel_body *body;
+    struct rel_queued *next;
+};
+
+struct rel_peer { /*the reliable channel to and from one peer*/
+    int port;
+    struct sockaddr_in addr;
+    uint32_t next_seq, acked, wnd; // sending: next number, all before acked are acked, room of the peer
+    int rto, srtt, rttvar; // ms, srtt 0 = not measured yet
+    struct rel_out out[REL_WINDOW];
+    struct rel_queued *queue, *queue_tail;
+    uint32_t in_inc, expected; // receiving: incarnation of the peer, next number to pass on
+    struct rel_in *in[REL_WINDOW];
+    int buffered, ack_due; // frames not acked yet
+    long long ack_at; // ms, when they are
+    struct shm_box *shm_box; // -M: the shared memory of the peer and our ring in it, NULL = UDP
+    struct shm_ring *shm;
+    long long shm_retry; // ms, next try to map it
+
+    struct rel_peer *next;
+};
+
+struct rel_peer *rel_peers[REL_BUCKETS];
+uint32_t incarnation; // random on startup, tells a restarted peer apart
+int loss_percent; // -l: datagrams dropped on receive, to test the retransmits
+
+#define BATCH_MTU 1472 // bytes of a datagram on an Ethernet path (1500 - IP and UDP headers)
+#define DELIVER_BATCH 64 // chat messages written to the DB with one writev
+
+struct { /*chat and acks of the event loop waiting to go out in one datagram*/
+    char buf[BATCH_MTU - REL_HEADER];
+    struct proto_out o;
+    int frames, chats; // chats: of the batch being applied, on receive
+    long long deadline, last_flush; // us, deadline 0 = at the end of this pass of the loop
+    int receiving; // peer_frame is applying a PROTO_BATCH
+} batch;
+int batch_us = -1; // -b: how long a batch may wait under load, -1 = no coalescing
+
+#define XFER_WAIT 3000 // ms to wait for the join acks of the members before asking for the DB
+#define XFER_CONNECT_WAIT 3000 // ms a donor has to take our connection before the next member is asked
+#define XFER_SERVE_WAIT 60000 // ms a joiner may wait for its cut before the donor gives up on it
+#define XFER_CHUNK (256 << 10) // bytes of entries compressed into one PROTO_XFER_CHUNK
+#define XFER_IDLE 0
+#define XFER_ACKS 1 // a late joiner waiting for the join acks, the chat is held back
+#define XFER_STREAM 2 // receiving the DB of a member, the chat is held back
+#define XFER_DONE 3 // the DB came, the chat up to the cut is dropped
+
+struct { /*the state transfer of this peer as a late joiner*/
+    int state, started; // started: the first list of members came
+    int acks, ack_ports[MAX_PEERS]; // join acks of the members
+    uint64_t ack_ts[MAX_PEERS];
+    long long deadline; // ms, of the join acks (or of the connection to the donor)
+    uint64_t cut_ts; // (TS, port): the chat up to here is in the DB of the donor
+    int cut_port;
+    int fd, donor, tried[MAX_PEERS], ntried;
+    int connecting; // the connection to the donor is not up yet, deadline is when it is given up
+    struct proto_reader in;
+    uint32_t entries, bytes;
+    uint64_t start; // ns
+} xfer = { .fd = -1 };
+
+struct xfer_req { /*a late joiner that asked this peer for its DB*/
+    int fd, port, cut_port;
+    uint64_t cut_ts, ts; // ts: clock of the joiner
+    int asked, ready; // asked: the clocks of the peers were asked, ready: the cut is fixed
+    int seen, gone; // seen: the joiner was in the member list, gone: it left it since
+    uint32_t key; // entries to stream
+    struct xfer_req *next;
+};
+struct xfer_req *xfer_requests; // waiting for their cut, guarded by lock_xfer
+pthread_mutex_t lock_xfer;
+pthread_cond_t xfer_cond; // the event loop fixed a cut
+int xfer_fd = -1; // TCP socket on serv_port for the joiners
+
+#define FANOUT_MESH 0 // a datagram to every peer
+#define FANOUT_RELAY 1 // one frame to the server, it writes it to every peer
+#define FANOUT_TREE 2 // a datagram to tree_children peers, they pass it on
+int fanout = FANOUT_MESH; // -f
+int tree_children = 4; // -k
+
+#define SEND_QUEUE 1024 // frames waiting for the sender thread, a power of 2
+#define SEND_BLOCK 0 // a full queue: the caller waits for room
+#define SEND_DROP 1 // the oldest frame that may be dropped makes room
+#define SEND_REJECT 2 // the new frame is not sent
+
+struct send_slot { /*a frame for the sender thread, seq says whose turn the slot is*/
+    uint32_t seq;
+    int port, len, keep; // port 0: to all the peers, keep: never dropped (a decision of 2 PC)
+    char frame[SIZE*2];
+};
+struct { /*bounded lock-free queue of the frames of the event loop for sender_thread*/
+    struct send_slot slots[SEND_QUEUE];
+    uint32_t head, tail; // next slot to take, next slot to fill
+    int waiting; // callers waiting for room
+    int fd, room; // eventfds: frames to send, room for a waiting caller
+} sendq;
+int send_policy = SEND_BLOCK; // -q
+
+enum { M_CHAT_SENT, M_CHAT_DELIVERED, M_DATAGRAMS_IN, M_DATAGRAMS_OUT, M_BYTES_IN, M_BYTES_OUT, M_ACKS_SENT,
+       M_VOTES_GO, M_VOTES_ABORT, M_EDITS_COMMITTED, M_EDITS_ABORTED, M_HOLDBACK, M_INPUT_QUEUE,
+       M_HOLDBACK_TIME, M_DB_WRITE, M_MULTICAST, M_DB_RECOVERY, M_RETRANSMITS, M_DUPLICATES,
+       M_BATCHES, M_BATCHED, M_XFER_BYTES_IN, M_XFER_BYTES_OUT, M_XFER_TIME, M_FORWARDED, M_RELAYED,
+       M_SEND_QUEUE, M_SEND_DROPPED, M_SEARCH_TIME, M_SEARCH_POSTINGS, M_SHM_IN, M_SHM_OUT, M_COUNT };
+struct metric metrics[M_COUNT] = {
+    [M_CHAT_SENT] = { "chat_sent_total", "chat messages sent by this peer", METRIC_COUNTER },
+    [M_CHAT_DELIVERED] = { "chat_delivered_total", "chat messages written to the DB in total order", METRIC_COUNTER },
+    [M_DATAGRAMS_IN] = { "datagrams_in_total", "frames received from the peers", METRIC_COUNTER },
+    [M_DATAGRAMS_OUT] = { "datagrams_out_total", "frames sent to the peers", METRIC_COUNTER },
+    [M_BYTES_IN] = { "bytes_in_total", "bytes received from the peers", METRIC_COUNTER },
+    [M_BYTES_OUT] = { "bytes_out_total", "bytes sent to the peers", METRIC_COUNTER },
+    [M_ACKS_SENT] = { "acks_sent_total", "acks of chat messages multicast", METRIC_COUNTER },
+    [M_VOTES_GO] = { "votes_go_total", "/GO votes sent", METRIC_COUNTER },
+    [M_VOTES_ABORT] = { "votes_abort_total", "/ABORT votes sent", METRIC_COUNTER },
+    [M_EDITS_COMMITTED] = { "edits_committed_total", "edits coordinated by this peer and committed", METRIC_COUNTER },
+    [M_EDITS_ABORTED] = { "edits_aborted_total", "edits coordinated by this peer and aborted", METRIC_COUNTER },
+    [M_HOLDBACK] = { "holdback_depth", "chat messages in the hold-back queue", METRIC_GAUGE },
+    [M_INPUT_QUEUE] = { "input_queue_depth", "stdin lines waiting for the event loop", METRIC_GAUGE },
+    [M_HOLDBACK_TIME] = { "holdback_seconds", "time from hold-back to delivery", METRIC_HISTOGRAM },
+    [M_DB_WRITE] = { "db_write_seconds", "time of one append to the DB log", METRIC_HISTOGRAM },
+    [M_MULTICAST] = { "multicast_seconds", "time of one sendmmsg fan-out", METRIC_HISTOGRAM },
+    [M_DB_RECOVERY] = { "db_recovery_seconds", "time to rebuild the DB index on startup", METRIC_HISTOGRAM },
+    [M_RETRANSMITS] = { "retransmits_total", "frames sent again because their ack did not come", METRIC_COUNTER },
+    [M_DUPLICATES] = { "duplicates_total", "frames received twice and dropped", METRIC_COUNTER },
+    [M_BATCHES] = { "batches_sent_total", "datagrams of coalesced chat and acks multicast", METRIC_COUNTER },
+    [M_BATCHED] = { "batched_frames_total", "chat and ack frames that went out in a batch", METRIC_COUNTER },
+    [M_XFER_BYTES_IN] = { "xfer_bytes_in_total", "compressed DB bytes received as a late joiner", METRIC_COUNTER },
+    [M_XFER_BYTES_OUT] = { "xfer_bytes_out_total", "compressed DB bytes streamed to late joiners", METRIC_COUNTER },
+    [M_XFER_TIME] = { "xfer_seconds", "time from the first list of members to the DB installed", METRIC_HISTOGRAM },
+    [M_FORWARDED] = { "forwarded_frames_total", "frames of other peers passed on down their tree (-f tree)", METRIC_COUNTER },
+    [M_RELAYED] = { "relayed_frames_total", "frames sent to the server for all the peers (-f relay)", METRIC_COUNTER },
+    [M_SEND_QUEUE] = { "send_queue_depth", "edit frames and votes waiting for the sender thread", METRIC_GAUGE },
+    [M_SEND_DROPPED] = { "send_dropped_total", "frames dropped or refused because the send queue was full (-q)", METRIC_COUNTER },
+    [M_SEARCH_TIME] = { "search_seconds", "time of one /search query", METRIC_HISTOGRAM },
+    [M_SEARCH_POSTINGS] = { "search_postings", "postings in the full-text index (old versions until a query drops them)", METRIC_GAUGE },
+    [M_SHM_IN] = { "shm_datagrams_in_total", "datagrams the peers of this host wrote to our shared memory (-M)", METRIC_COUNTER },
+    [M_SHM_OUT] = { "shm_datagrams_out_total", "datagrams written to the shared memory of a peer instead of UDP (-M)", METRIC_COUNTER },
+};
+int metrics_fd = -1; // Unix socket of the Prometheus dump, -1 = none
+struct trace trace = { .fd = -1 }; // -T: what the peer reads and writes, for replay
+struct hop_log hops = { .fd = -1 }; // -L: the stages of the chat messages, for hopstat
+uint64_t input_typed; // when the line handle_input runs was typed (hop_now_ns), 0 = not from stdin
+int use_shm; // -M
+struct shm_box *shm_box; // -M: what the peers of this host write to us, NULL = UDP only
+int shm_fd = -1; // eventfd of the event loop, written by shm_thread when a peer rings
+
+struct input_line { /*a line typed on stdin, waiting for the event loop*/
+    char text[SIZE];
+    uint64_t typed; // hop_now_ns when it was read, for -L
+    struct input_line *next;
+};
+struct input_line *input_head, *input_tail;
 
 int main(int argc, char *argv[]) {
-    int n, sock;
-    struct sockaddr_in serv_addr, peer_addr;
-    pthread_t thread_id, serv_id;
-    char buffer[SIZE], message[SIZE], command[SIZE], msg_token;
+    int n;
+    uint64_t start;
+    pthread_t loop_id, shm_id;
+    char buffer[SIZE];
     
-    // TCP/IP connection with server
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0){
-        perror("Error on opening socket");
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s port [-p manual|auto|deny] [-t vote timeout ms] [-m metrics socket] [-l loss %%] [-b batch us]"
+                " [-f mesh|relay|tree] [-k children] [-q block|drop|reject] [-a address] [-S server[:port],...] [-T trace file] [-L hop file] [-M]\n", argv[0]);
         exit(1);
     }
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(6000);
-    serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    vote_policy = policy_manual;
+    local_addr.s_addr = INADDR_ANY;
+    server_host = "127.0.0.1";
+    optind = 2;
+    while ((n = getopt(argc, argv, "p:t:m:l:b:f:k:q:a:S:T:L:M")) != -1) {
+        if (n == 'p')
+            set_policy(optarg);
+        else if (n == 't')
+            vote_timeout = atoi(optarg);
+        else if (n == 'l')
+            loss_percent = atoi(optarg);
+        else if (n == 'b')
+            batch_us = atoi(optarg);
+        else if (n == 'f')
+            fanout = strcmp(optarg, "relay") == 0 ? FANOUT_RELAY : strcmp(optarg, "tree") == 0 ? FANOUT_TREE : FANOUT_MESH;
+        else if (n == 'k' && atoi(optarg) > 0)
+            tree_children = atoi(optarg);
+        else if (n == 'q')
+            send_policy = strcmp(optarg, "drop") == 0 ? SEND_DROP : strcmp(optarg, "reject") == 0 ? SEND_REJECT : SEND_BLOCK;
+        else if (n == 'a' && inet_pton(AF_INET, optarg, &local_addr) != 1) {
+            fprintf(stderr, "Not an IPv4 address: %s\n", optarg);
+            exit(1);
+        }
+        else if (n == 'S')
+            server_host = optarg;
+        else if (n == 'M')
+            use_shm = 1;
+        else if (n == 'T' && trace_open(&trace, optarg, 'P', atoi(argv[1])) < 0) {
+            perror("Error on opening trace");
+            exit(1);
+        }
+        else if (n == 'L' && hop_open(&hops, optarg, atoi(argv[1])) < 0) {
+            perror("Error on opening hop file");
+            exit(1);
+        }
+        else if (n == 'm' && (metrics_fd = metrics_listen(optarg)) < 0) {
+            perror("Error on metrics socket");
+            exit(1);
+        }
+    }
+    if (!isatty(STDOUT_FILENO)) // a scripted (headless) peer, its output is read line by line
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    if (trace.fd >= 0)
+        atexit(trace_end);
+    if (hops.fd >= 0)
+        atexit(hops_end);
 
     printf("Connecting to Messenger Server...\n");
     
-    //request to connect
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0){
+    // TCP/IP connection with the first server of -S that answers
+    server_list();
+    sockfd = server_connect();
+    if (sockfd < 0){
         perror("Error on connecting");
         exit(1);
     }
+    trace_add(&trace, TRACE_OPEN, 0, 0, NULL, 0);
 
     // signals used for server connection
-    static struct sigaction act, act2; 
+    static struct sigaction act; 
     act.sa_handler = signal_handler; 
     sigfillset(&(act.sa_mask));  
     sigaction(SIGTSTP, &act, 0);
     signal(SIGINT,signal_handler);
 
     printf("Connected !\n");
-    
+
+    // mutex initialization
+    if (pthread_mutex_init(&lock, NULL) < 0
+        || pthread_mutex_init(&lock_input, NULL) < 0 || pthread_mutex_init(&lock_db, NULL) < 0
+        || pthread_mutex_init(&lock_xfer, NULL) < 0 || pthread_cond_init(&xfer_cond, NULL) < 0
+        || pthread_mutex_init(&lock_server, NULL) < 0
+        || pthread_cond_init(&compact_cond, NULL) < 0){
+        perror("Error on initializing mutex");
+        exit(1);
+    }
+
     //PORT of this particular peer used a server
     serv_port = atoi(argv[1]);
-    if (pthread_create(&serv_id, NULL, server_peer, (void*) &argv) < 0) { /*server_peer= pointer to function*/ 
+    srand(time(NULL) ^ getpid());
+    incarnation = ((uint32_t) rand() << 1) | 1; // never 0, the incarnation of a peer we have not heard
+    server_peer();
+    xfer_listen();
+    if (use_shm) { // after the bind: the port is ours
+        if ((shm_box = shm_create(serv_port)) == NULL || (shm_fd = eventfd(0, EFD_NONBLOCK)) < 0
+            || pthread_create(&shm_id, NULL, shm_thread, NULL) != 0) {
+            perror("Error on creating shared memory");
+            exit(1);
+        }
+        atexit(shm_end);
+    }
+    start = metric_now_ns();
+    db_open();
+    metric_observe(&metrics[M_DB_RECOVERY], metric_now_ns() - start);
+
+    /* tell the server the port and address of this peer, this also switches it to frames */
+    if (server_hello(sockfd, 0) < 0){
+        perror("Error on writing to server");
+        exit(1);
+    }
+
+    // wakes the event loop for new stdin lines and for the shutdown
+    event_fd = eventfd(0, EFD_NONBLOCK);
+    if (event_fd < 0){
+        perror("Error on creating eventfd");
+        exit(1);
+    }
+    /* one thread sends the edits and the votes, for the whole life of the peer */
+    sender_init();
+    if (pthread_create(&sender_id, NULL, sender_thread, NULL) < 0){
         perror("Error on creating thread");
         exit(1);
     }
-    /* create thread for receiving chat messages from the server */
-    if (pthread_create(&thread_id, NULL, get_messages, (void*) &sockfd) < 0){
+    /* one thread waits on the server socket, the peer socket and event_fd */
+    if (pthread_create(&loop_id, NULL, event_loop, NULL) < 0){
         perror("Error on creating thread");
         exit(1);
     }
     
-    
     while (1) {
-        // infinite loop to write messages to server or to chat
+        // infinite loop to read the commands, the event loop runs them
         bzero(buffer, SIZE);
-        fgets(buffer, SIZE-1, stdin);
-        if(strcmp(buffer,"clear\n")==0){
-            system("clear");
-            bzero(buffer, SIZE);
-        }
-        n = 0;
-        msg_token = buffer[0];
-        if (msg_token == '/') {
-
-            /* read buffer into command and message strings */
-            bzero(command, SIZE);
-            bzero(message, SIZE);
-            bzero(sec, SIZE);
-            bzero(serv_message, SIZE);
-            sscanf(buffer, "%s %[^\n]", command, message);
-
-            /* process chat commands */
-            if (strcmp(command, "/msg") == 0) {
-                // chat wrapper function
-                chat(argc, argv, message);
-                sprintf(locked_key, "%d", key);
-                consistent(message, locked_key, 1);
-            }else if(strcmp(command, "/edit") == 0) {
-                k=0;
-                // edit the array of ALL PEERS function
-                edit_DB_entry(argc, argv, message);
-            }else if((strcmp(command, "/ABORT") == 0)||(strcmp(command, "/GO") == 0)){
-                // send /GO or /ABORT to peer that requests to edit
-                sock = socket(AF_INET, SOCK_DGRAM, 0);
-                if (sock < 0){
-                    perror("Error on opening socket");
-                    exit(1);
-                }
-
-                bzero((char *) &peer_addr, sizeof(peer_addr));
-                memset(&peer_addr, 0, sizeof(peer_addr));
-                peer_addr.sin_family = AF_INET;
-                peer_addr.sin_port = htons(edit_port);
-                peer_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-                if(strcmp(command, "/ABORT") == 0){
-                    pthread_mutex_lock(&lock); //-->Total order multicast chat
-                    sendto(sock, "/ABORT", sizeof("/ABORT"), 
-                    MSG_CONFIRM, (const struct sockaddr *) &peer_addr,
-                    sizeof(peer_addr));
-                    pthread_mutex_unlock(&lock);
-                }
-                else if((strcmp(command, "/GO") == 0))
-                {   pthread_mutex_lock(&lock); //-->Total order multicast chat
-                    sendto(sock, "/GO", sizeof("/GO"), 
-                    MSG_CONFIRM, (const struct sockaddr *) &peer_addr,
-                    sizeof(peer_addr));
-                    pthread_mutex_unlock(&lock);
-                }
-            }else{
-                /* write to server the command*/
-                n = write(sockfd, buffer, strlen(buffer));
-                if (n < 0)
-                    break;
-            }
-        }
-        else {
-                printf("Command not found try /help\n");
-            }
+        if (fgets(buffer, SIZE-1, stdin) == NULL)
+            break;
+        post_input(buffer);
     }
+    // stdin closed: ask the event loop to disconnect from the server
+    shutting_down = 1;
+    eventfd_write(event_fd, 1);
+
     // terminating threads
-    pthread_join(client_id, NULL);
-    pthread_join(serv_id, NULL);
-    pthread_join(thread_id, NULL);
+    pthread_join(loop_id, NULL);
     printf("Lost connection to server\n");
-    pthread_exit(NULL);
     close(sockfd);
     return 0;
 }
 
-// read messages from srever
-void *get_messages(void *sock_ptr) {
-    int sock, len, n, i=0;
-    char buffer[SIZE], cache[SIZE], msg_token, *a, command[SIZE], message[SIZE];
-    char *ptr,*shared_users[SIZE];;
-    sock = *(int *) sock_ptr;
-    
-    bzero(cache, SIZE);
-    while(1) {
-        /* read message into buffer*/
-        bzero(buffer, SIZE);
-        n = recv(sock, buffer, SIZE-1, MSG_DONTWAIT); /* non-blocking read */
-
-        len = strlen(buffer);
-
-        /* only display new messages */
-        if (len > 0 && strcmp(buffer, cache) != 0) {
-            printf("\n-%s \n", buffer);
-            if(buffer[0]=='P'){ // if message is Peers: ... then this is the list of active peers
-                // initialization of file names
-                number_of_users = 0;
-                for(i=0;i<SIZE;i++){
-                    bzero(file_name[i], 2);
-                }
-                ptr = strtok(buffer, " ");
-                while(ptr!=NULL){
-                    //shared_users = array with peers id
-                    ptr = strtok(NULL, " ");
-                    shared_users[number_of_users] = ptr;
-                    number_of_users++;
+// queues a line from stdin for the event loop and wakes it
+void post_input(char *line)
+{   struct input_line *in = malloc(sizeof(*in));
+    if (in == NULL){
+        perror("Error on allocating input");
+        exit(1);
+    }
+    strcpy(in->text, line);
+    in->typed = hops.fd >= 0 ? hop_now_ns() : 0;
+    in->next = NULL;
+    trace_add(&trace, TRACE_STDIN, 0, 0, line, strlen(line));
+    pthread_mutex_lock(&lock_input);
+    if (input_tail != NULL)
+        input_tail->next = in;
+    else
+        input_head = in;
+    input_tail = in;
+    pthread_mutex_unlock(&lock_input);
+    metric_add(&metrics[M_INPUT_QUEUE], 1);
+    eventfd_write(event_fd, 1);
+}
+
+// event loop: sleeps in epoll_wait until the server, a peer or stdin has something
+void *event_loop(void *arg)
+{   int nfds, i, n, timeout;
+    struct epoll_event ev, events[8];
+    struct input_line *in;
+    eventfd_t value;
+
+    epfd = epoll_create1(0);
+    if (epfd < 0){
+        perror("Error on creating epoll");
+        exit(1);
+    }
+    set_nonblocking(sockfd);
+    set_nonblocking(udp_sock);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sockfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+    ev.data.fd = udp_sock;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, udp_sock, &ev);
+    ev.data.fd = event_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, event_fd, &ev);
+    if (metrics_fd >= 0) {
+        ev.data.fd = metrics_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, metrics_fd, &ev);
+    }
+    ev.data.fd = xfer_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, xfer_fd, &ev);
+    if (shm_fd >= 0) {
+        ev.data.fd = shm_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, shm_fd, &ev);
+    }
+
+    while (1) {
+        timeout = edit_next_timeout(); // wakes up for the vote timeouts and the markers
+        i = snapshot_next_timeout();
+        if (i >= 0 && (timeout < 0 || i < timeout))
+            timeout = i;
+        i = rel_next_timeout(); // and the retransmits
+        if (i >= 0 && (timeout < 0 || i < timeout))
+            timeout = i;
+        i = batch_next_timeout(); // and a batch held back under load
+        if (i >= 0 && (timeout < 0 || i < timeout))
+            timeout = i;
+        i = xfer_next_timeout(); // and the join acks of a late joiner
+        if (i >= 0 && (timeout < 0 || i < timeout))
+            timeout = i;
+        i = server_move_timeout(); // and a move to another server
+        if (i >= 0 && (timeout < 0 || i < timeout))
+            timeout = i;
+        if ((trace.fd >= 0 || hops.fd >= 0) && (timeout < 0 || timeout > 1000)) // and the trace, written once a second
+            timeout = 1000;
+        if (shm_box != NULL && shm_sleep(shm_box)) // a peer of this host wrote meanwhile
+            timeout = 0;
+        nfds = epoll_wait(epfd, events, 8, timeout);
+        if (shm_box != NULL)
+            shm_awake(shm_box);
+        if (nfds < 0){
+            if (errno == EINTR)
+                continue;
+            perror("Error on epoll_wait");
+            exit(1);
+        }
+        edit_timers();
+        rel_timers();
+        trace_tick(&trace);
+        hop_tick(&hops);
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.fd == sockfd) {
+                n = get_messages(sockfd);
+                // redirected to the server of the cluster that has us, or ours is gone and a member goes to another one
+                if (n != 0 && ((n < 0 && !xfer.started) || server_reconnect(n > 0 ? &redirect_to : NULL) < 0)) {
+                    printf("Lost connection to server\n");
+                    exit(0);
                 }
-                for(i=0;i<number_of_users-2;i++){
-                    // ports  = array with peers id 
-                    ports[i] = atoi(shared_users[i]) + PORT;
+            }
+            else if (events[i].data.fd == move.fd) {
+                if (server_moved() < 0) {
+                    printf("Lost connection to server\n");
+                    exit(0);
                 }
             }
-            if(strcmp(buffer,"You have been disconnected") == 0){
-                exit(0);
+            else if (events[i].data.fd == udp_sock) {
+                peer_messages(udp_sock);
+            }
+            else if (events[i].data.fd == shm_fd) {
+                eventfd_read(shm_fd, &value);
             }
-            bzero(cache, SIZE);
+            else if (events[i].data.fd == metrics_fd) {
+                metrics_serve(metrics_fd, "chat_peer", metrics, M_COUNT);
+            }
+            else if (events[i].data.fd == xfer_fd) {
+                xfer_accept();
+            }
+            else if (events[i].data.fd == xfer.fd) {
+                if (xfer.connecting)
+                    xfer_connected();
+                else
+                    xfer_read();
+            }
+            else if (events[i].data.fd == event_fd) {
+                eventfd_read(event_fd, &value);
+                while (1) {
+                    pthread_mutex_lock(&lock_input);
+                    in = input_head;
+                    if (in != NULL) {
+                        input_head = in->next;
+                        if (input_head == NULL)
+                            input_tail = NULL;
+                    }
+                    pthread_mutex_unlock(&lock_input);
+                    if (in == NULL)
+                        break;
+                    metric_add(&metrics[M_INPUT_QUEUE], -1);
+                    input_typed = in->typed;
+                    handle_input(in->text);
+                    input_typed = 0;
+                    free(in);
+                }
+                if (shutting_down) {
+                    char bye[SIZE] = "/exit\n";
+                    handle_input(bye);
+                }
+            }
+        }
+        shm_messages(); // every pass, a busy peer is not woken for them
+        if (server_move_timers() < 0) {
+            printf("Lost connection to server\n");
+            exit(0);
         }
+        xfer_timers();
+        xfer_serve(); // the joiners whose cut this pass delivered
+        batch_timers(); // what this pass coalesced goes out before the loop sleeps
     }
-    
-    close(sock);
     return NULL;
 }
 
-// signal handler for exit
-void signal_handler(int signum){
-    printf("\nType /exit in order to disconnect. \n");
-    return;
+// runs one command typed by the user
+void handle_input(char *buffer)
+{   char message[SIZE], command[SIZE], msg_token;
+
+    if(strcmp(buffer,"clear\n")==0){
+        system("clear");
+        return;
+    }
+    msg_token = buffer[0];
+    if (msg_token == '/') {
+
+        /* read buffer into command and message strings */
+        bzero(command, SIZE);
+        bzero(message, SIZE);
+        sscanf(buffer, "%255s %255[^\n]", command, message);
+
+        /* process chat commands */
+        if (strcmp(command, "/msg") == 0) {
+            // chat wrapper function
+            send_chat(message);
+            consistent(message, key, 1); // TS = Lamport clock of the message
+            hop_record(&hops, HOP_REPORTED, hop_id(serv_port, lamport), 0);
+        }else if(strcmp(command, "/edit") == 0) {
+            // edit the array of ALL PEERS function
+            edit_DB_entry(message);
+        }else if(strcmp(command, "/txn") == 0){
+            txn_status();
+        }else if(strcmp(command, "/policy") == 0){
+            set_policy(message);
+        }else if(strcmp(command, "/stats") == 0){
+            char stats[SIZE*16];
+            metrics_summary(metrics, M_COUNT, stats, sizeof(stats));
+            printf("%s", stats);
+        }else if(strcmp(command, "/search") == 0){
+            search_command(message);
+        }else if(strcmp(command, "/dump") == 0){
+            // the entries of the DB to <port>.txt
+            DB_dump();
+            printf("DB written to %d.txt\n", serv_port);
+        }else if(strcmp(command, "/ABORT") == 0){
+            // send /GO or /ABORT to peer that requests to edit
+            vote_command(message, PROTO_ABORT);
+        }else if(strcmp(command, "/GO") == 0){
+            vote_command(message, PROTO_GO);
+        }else{
+            /* write to server the command*/
+            char frame[SIZE*2];
+            struct proto_out o;
+            buffer[strcspn(buffer, "\n")] = '\0';
+            proto_init_out(&o, frame, sizeof(frame));
+            proto_begin(&o, PROTO_COMMAND, 0);
+            proto_put_str(&o, buffer, strlen(buffer));
+            if (proto_end(&o) >= 0)
+                send_server(o.buf, o.len);
+        }
+    }
+    else {
+            printf("Command not found try /help\n");
+        }
 }
 
+// resolves host[:port] of -S (a name or an IPv4 address, SERVER_PORT without a port)
+int server_address(const char *host, struct sockaddr_in *addr)
+{   char name[SIZE], *colon;
+    struct addrinfo hints, *res;
 
-// chat wrapper function
-void chat(int argc, char **argv, char message[SIZE])
-{   bzero(mess, SIZE);
-    pthread_t thread_id;
-    strcpy(mess, message);
-    // new thread for sending messages to other peers
-    if (pthread_create(&client_id, NULL, client_thread, (void*) &argv) < 0) { /*client_thread= pointer to function*/ 
-        perror("Error on creating thread");
-        exit(1);
+    snprintf(name, sizeof(name), "%.*s", (int) strcspn(host, ","), host);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(SERVER_PORT);
+    if ((colon = strrchr(name, ':')) != NULL) {
+        *colon = '\0';
+        addr->sin_port = htons(atoi(colon + 1));
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name, NULL, &hints, &res) != 0 || res == NULL) {
+        fprintf(stderr, "Error on resolving server %s\n", name);
+        return -1;
+    }
+    addr->sin_addr = ((struct sockaddr_in *) res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return 0;
+}
+
+// resolves the servers of -S once, a host that does not resolve is left out
+void server_list()
+{   const char *host;
+
+    for (host = server_host; host != NULL && number_of_servers < SERVER_MAX; host = strchr(host, ',')) {
+        if (*host == ',')
+            host++;
+        if (server_address(host, &servers[number_of_servers]) == 0)
+            number_of_servers++;
     }
 }
 
-// edit wrapper function
-void edit_DB_entry(int argc, char **argv, char message[SIZE])
-{   char request[SIZE] = "edit request - ";
-    strcat(request,argv[1]);
-    strcpy(edit_mess, message); //who is sending the edit request
-    chat(argc, argv, request);
-}
-
-//function to edit DB entry
-void edit_wrapper(int critical)
-{   //critical --> if all /GO = 0, if one /ABORT =  1
-    if( critical == 0){
-        strtok(edit_mess, "-");
-        char* edit_c = strtok(NULL, "-");
-        
-        /* key lock for entry*/
-        pthread_mutex_lock(&lock_edit);
-        edit = atoi(edit_c); // what entry to edit
-        sprintf(locked_key, "locked key= %d", edit);
-        strcpy(DB[edit], edit_mess); //write new message to entry "edit"
-        pthread_mutex_unlock(&lock_edit);
-        consistent(edit_mess, locked_key, 2);
-        edit=0;
-        DB_write_edit(); // edit entry to all peer files
-    }
-    else if( critical == 1)
-        printf("Edit Aborted\n"); // /ABORT
-    critical = 0;
+// a TCP socket from -a, so the server sees our address
+int server_socket()
+{   int fd, one = 1;
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = local_addr;
+    if (local_addr.s_addr != INADDR_ANY && bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // -f relay: a chat message or an ack goes out at once
+    return fd;
 }
 
+// at startup: a connection to the first server of -S that answers, -1 if none does
+int server_connect()
+{   int fd, i;
+    struct timeval tv = { 1, 0 };
 
-// edit DB entry in all file copies
-void DB_write_edit()
-{   int i=0, j=0;
-    for(j=0;j<number_of_users-2;j++){
-        sprintf(file_name[j], "%d", ports[j]); //filenames=ports.txt
-        strcat(file_name[j],".txt");
-        fp[j] = fopen (file_name[j],"wb"); //open txt file
-        for(i=0;i<key;i++){ // key = #entries
-            fprintf (fp[j], DB[i], sizeof(DB[i]));
-            fprintf(fp[j], "\n");
+    for (i = 0; i < number_of_servers; i++) {
+        if ((fd = server_socket()) < 0)
+            return -1;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)); // of connect, a host that is down
+        if (connect(fd, (struct sockaddr *) &servers[i], sizeof(servers[i])) == 0) {
+            tv.tv_sec = 0;
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            return fd;
         }
-        fclose(fp[j]);
+        close(fd);
     }
+    return -1;
 }
 
-//write message to DB
-void DB_write()
-{   int i=0, j=0;
-    FILE *f;
-    char filename[SIZE];
-    sprintf(filename, "%d", serv_port); //file of every peer
-    strcat(filename,".txt");
+// PROTO_HELLO with our port and address and, before we are a member, the entries we have for PROTO_SYNC_REQ
+int server_hello(int fd, int flags)
+{   char buffer[SIZE];
+    struct proto_out o;
 
-    f = fopen (filename,"wb");
-    for(i=0;i<key;i++){  // key = #entries
-        fprintf (f, DB[i], sizeof(DB[i]));
-        fprintf(f, "\n");
+    proto_init_out(&o, buffer, SIZE);
+    proto_begin(&o, PROTO_HELLO, flags);
+    proto_put_u16(&o, serv_port);
+    proto_put_u32(&o, ntohl(local_addr.s_addr)); // 0: the address the server sees
+    proto_end(&o);
+    if (!xfer.started) { // the server sends back what its checkpoints have beyond them
+        proto_begin(&o, PROTO_SYNC_REQ, 0);
+        proto_put_u32(&o, key);
     }
-    fclose(f);
+    if (proto_end(&o) < 0)
+        return -1;
+    trace_add(&trace, TRACE_OUT, 0, 0, o.buf, o.len);
+    if (write(fd, o.buf, o.len) != (int) o.len)
+        return -1;
+    return 0;
 }
 
-// updates the DB array from the file
-void update()
-{   int i=0, j=0;
-    FILE *file;
-    char filename[SIZE];
-    sprintf(filename, "%d", serv_port);
-    strcat(filename,".txt");
-    int numProgs=0;
-    char* programs[50];
-    char line[50];
+/* moves us to another server of the cluster: the one of a PROTO_REDIRECT (to), or when ours went away the
+   first of -S that answers (MOVE_ROUNDS rounds, the others need a moment to see it is gone). The connects do
+   not block, the event loop goes on with the retransmits, the votes and stdin meanwhile and the frames for
+   the server wait in move.held. We stay a member, the new server sends the whole list and nothing changes
+   for the other peers */
+int server_reconnect(struct sockaddr_in *to)
+{
+    pthread_mutex_lock(&lock_server); // from now on send_server holds the frames
+    epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
+    close(sockfd);
+    sockfd = -1;
+    trace_add(&trace, TRACE_CLOSE, 0, 0, NULL, 0);
+    move.active = 1;
+    pthread_mutex_unlock(&lock_server);
+    memset(&move.first, 0, sizeof(move.first));
+    if (to != NULL)
+        move.first = *to;
+    memset(&redirect_to, 0, sizeof(redirect_to));
+    move.next = move.rounds = 0;
+    return server_move_next();
+}
 
-    bzero(DB, SIZE);
-    file = fopen (filename,"r");
-    while(fgets(line, sizeof(line), file)!=NULL) {
-        if(strcmp(line, "\n") != 0){
-            line[strlen(line) - 1] = '\0';
-            strcpy(DB[i], line);  
-            i++;
+// connects to the next server without waiting for it, after a round of -S a pause; -1 when the rounds are over
+int server_move_next()
+{   struct sockaddr_in to;
+    struct epoll_event ev;
+    int fd;
+
+    while (1) {
+        if (move.first.sin_port != 0) {
+            to = move.first;
+            move.first.sin_port = 0;
         }
+        else if (move.next < number_of_servers)
+            to = servers[move.next++];
+        else {
+            move.next = 0;
+            if (++move.rounds >= MOVE_ROUNDS)
+                return -1;
+            move.deadline = now_ms() + MOVE_PAUSE;
+            return 0;
+        }
+        if ((fd = server_socket()) < 0)
+            continue;
+        if (set_nonblocking(fd) < 0
+            || (connect(fd, (struct sockaddr *) &to, sizeof(to)) < 0 && errno != EINPROGRESS)) {
+            close(fd);
+            continue;
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        move.fd = fd;
+        move.deadline = now_ms() + MOVE_CONNECT;
+        return 0;
     }
-    fclose(file);
 }
 
-// write messages to all peers in chat
-void *client_thread(void *args_ptr)
-{   int sockfd[SIZE], i=0;
-    struct sockaddr_in serv_addr[SIZE];
-    char buffer[SIZE];;
-    
-    
-    for(i=0;i<number_of_users-2;i++)
-    {   //socket for every peer connection
-        sockfd[i] = socket(AF_INET, SOCK_DGRAM, 0);
-        if (sockfd[i] < 0){
-            perror("Error on opening socket");
-            exit(1);
-        }
+// the connection of a move is up (or refused): the hello, then the frames held meanwhile
+int server_moved()
+{   int err = 0, fd = move.fd;
+    socklen_t len = sizeof(err);
+    struct epoll_event ev;
+
+    move.fd = -1;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        close(fd); // and out of epoll
+        return server_move_next();
+    }
+    pthread_mutex_lock(&lock_server);
+    trace_add(&trace, TRACE_OPEN, 0, 0, NULL, 0);
+    sockfd = fd;
+    server_in.off = server_in.len = 0;
+    greeted = 0;
+    err = server_hello(fd, PROTO_HELLO_MOVED) < 0 || server_write(move.held, move.held_len) < 0;
+    move.held_len = 0;
+    move.active = 0;
+    pthread_mutex_unlock(&lock_server);
+    if (err)
+        return -1;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    printf("Moved to another server of the cluster\n");
+    return 0;
+}
+
+// a server of a move that did not answer in time, or the pause before the next round is over
+int server_move_timers()
+{
+    if (!move.active || now_ms() < move.deadline)
+        return 0;
+    if (move.fd >= 0) {
+        close(move.fd);
+        move.fd = -1;
+    }
+    return server_move_next();
+}
 
-        bzero((char *) &serv_addr[i], sizeof(serv_addr[i]));
-        memset(&serv_addr[i], 0, sizeof(serv_addr[i]));
-        serv_addr[i].sin_family = AF_INET;
-        serv_addr[i].sin_port = htons(ports[i]);
-        serv_addr[i].sin_addr.s_addr = inet_addr("127.0.0.1");
+// milliseconds until server_move_timers has something to do, -1 if we are not moving
+int server_move_timeout()
+{   long long now = now_ms();
 
-        pthread_mutex_lock(&lock); //-->Total order multicast chat
-        sendto(sockfd[i], (const char *)mess, SIZE-1, 
-            MSG_CONFIRM, (const struct sockaddr *) &serv_addr[i],
-                sizeof(serv_addr[i]));
-        pthread_mutex_unlock(&lock);
+    if (!move.active)
+        return -1;
+    return move.deadline > now ? (int) (move.deadline - now) : 0;
+}
+
+// writes whole frames to the server, called with lock_server held; -1 when it is gone
+int server_write(const char *frame, int len)
+{   int n;
+
+    while (len > 0) {
+        n = write(sockfd, frame, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN) { // a big snapshot report, wait for room
+            struct pollfd pfd = { sockfd, POLLOUT, 0 };
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (n < 0)
+            return -1;
+        frame += n;
+        len -= n;
     }
+    return 0;
 }
 
-// function for peer server
-void* server_peer(void* args_ptr)
-{   int sock, clisockfd, n, i = 0, j = 0, len, r=0, ans_m[SIZE], critical=0;
-    char buffer[SIZE], cache[SIZE], answer[SIZE];
-    socklen_t clilen; /*for the accept*/
-    pthread_t thread_id;
-    
-    //connection for all peers
-    struct sockaddr_in serv_addr, cli_addr;
-    if ( (sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) { // UDP connection
-        perror("socket creation failed");
-        exit(EXIT_FAILURE);
+// writes a frame to the server, or holds it while we move to another one
+void send_server(const char *frame, int len)
+{   uint32_t cap;
+
+    pthread_mutex_lock(&lock_server); // whole frames, a relayed edit may come from sender_thread
+    trace_add(&trace, TRACE_OUT, 0, 0, frame, len);
+    if (move.active) {
+        if (move.held_len + len > move.held_cap) {
+            cap = move.held_cap ? move.held_cap : 4096;
+            while (cap < move.held_len + len)
+                cap *= 2;
+            move.held = realloc(move.held, cap);
+            if (move.held == NULL) {
+                perror("Error on allocating frames for the server");
+                exit(1);
+            }
+            move.held_cap = cap;
+        }
+        memcpy(move.held + move.held_len, frame, len);
+        move.held_len += len;
     }
+    else if (server_write(frame, len) < 0)
+        exit(0);
+    pthread_mutex_unlock(&lock_server);
+}
+
+// read messages from srever, returns -1 when the connection is lost
+int get_messages(int sock) {
+    int n;
+    char *end;
+    struct proto_frame f;
     
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    memset(&cli_addr, 0, sizeof(cli_addr));
-      
-    // Filling server information
-    serv_addr.sin_family    = AF_INET; // IPv4
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(serv_port);
-      
-    // Bind the socket with the server address
-    if ( bind(sock, (const struct sockaddr *)&serv_addr, 
-            sizeof(serv_addr)) < 0 )
-    {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
+    while(1) {
+        /* read message into the buffer of the server stream*/
+        if (proto_reserve(&server_in, SIZE*4) < 0)
+            return -1;
+        n = recv(sock, server_in.buf + server_in.len, server_in.cap - server_in.len, 0); /* socket is ready, no spinning */
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        trace_add(&trace, TRACE_IN, 0, 0, server_in.buf + server_in.len, n);
+        server_in.len += n;
+
+        if (!greeted) { // the welcome line comes as text
+            end = memchr(server_in.buf, '\n', server_in.len);
+            if (end == NULL)
+                continue;
+            *end = '\0';
+            printf("\n-%s \n", server_in.buf);
+            server_in.off = end - server_in.buf + 1;
+            greeted = 1;
+        }
+        while (redirect_to.sin_port == 0 && (n = proto_next(&server_in, &f)) == 1)
+            server_frame(&f);
+        if (redirect_to.sin_port != 0) // the rest of this connection does not matter
+            return 1;
+        if (n < 0) {
+            printf("Bad frame from server\n");
+            return -1;
+        }
     }
-    clilen = sizeof(cli_addr);
-    // mutex initialization
-    if (pthread_mutex_init(&lock, NULL) < 0){
-        perror("Error on initializing mutex");
-        exit(1);
+}
+
+// one frame of the server: text to print or the list of active peers
+void server_frame(struct proto_frame *f)
+{   int i;
+    uint32_t count;
+    char buffer[SIZE*2];
+    struct proto_in in;
+
+    proto_init_in(&in, f);
+    if (f->kind == PROTO_TEXT) {
+        proto_get_cstr(&in, buffer, sizeof(buffer));
+        printf("\n-%s \n", buffer);
+        if(strcmp(buffer,"You have been disconnected") == 0){
+            DB_dump();
+            search_save();
+            exit(0);
+        }
     }
-  
-    len = sizeof(cli_addr);  
-    bzero(cache, SIZE);
-    while(1) {
-        /* read message into buffer*/
-        bzero(buffer, SIZE);
-        n = recvfrom(sock, (char *)buffer, SIZE-1, 
-                MSG_DONTWAIT, ( struct sockaddr *) &cli_addr,
-                &len); // non blocking receive
-        
-        len = strlen(buffer);
-        buffer[n] = '\0';
-        // read only new messages
-        if (len > 0 && strcmp(buffer, cache) != 0) {
-            strtok(buffer, "-");
-            char* edit_c = strtok(NULL, "-"); 
-            
-            if(edit_c != NULL){
-                edit_port = atoi(edit_c); // port of peer that requests to edit
-                if(serv_port!=edit_port)
-                    printf("Type /ABORT or /GO:\n"); //this message is printed only to those who dont request to edit this message
-            }
-            else if((strcmp(buffer,"/ABORT") == 0)||(strcmp(buffer,"/GO") == 0)){
-                k = k+1; // #of replies to edit request
-                if(strcmp(buffer,"/ABORT") == 0){
-                    ans_m[k-1] = 1;
-                }
-                else if(strcmp(buffer,"/GO") == 0){
-                    ans_m[k-1] = 0;
-                     
-                }
-                critical = 0;
-                if(k==number_of_users-3){ // check if we got replies from all users
-                    for(r=0;r<k;r++){ // we run the whole array of ans_m for /ABORT messages
-                        if(ans_m[r] == 1){
-                            critical = 1; //ABORTING
-                        }
-                    }
-                    edit_wrapper(critical);
-                }
+    else if (f->kind == PROTO_PEER_LIST) { // all the members, after our PROTO_HELLO or a /list
+        int old_ports[MAX_PEERS], old_users = number_of_users, j, port;
+        uint32_t addr;
+        uint64_t old_ts[MAX_PEERS];
+
+        memcpy(old_ports, ports, sizeof(ports));
+        memcpy(old_ts, peer_ts, sizeof(peer_ts));
+        epoch = proto_get_u32(&in);
+        count = proto_get_u32(&in);
+        printf("\n-Peers: ");
+        number_of_users = 0;
+        for (i = 0; i < (int) count && number_of_users < MAX_PEERS; i++) {
+            id = proto_get_u32(&in);
+            port = proto_get_u16(&in);
+            addr = proto_get_u32(&in);
+            if (in.err)
+                break;
+            ports[number_of_users] = port;
+            addrs[number_of_users] = htonl(addr);
+            set_departed(port, 0);
+            peer_ts[number_of_users] = 0; // the newest TS of a peer stays with its port
+            for (j = 0; j < old_users; j++) {
+                if (old_ports[j] == ports[number_of_users])
+                    peer_ts[number_of_users] = old_ts[j];
             }
-            else{
-                // the new messages of the chat
-                printf("\n-%s \n", buffer);
-                if(key>0){ // if one or more messages are received write it to DB
-                    update();
-                }
-                pthread_mutex_lock(&lock_edit);
-                // key lock for editing 
-                strcpy(DB[key], buffer); // edit
-                key = key +1;
-                pthread_mutex_unlock(&lock_edit);
-
-                DB_write();
-                
-                if(strcmp(buffer,"You have been disconnected") == 0){
-                        exit(0);
-                }
+            number_of_users++;
+            printf("%d ", id);
+        }
+        printf("\n");
+        pthread_mutex_lock(&lock);
+        for (j = 0; j < old_users; j++) { // the channels of the peers that left
+            for (i = 0; i < number_of_users && ports[i] != old_ports[j]; i++)
+                ;
+            if (i == number_of_users) {
+                rel_forget(old_ports[j]);
+                set_departed(old_ports[j], 1);
             }
-            bzero(cache, SIZE);
+        }
+        pthread_mutex_unlock(&lock);
+        build_destinations();
+        xfer_join(); // on the first list: the DB of the members, if there are any
+        deliver(); // a peer that left may have been holding messages back
+    }
+    else if (f->kind == PROTO_MEMBER) { // a peer joined or left
+        uint32_t member_epoch = proto_get_u32(&in);
+        int op = proto_get_u8(&in);
+        int member_id = proto_get_u32(&in);
+        int port = proto_get_u16(&in);
+        uint32_t addr = proto_get_u32(&in);
+        if (!in.err)
+            member_delta(member_epoch, op, member_id, port, htonl(addr));
+    }
+    else if (f->kind == PROTO_MARKER) { // the server starts a snapshot
+        int port = proto_get_u16(&in);
+        uint32_t snap_id = proto_get_u32(&in);
+        int full = proto_get_u8(&in);
+        uint32_t last_complete = proto_get_u32(&in);
+        if (!in.err)
+            snapshot_marker(port, snap_id, full, last_complete);
+    }
+    else if (f->kind == PROTO_SYNC) {
+        sync_frame(f);
+    }
+    else if (f->kind == PROTO_SYNC_DONE) {
+        uint32_t snap_id = proto_get_u32(&in);
+        count = proto_get_u32(&in);
+        if (count > 0)
+            printf("Resynced %u entries from snapshot %u, %d entries\n", count, snap_id, key);
+    }
+    else if (f->kind == PROTO_REDIRECT) { // another server of the cluster has our part of the ring
+        uint32_t addr = proto_get_u32(&in);
+        int port = proto_get_u16(&in);
+        if (!in.err) {
+            redirect_to.sin_family = AF_INET;
+            redirect_to.sin_addr.s_addr = htonl(addr);
+            redirect_to.sin_port = htons(port);
         }
     }
-    close(sock);
+    else // chat, acks and edits of a peer with -f relay, passed on by the server
+        peer_frame(f);
 }
 
-// sending to server the local state i order to create global consistent states
-void consistent(char* message, char* entry, int option){
-    char command[SIZE];
-    int n=0;
-    
-    bzero(sec, SIZE); // sec --> TS in str
-    bzero(serv_message, SIZE);
-    bzero(command, SIZE);
-    if(option==1){
-        command[0]='/'; command[1]='m';command[2]='s';command[3]='g';command[4]= ' '; // command = /msg
+// applies a membership delta of the server to ports[], addrs[] and the destinations
+void member_delta(uint32_t member_epoch, int op, int member_id, int port, uint32_t addr)
+{   int i;
+    char frame[SIZE*2];
+    struct proto_out o;
+
+    if (member_epoch != epoch + 1) { // a delta was missed, ask for the whole list
+        proto_init_out(&o, frame, sizeof(frame));
+        proto_begin(&o, PROTO_COMMAND, 0);
+        proto_put_str(&o, "/list", 5);
+        if (proto_end(&o) >= 0)
+            send_server(o.buf, o.len);
+        return;
     }
-    else if(option==2){
-        command[0]='/'; command[1]='e';command[2]='d';command[3]='i';command[4]= 't'; command[5]=' ';// command = /edit
+    epoch = member_epoch;
+    for (i = 0; i < number_of_users; i++) {
+        if (ports[i] == port)
+            break;
     }
-    
-    sprintf(sec, "%d", time(NULL)); // TS
-    strcpy(serv_message, message);
-    strcat(serv_message, " | ");
-    strcat(serv_message, sec);
-    strcat(command, serv_message);
-    strcat(command, " | ");
-    strcat(command, entry);
-    n = write(sockfd, command, strlen(command)); // we write the message we received to server with its TS
-    if (n<0)
-        exit(0);
+    if (op == PROTO_JOIN && i == number_of_users && number_of_users < MAX_PEERS) {
+        ports[number_of_users] = port;
+        addrs[number_of_users] = addr;
+        set_departed(port, 0);
+        /* the messages held back now were sent before it joined and it will not ack them,
+           the ack below moves its clock past ours before it sends anything */
+        peer_ts[number_of_users] = lamport;
+        number_of_users++;
+        build_destinations();
+        send_ack(PROTO_ACK_JOIN); // the chat it gets starts after this TS, the rest is in the DB it asks for
+        printf("\n-%d joined \n", member_id);
+    }
+    else if (op == PROTO_LEAVE && i < number_of_users) {
+        pthread_mutex_lock(&lock);
+        rel_forget(port); // nothing in flight to it will be acked
+        set_departed(port, 1);
+        pthread_mutex_unlock(&lock);
+        number_of_users--;
+        ports[i] = ports[number_of_users];
+        addrs[i] = addrs[number_of_users];
+        peer_ts[i] = peer_ts[number_of_users];
+        build_destinations();
+        printf("\n-%d left \n", member_id);
+        deliver(); // it may have been holding messages back
+    }
+}
+
+// signal handler for exit
+void signal_handler(int signum){
+    printf("\nType /exit in order to disconnect. \n");
+    return;
+}
+
+// writes the rest of the trace (-T) when the peer exits
+void trace_end()
+{   trace_close(&trace);
+}
+
+// removes our shared memory (-M) when the peer exits
+void shm_end()
+{   shm_remove(serv_port);
+}
+
+// writes the rest of the hops (-L) when the peer exits
+void hops_end()
+{   hop_close(&hops);
+    if (hops.dropped > 0)
+        fprintf(stderr, "%llu hops dropped, the rings were full\n", (unsigned long long) hops.dropped);
+}
+
+
+// chat wrapper function: the sender thread multicasts a copy of the frame, -1 when the queue refused it
+int chat(const char *frame, int len, int policy)
+{
+    return send_post(0, frame, len, policy);
+}
+
+// sends a chat message to all peers, stamped with the Lamport clock
+void send_chat(char *message)
+{   char frame[SIZE*2];
+    struct proto_out o;
+
+    lamport++;
+    proto_init_out(&o, frame, sizeof(frame));
+    proto_begin(&o, PROTO_CHAT, 0);
+    proto_put_u16(&o, serv_port);
+    proto_put_u64(&o, lamport);
+    proto_put_str(&o, message, strlen(message));
+    if (proto_end(&o) < 0)
+        return;
+    if (input_typed != 0)
+        hop_record(&hops, HOP_TYPED, hop_id(serv_port, lamport), input_typed);
+    hop_record(&hops, HOP_PARSED, hop_id(serv_port, lamport), 0);
+    holdback_push(lamport, serv_port, message); // our own copy waits like the others
+    metric_add(&metrics[M_CHAT_SENT], 1);
+    hop_record(&hops, HOP_SENT, hop_id(serv_port, lamport), 0); // before the syscall, a receiver may be faster than its return
+    batch_multicast(o.buf, o.len); // from the event loop like the acks, so every peer gets them in order
+    deliver(); // alone in the chat nobody else has to ack it
+}
+
+/* ---------- Total Order Multicast ----------
+Every chat message carries the Lamport clock of its sender and the port breaks ties.
+A received message waits in the hold-back queue and every peer answers it with a PROTO_ACK
+carrying its own clock. Chat messages and acks are both sent by the event loop, so the messages
+of one peer arrive in the order it sent them. The head of the queue (smallest TS, port) is written to the DB only
+when every other peer has sent something newer, so no message with a smaller TS can still come
+and all the peers write the same entries in the same order. */
+
+// (ts, port) pairs in the total order
+int holdback_before(uint64_t ts, int port, uint64_t ts2, int port2)
+{
+    return ts < ts2 || (ts == ts2 && port < port2);
+}
+
+void holdback_push(uint64_t ts, int port, const char *text)
+{   int i, parent;
+    struct held_msg m;
+
+    if (holdback.n == holdback.cap) {
+        holdback.cap = holdback.cap ? holdback.cap * 2 : 64;
+        holdback.heap = realloc(holdback.heap, holdback.cap * sizeof(*holdback.heap));
+        if (holdback.heap == NULL){
+            perror("Error on allocating hold-back queue");
+            exit(1);
+        }
+    }
+    m.ts = ts;
+    m.port = port;
+    m.text = strdup(text);
+    m.since = metric_now_ns();
+    metric_add(&metrics[M_HOLDBACK], 1);
+    i = holdback.n++;
+    while (i > 0) { // min-heap on (ts, port)
+        parent = (i - 1) / 2;
+        if (!holdback_before(m.ts, m.port, holdback.heap[parent].ts, holdback.heap[parent].port))
+            break;
+        holdback.heap[i] = holdback.heap[parent];
+        i = parent;
+    }
+    holdback.heap[i] = m;
+}
+
+void holdback_pop()
+{   int i = 0, child;
+    struct held_msg last = holdback.heap[--holdback.n];
+
+    while ((child = 2 * i + 1) < holdback.n) {
+        if (child + 1 < holdback.n && holdback_before(holdback.heap[child+1].ts, holdback.heap[child+1].port,
+                                                      holdback.heap[child].ts, holdback.heap[child].port))
+            child++;
+        if (!holdback_before(holdback.heap[child].ts, holdback.heap[child].port, last.ts, last.port))
+            break;
+        holdback.heap[i] = holdback.heap[child];
+        i = child;
+    }
+    holdback.heap[i] = last;
+}
+
+// remembers the newest TS of a peer and moves our clock past it
+void clock_seen(int port, uint64_t ts)
+{   int i;
+
+    if (ts > lamport)
+        lamport = ts;
+    lamport++;
+    for (i = 0; i < number_of_users; i++) {
+        if (ports[i] == port && ts > peer_ts[i])
+            peer_ts[i] = ts;
+    }
+}
+
+// 1 when no peer can send a message before the head of the hold-back queue any more
+int holdback_ready()
+{   int i;
+    struct held_msg *m = &holdback.heap[0];
+
+    for (i = 0; i < number_of_users; i++) {
+        if (ports[i] == serv_port)
+            continue;
+        if (holdback_before(peer_ts[i], ports[i], m->ts, m->port)) // may still send an older message
+            return 0;
+    }
+    return 1;
+}
+
+// writes to the DB the messages that can not be preceded any more, all of them with one writev
+void deliver()
+{   int i, n = 0;
+    struct held_msg *m;
+    char *texts[DELIVER_BATCH];
+    uint64_t ids[DELIVER_BATCH];
+
+    if (xfer.state == XFER_ACKS || xfer.state == XFER_STREAM) // they go after the DB of the donor
+        return;
+    while (holdback.n > 0 && holdback_ready()) {
+        m = &holdback.heap[0];
+        printf("\n-%s \n", m->text);
+        delivered_ts = m->ts;
+        delivered_port = m->port;
+        ids[n] = hop_id(m->port, m->ts);
+        texts[n++] = m->text;
+        metric_add(&metrics[M_CHAT_DELIVERED], 1);
+        metric_add(&metrics[M_HOLDBACK], -1);
+        metric_observe(&metrics[M_HOLDBACK_TIME], metric_now_ns() - m->since);
+        holdback_pop();
+        if (n == DELIVER_BATCH || holdback.n == 0 || !holdback_ready()) {
+            DB_write_batch(texts, n); // appended to the log, key = key + n
+            for (i = 0; i < n; i++) {
+                hop_record(&hops, HOP_DELIVERED, ids[i], 0);
+                free(texts[i]);
+            }
+            n = 0;
+        }
+    }
+}
+
+// tells all peers that our clock has passed a message
+void send_ack(int flags)
+{   char frame[SIZE];
+    struct proto_out o;
+
+    proto_init_out(&o, frame, sizeof(frame));
+    proto_begin(&o, PROTO_ACK, flags);
+    proto_put_u16(&o, serv_port);
+    proto_put_u64(&o, lamport);
+    if (proto_end(&o) >= 0)
+        batch_multicast(o.buf, o.len);
+    metric_add(&metrics[M_ACKS_SENT], 1);
+}
+
+/* ---------- 2 PC (edit) ----------
+Every edit is a transaction with its own id (port << 32 | counter) and its own vote table, so many
+edits can be open at the same time. The coordinator multicasts PROTO_EDIT_REQ to all the peers
+(itself too), every peer locks the entry for the transaction and votes. An entry that is locked by
+another transaction, or that does not exist, gets an /ABORT at once, so edits on different entries
+go on in parallel and edits on the same entry do not wait for each other. The coordinator multicasts
+PROTO_EDIT_COMMIT when all voted /GO and PROTO_EDIT_ABORT on the first /ABORT or when the votes did
+not come in time. A participant that never hears the decision unlocks the entry after twice the
+vote timeout. The vote of a participant is decided by vote_policy: ask the user (/GO or /ABORT),
+always /GO or always /ABORT. */
+
+long long now_ms()
+{   struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// transaction that holds the lock of an entry, 0 if it is free
+uint64_t entry_owner(int entry)
+{   struct entry_lock *l;
+
+    for (l = entry_locks[entry & (LOCK_BUCKETS-1)]; l != NULL; l = l->next) {
+        if (l->entry == entry)
+            return l->txn;
+    }
+    return 0;
+}
+
+// locks an entry for a transaction, returns -1 if another one holds it
+int entry_lock(int entry, uint64_t txn)
+{   struct entry_lock *l;
+    uint64_t owner = entry_owner(entry);
+
+    if (owner != 0)
+        return owner == txn ? 0 : -1;
+    l = malloc(sizeof(*l));
+    if (l == NULL)
+        return -1;
+    l->entry = entry;
+    l->txn = txn;
+    l->next = entry_locks[entry & (LOCK_BUCKETS-1)];
+    entry_locks[entry & (LOCK_BUCKETS-1)] = l;
+    return 0;
+}
+
+void entry_unlock(int entry, uint64_t txn)
+{   struct entry_lock **p, *l;
+
+    for (p = &entry_locks[entry & (LOCK_BUCKETS-1)]; (l = *p) != NULL; p = &l->next) {
+        if (l->entry == entry && l->txn == txn) {
+            *p = l->next;
+            free(l);
+            return;
+        }
+    }
+}
+
+// the transactions we coordinate and the ones we take part in are kept in two lists
+struct txn *txn_find(struct txn *list, uint64_t id)
+{
+    for (; list != NULL; list = list->next) {
+        if (list->id == id)
+            return list;
+    }
+    return NULL;
+}
+
+void txn_remove(struct txn **list, struct txn *t)
+{   struct txn **p;
+
+    for (p = list; *p != NULL; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            free(t);
+            return;
+        }
+    }
+}
+
+// edit wrapper function, message = new text - number of entry
+void edit_DB_entry(char message[SIZE])
+{   char frame[SIZE*2], *dash;
+    int n;
+    struct txn *t;
+    struct proto_out o;
+
+    dash = strrchr(message, '-'); // the text itself may contain '-'
+    if (dash == NULL) {
+        printf("Usage: /edit (message) - (number of entry)\n");
+        return;
+    }
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return;
+    t->entry = atoi(dash + 1);
+    *dash = '\0';
+    n = strlen(message);
+    while (n > 0 && message[n-1] == ' ')
+        message[--n] = '\0';
+    strcpy(t->text, message);
+    t->id = ((uint64_t) serv_port << 32) | ++txn_counter;
+    t->port = serv_port;
+    t->votes_needed = number_of_users; // every peer votes, this one too
+    t->start = now_ms();
+    t->deadline = t->start + vote_timeout;
+    t->next = coordinated;
+    coordinated = t;
+
+    proto_init_out(&o, frame, sizeof(frame));
+    proto_begin(&o, PROTO_EDIT_REQ, 0);
+    proto_put_u16(&o, serv_port);
+    proto_put_u64(&o, t->id);
+    proto_put_u32(&o, t->entry);
+    proto_put_str(&o, t->text, strlen(t->text));
+    if (proto_end(&o) < 0 || chat(o.buf, o.len, send_policy) < 0) {
+        printf("Send queue full, edit not started\n");
+        txn_remove(&coordinated, t);
+        return;
+    }
+    printf("Edit %llx of entry %d started\n", (unsigned long long) t->id, t->entry);
+}
+
+// sends /GO or /ABORT to the peer that coordinates a transaction
+void send_vote(struct txn *t, int vote)
+{   char frame[SIZE];
+    struct proto_out o;
+
+    proto_init_out(&o, frame, sizeof(frame));
+    proto_begin(&o, PROTO_VOTE, 0);
+    proto_put_u16(&o, serv_port);
+    proto_put_u64(&o, t->id);
+    proto_put_u8(&o, vote);
+    if (proto_end(&o) < 0)
+        return;
+    if (send_post(t->port, o.buf, o.len, send_policy) < 0) { // the coordinator times out, or the user votes again
+        printf("Send queue full, vote for %llx not sent\n", (unsigned long long) t->id);
+        return;
+    }
+    t->voted = 1;
+    metric_add(&metrics[vote == PROTO_GO ? M_VOTES_GO : M_VOTES_ABORT], 1);
+    if (vote == PROTO_ABORT) // no need to keep the entry for a transaction we refused
+        entry_unlock(t->entry, t->id);
+}
+
+// /GO or /ABORT typed by the user, for one transaction or the oldest one waiting
+void vote_command(char *message, int vote)
+{   struct txn *t, *oldest = NULL;
+    uint64_t id = strtoull(message, NULL, 16);
+
+    for (t = participating; t != NULL; t = t->next) {
+        if (t->voted)
+            continue;
+        if (id != 0 && t->id == id)
+            break;
+        if (id == 0 && (oldest == NULL || t->start < oldest->start))
+            oldest = t;
+    }
+    if (t == NULL)
+        t = oldest;
+    if (t == NULL) {
+        printf("No edit is waiting for your vote\n");
+        return;
+    }
+    send_vote(t, vote);
+}
+
+// /policy manual|auto|deny
+void set_policy(char *name)
+{
+    if (strncmp(name, "auto", 4) == 0)
+        vote_policy = policy_auto;
+    else if (strncmp(name, "deny", 4) == 0)
+        vote_policy = policy_deny;
+    else if (strncmp(name, "manual", 6) == 0)
+        vote_policy = policy_manual;
+    else
+        printf("Policies: manual, auto, deny\n");
+}
+
+// votes of the policies: ask the user, always /GO, always /ABORT
+int policy_manual(struct txn *t)
+{
+    printf("%d requests to edit entry %d: %s\nType /ABORT or /GO (%llx):\n", t->port, t->entry, t->text,
+           (unsigned long long) t->id); //this message is printed only to those who dont request to edit this message
+    return VOTE_ASK;
+}
+
+int policy_auto(struct txn *t)
+{
+    return PROTO_GO;
+}
+
+int policy_deny(struct txn *t)
+{
+    return PROTO_ABORT;
+}
+
+// a peer asks us to prepare an edit
+void edit_prepare(int port, uint64_t id, int entry, char *message)
+{   struct txn *t;
+    int vote;
+
+    if (txn_find(participating, id) != NULL) // a copy of the request
+        return;
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return;
+    t->id = id;
+    t->port = port;
+    t->entry = entry;
+    strcpy(t->text, message);
+    t->start = now_ms();
+    t->deadline = t->start + 2 * vote_timeout; // presumed abort if the decision never comes
+    t->next = participating;
+    participating = t;
+
+    /* key lock for entry */
+    if (entry < 0 || entry >= key || entry_lock(entry, id) < 0)
+        vote = PROTO_ABORT;
+    else if (port == serv_port) // the coordinator agrees with its own edit
+        vote = PROTO_GO;
+    else
+        vote = vote_policy(t);
+    if (vote != VOTE_ASK)
+        send_vote(t, vote);
+}
+
+// a vote for a transaction we coordinate
+void edit_vote(int port, uint64_t id, int vote)
+{   struct txn *t = txn_find(coordinated, id);
+    int i;
+
+    if (t == NULL || t->decided)
+        return;
+    for (i = 0; i < t->votes; i++) {
+        if (t->voters[i] == port) // a copy of the vote
+            return;
+    }
+    if (t->votes < MAX_PEERS)
+        t->voters[t->votes++] = port;
+    if (vote == PROTO_ABORT)
+        edit_decide(t, PROTO_ABORT);
+    else if (t->votes >= t->votes_needed) // check if we got /GO from all users
+        edit_decide(t, PROTO_GO);
+}
+
+// multicasts the decision of a transaction we coordinate
+void edit_decide(struct txn *t, int decision)
+{   char frame[SIZE*2];
+    struct proto_out o;
+
+    t->decided = 1;
+    proto_init_out(&o, frame, sizeof(frame));
+    if (decision == PROTO_GO) {
+        /* every peer writes the new version of the entry in its own DB */
+        proto_begin(&o, PROTO_EDIT_COMMIT, 0);
+        proto_put_u16(&o, serv_port);
+        proto_put_u64(&o, t->id);
+        proto_put_u32(&o, t->entry);
+        proto_put_str(&o, t->text, strlen(t->text));
+        edits_committed++;
+        metric_add(&metrics[M_EDITS_COMMITTED], 1);
+        if (first_commit == 0)
+            first_commit = t->start;
+        printf("Edit %llx committed in %lld ms\n", (unsigned long long) t->id, now_ms() - t->start);
+        consistent(t->text, t->entry, 2);
+    }
+    else {
+        proto_begin(&o, PROTO_EDIT_ABORT, 0);
+        proto_put_u16(&o, serv_port);
+        proto_put_u64(&o, t->id);
+        edits_aborted++;
+        metric_add(&metrics[M_EDITS_ABORTED], 1);
+        printf("Edit Aborted\n"); // /ABORT
+    }
+    if (proto_end(&o) >= 0)
+        chat(o.buf, o.len, SEND_BLOCK); // a decision is never dropped, the participants hold the entry for it
+    txn_remove(&coordinated, t);
+}
+
+// the decision of the coordinator
+void edit_finish(int port, uint64_t id, int decision, int entry, char *message)
+{   struct txn *t = txn_find(participating, id);
+
+    if (decision == PROTO_GO) {
+        DB_write_edit(entry, message); // new version of the entry
+        printf("Entry %d edited by %d: %s\n", entry, port, message);
+    }
+    if (t != NULL) {
+        entry_unlock(t->entry, t->id);
+        txn_remove(&participating, t);
+    }
+}
+
+// aborts the transactions whose votes or decision did not come in time
+void edit_timers()
+{   struct txn *t, *next;
+    long long now = now_ms();
+
+    for (t = coordinated; t != NULL; t = next) {
+        next = t->next;
+        if (now >= t->deadline) {
+            printf("Edit %llx timed out waiting for votes\n", (unsigned long long) t->id);
+            edit_decide(t, PROTO_ABORT);
+        }
+    }
+    for (t = participating; t != NULL; t = next) {
+        next = t->next;
+        if (now >= t->deadline) {
+            entry_unlock(t->entry, t->id);
+            txn_remove(&participating, t);
+        }
+    }
+}
+
+// milliseconds until the next deadline of a transaction, -1 if there is none
+int edit_next_timeout()
+{   struct txn *t;
+    long long next = -1, now = now_ms();
+
+    for (t = coordinated; t != NULL; t = t->next) {
+        if (next < 0 || t->deadline < next)
+            next = t->deadline;
+    }
+    for (t = participating; t != NULL; t = t->next) {
+        if (next < 0 || t->deadline < next)
+            next = t->deadline;
+    }
+    if (next < 0)
+        return -1;
+    return next > now ? (int) (next - now) : 0;
+}
+
+// /txn: open transactions and committed edits/sec
+void txn_status()
+{   struct txn *t;
+    double seconds = (now_ms() - first_commit) / 1000.0;
+
+    for (t = coordinated; t != NULL; t = t->next)
+        printf("coordinator %llx entry %d votes %d/%d\n", (unsigned long long) t->id, t->entry, t->votes, t->votes_needed);
+    for (t = participating; t != NULL; t = t->next)
+        printf("participant %llx entry %d from %d %s\n", (unsigned long long) t->id, t->entry, t->port,
+               t->voted ? "voted" : "waiting for /GO or /ABORT");
+    printf("edits committed: %ld aborted: %ld committed edits/sec: %.1f\n", edits_committed, edits_aborted,
+           first_commit && seconds > 0 ? edits_committed / seconds : 0.0);
+}
+
+/* ---------- snapshots (Chandy-Lamport) ----------
+The first marker of a snapshot (from the server or from a peer) makes this peer send its DB to the
+server at once (only the entries changed since its last report, unless the server does not have that
+report) and multicast the marker to the other peers. From then on the chat messages of a peer are
+recorded until the marker of that peer comes: they were on the way when the state was taken. The
+messages in the hold-back queue and the recorded ones go to the server in PROTO_SNAP_CHANNEL,
+which ends the report. A peer whose marker never comes is given up after SNAP_WAIT ms. */
+
+// sends the entries of the DB to the server, in frames of about SNAP_CHUNK bytes
+void snapshot_state(int full)
+{   char *frame, *text;
+    struct proto_out o;
+    struct db_location loc;
+    uint32_t entry, count = 0, pos = 0, n;
+    int len, first = 1;
+
+    frame = malloc(SNAP_CHUNK + SIZE*2);
+    text = malloc(0x10000);
+    if (frame == NULL || text == NULL){
+        perror("Error on allocating snapshot");
+        exit(1);
+    }
+    pthread_mutex_lock(&lock_db);
+    for (entry = 0; entry <= (uint32_t) key; entry++) {
+        if (count == 0 && (first || entry < (uint32_t) key)) { // a new frame
+            proto_init_out(&o, frame, SNAP_CHUNK + SIZE*2);
+            proto_begin(&o, PROTO_SNAP_STATE, 0);
+            proto_put_u32(&o, snap.id);
+            proto_put_u8(&o, full && first); // the server starts the image of this peer again
+            proto_put_u64(&o, lamport);
+            proto_put_u32(&o, key);
+            pos = o.len;
+            proto_put_u32(&o, 0);
+        }
+        if (entry < (uint32_t) key) {
+            loc = db.index[entry];
+            if (loc.version == 0 || (!full && !loc.dirty))
+                continue;
+            len = pread(db.segments[loc.slot].fd, text, loc.len, loc.offset + sizeof(struct db_record));
+            if (len < 0)
+                continue;
+            db.index[entry].dirty = 0;
+            proto_put_u32(&o, entry);
+            proto_put_u32(&o, loc.version);
+            proto_put_str(&o, text, len);
+            count++;
+            if (o.len < SNAP_CHUNK)
+                continue;
+        }
+        else if (count == 0 && !first)
+            break;
+        n = htonl(count);
+        memcpy(o.buf + pos, &n, 4);
+        if (proto_end(&o) >= 0)
+            send_server(o.buf, o.len);
+        count = 0;
+        first = 0;
+    }
+    pthread_mutex_unlock(&lock_db);
+    free(text);
+    free(frame);
+}
+
+// keeps a chat message that was in flight when the state was taken
+void snapshot_record(int port, uint64_t ts, const char *text)
+{
+    if (snap.nchannel == snap.channel_cap) {
+        snap.channel_cap = snap.channel_cap ? snap.channel_cap * 2 : 64;
+        snap.channel = realloc(snap.channel, snap.channel_cap * sizeof(*snap.channel));
+        if (snap.channel == NULL){
+            perror("Error on allocating snapshot");
+            exit(1);
+        }
+    }
+    snap.channel[snap.nchannel].port = port;
+    snap.channel[snap.nchannel].ts = ts;
+    snap.channel[snap.nchannel].text = strdup(text);
+    snap.nchannel++;
+}
+
+// a marker came from port (0 = the server)
+void snapshot_marker(int port, uint32_t snap_id, int full, uint32_t last_complete)
+{   char frame[SIZE];
+    struct proto_out o;
+    int i;
+
+    if (snap_id <= snap_reported && !(snap.active && snap.id == snap_id))
+        return; // an old snapshot
+    if (!snap.active || snap.id != snap_id) {
+        if (snap.active) // a newer one started, the old one was given up by the server
+            snapshot_finish();
+        snap.active = 1;
+        snap.id = snap_id;
+        snap.deadline = now_ms() + SNAP_WAIT;
+        snap.nwaiting = 0;
+        for (i = 0; i < number_of_users; i++) {
+            if (ports[i] != serv_port)
+                snap.waiting[snap.nwaiting++] = ports[i];
+        }
+        // the server has our last report only if it completed
+        snapshot_state(full || snap_reported != last_complete);
+        snap_reported = snap_id;
+        for (i = 0; i < holdback.n; i++)
+            snapshot_record(holdback.heap[i].port, holdback.heap[i].ts, holdback.heap[i].text);
+
+        proto_init_out(&o, frame, sizeof(frame));
+        proto_begin(&o, PROTO_MARKER, 0);
+        proto_put_u16(&o, serv_port);
+        proto_put_u32(&o, snap_id);
+        proto_put_u8(&o, full);
+        proto_put_u32(&o, last_complete);
+        batch_flush(); // the chat messages before the marker go out before it
+        if (proto_end(&o) >= 0)
+            multicast(o.buf, o.len); // after our chat messages, like them
+    }
+    for (i = 0; i < snap.nwaiting; i++) { // the channel of port is recorded
+        if (snap.waiting[i] == port)
+            snap.waiting[i] = snap.waiting[--snap.nwaiting];
+    }
+    if (snap.nwaiting == 0)
+        snapshot_finish();
+}
+
+// 1 while the messages of port are still recorded for the snapshot
+int snapshot_recording(int port)
+{   int i;
+
+    if (!snap.active)
+        return 0;
+    for (i = 0; i < snap.nwaiting; i++) {
+        if (snap.waiting[i] == port)
+            return 1;
+    }
+    return 0;
+}
+
+// sends the recorded messages, the end of the report of this peer
+void snapshot_finish()
+{   char *frame;
+    struct proto_out o;
+    int i, cap = SIZE + snap.nchannel * (SIZE + 16);
+
+    snap.active = 0;
+    frame = malloc(cap);
+    if (frame == NULL){
+        perror("Error on allocating snapshot");
+        exit(1);
+    }
+    proto_init_out(&o, frame, cap);
+    proto_begin(&o, PROTO_SNAP_CHANNEL, 0);
+    proto_put_u32(&o, snap.id);
+    proto_put_u32(&o, snap.nchannel);
+    for (i = 0; i < snap.nchannel; i++) {
+        proto_put_u16(&o, snap.channel[i].port);
+        proto_put_u64(&o, snap.channel[i].ts);
+        proto_put_str(&o, snap.channel[i].text, strlen(snap.channel[i].text));
+        free(snap.channel[i].text);
+    }
+    if (proto_end(&o) >= 0)
+        send_server(o.buf, o.len);
+    free(frame);
+    if (snap.nwaiting > 0)
+        printf("Snapshot %u: no marker from %d peers\n", snap.id, snap.nwaiting);
+    snap.nchannel = 0;
+}
+
+// milliseconds until the markers are given up, -1 if no snapshot
+int snapshot_next_timeout()
+{   long long now = now_ms();
+
+    if (!snap.active)
+        return -1;
+    if (now >= snap.deadline)
+        snapshot_finish();
+    return snap.active ? (int) (snap.deadline - now) : -1;
+}
+
+// entries of the DB the server had in its checkpoints, after a restart without them
+void sync_frame(struct proto_frame *f)
+{   struct proto_in in;
+    uint64_t ts;
+    uint32_t n, i, entry, version, len;
+    const char *text;
+
+    proto_init_in(&in, f);
+    ts = proto_get_u64(&in);
+    if (ts > lamport)
+        lamport = ts;
+    n = proto_get_u32(&in);
+    for (i = 0; i < n && !in.err; i++) {
+        entry = proto_get_u32(&in);
+        version = proto_get_u32(&in);
+        text = proto_get_str(&in, &len);
+        if (text != NULL)
+            DB_apply(entry, version, text, len);
+    }
+}
+
+/* ---------- state transfer to a late joiner ----------
+Every member answers the join of a peer with an ack flagged PROTO_ACK_JOIN: the chat it sends from then
+on has a greater TS and reaches the joiner, the older chat does not. The joiner holds its chat back until
+it has the join acks of all the members (or XFER_WAIT ms passed), the greatest (TS, port) of them is
+the cut. It asks a member (the donor) for its DB over TCP, the port of the peer. The donor asks all the
+peers for an ack (PROTO_ACK_ASK) and waits until every clock is past the cut and it delivered all the
+chat up to it, then a thread streams the entries in XFER_CHUNK bytes, compressed with lz.h and with a
+crc32, and PROTO_XFER_DONE with the cut. The joiner writes the entries to its DB, drops the chat up to
+the cut (it is in the DB now) and delivers the rest. A donor that fails is replaced by the next member. */
+
+// TCP socket on the port of this peer, for the joiners that ask for the DB
+void xfer_listen()
+{   struct sockaddr_in addr;
+    int on = 1;
+
+    if ((xfer_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("Error on opening socket");
+        exit(1);
+    }
+    setsockopt(xfer_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = local_addr;
+    addr.sin_port = htons(serv_port);
+    if (bind(xfer_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(xfer_fd, 16) < 0) {
+        perror("Error on binding state transfer socket");
+        exit(1);
+    }
+    set_nonblocking(xfer_fd);
+}
+
+// writes all of buf to a joiner, -1 when it is gone
+int xfer_write(int fd, const char *buf, int len)
+{   int n;
+
+    while (len > 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// streams the entries below the cut of a joiner
+void xfer_stream(struct xfer_req *r)
+{   char *raw, *frame, *text;
+    struct proto_out o;
+    struct db_location loc;
+    uint32_t entry = 0, count, sent = 0, crc;
+    int len, cap = PROTO_HEADER + 12 + lz_bound(XFER_CHUNK + 0x10000);
+
+    raw = malloc(XFER_CHUNK + 0x10000);
+    frame = malloc(cap);
+    text = malloc(0x10000);
+    if (raw == NULL || frame == NULL || text == NULL){
+        perror("Error on allocating state transfer");
+        exit(1);
+    }
+    while (entry < r->key) {
+        proto_init_out(&o, raw, XFER_CHUNK + 0x10000);
+        count = 0;
+        pthread_mutex_lock(&lock_db); // a chunk at a time, the event loop writes in between
+        for (; entry < r->key && o.len < XFER_CHUNK; entry++) {
+            loc = db.index[entry];
+            if (loc.version == 0)
+                continue;
+            len = pread(db.segments[loc.slot].fd, text, loc.len, loc.offset + sizeof(struct db_record));
+            if (len < 0)
+                continue;
+            proto_put_u32(&o, entry);
+            proto_put_u32(&o, loc.version);
+            proto_put_str(&o, text, len);
+            count++;
+        }
+        pthread_mutex_unlock(&lock_db);
+        crc = crc32_update(0, raw, o.len);
+        len = o.len;
+        proto_init_out(&o, frame, cap);
+        proto_begin(&o, PROTO_XFER_CHUNK, 0);
+        proto_put_u32(&o, count);
+        proto_put_u32(&o, len);
+        proto_put_u32(&o, crc);
+        o.len += lz_compress(raw, len, frame + o.len);
+        if (proto_end(&o) < 0 || xfer_write(r->fd, o.buf, o.len) < 0)
+            break;
+        metric_add(&metrics[M_XFER_BYTES_OUT], o.len);
+        sent += count;
+    }
+    if (entry >= r->key) {
+        proto_init_out(&o, frame, cap);
+        proto_begin(&o, PROTO_XFER_DONE, 0);
+        proto_put_u64(&o, r->cut_ts);
+        proto_put_u16(&o, r->cut_port);
+        proto_put_u32(&o, r->key);
+        proto_put_u32(&o, sent);
+        if (proto_end(&o) >= 0 && xfer_write(r->fd, o.buf, o.len) == 0)
+            printf("DB sent to %d: %u entries\n", r->port, sent);
+    }
+    free(text);
+    free(frame);
+    free(raw);
+}
+
+// 1 when the joiner closed its connection (it sends nothing after its request)
+int xfer_hung_up(int fd)
+{   char c;
+    int n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// takes a request out of the list of the event loop, called with lock_xfer held
+void xfer_drop(struct xfer_req *r)
+{   struct xfer_req **pr;
+
+    for (pr = &xfer_requests; *pr != NULL && *pr != r; pr = &(*pr)->next)
+        ;
+    if (*pr == r)
+        *pr = r->next;
+}
+
+// one joiner: reads its request, waits for the event loop to fix the cut and streams the DB; gives up
+// when the joiner closes the connection, leaves the chat or waited XFER_SERVE_WAIT ms
+void *xfer_thread(void *arg)
+{   struct xfer_req *r;
+    struct proto_reader rd = { 0 };
+    struct proto_frame f;
+    struct proto_in in;
+    struct timespec until;
+    long long deadline = now_ms() + XFER_SERVE_WAIT;
+    int fd = (int) (intptr_t) arg, n = 0, ready;
+
+    while (n == 0) {
+        if (proto_reserve(&rd, 64) < 0)
+            break;
+        n = read(fd, rd.buf + rd.len, rd.cap - rd.len);
+        if (n <= 0) {
+            n = -1;
+            break;
+        }
+        rd.len += n;
+        n = proto_next(&rd, &f);
+    }
+    r = calloc(1, sizeof(*r));
+    if (n == 1 && f.kind == PROTO_XFER_REQ && r != NULL) {
+        proto_init_in(&in, &f);
+        r->fd = fd;
+        r->port = proto_get_u16(&in);
+        r->cut_ts = proto_get_u64(&in);
+        r->cut_port = proto_get_u16(&in);
+        r->ts = proto_get_u64(&in);
+        if (!in.err) {
+            pthread_mutex_lock(&lock_xfer);
+            r->next = xfer_requests;
+            xfer_requests = r;
+            pthread_mutex_unlock(&lock_xfer);
+            eventfd_write(event_fd, 1); // the event loop asks the clocks of the peers
+            pthread_mutex_lock(&lock_xfer);
+            while (!r->ready && !r->gone) {
+                if (now_ms() >= deadline || xfer_hung_up(fd)) {
+                    xfer_drop(r);
+                    break;
+                }
+                clock_gettime(CLOCK_REALTIME, &until); // a look at the connection every second
+                until.tv_sec++;
+                pthread_cond_timedwait(&xfer_cond, &lock_xfer, &until);
+            }
+            ready = r->ready;
+            pthread_mutex_unlock(&lock_xfer);
+            if (ready)
+                xfer_stream(r);
+            else
+                printf("DB for %d given up, it went away or its cut did not come\n", r->port);
+        }
+    }
+    free(rd.buf);
+    free(r);
+    close(fd);
+    return NULL;
+}
+
+// the joiners that connected, one thread each
+void xfer_accept()
+{   int fd;
+    pthread_t xfer_id;
+
+    while ((fd = accept(xfer_fd, NULL, NULL)) >= 0) {
+        if (pthread_create(&xfer_id, NULL, xfer_thread, (void *) (intptr_t) fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(xfer_id);
+    }
+}
+
+// 1 when the chat up to the cut of r is in our DB and no peer can send more of it
+int xfer_cut_ready(struct xfer_req *r)
+{   int i;
+
+    if (xfer.state == XFER_ACKS || xfer.state == XFER_STREAM) // our own DB is not complete yet
+        return 0;
+    for (i = 0; i < number_of_users; i++) {
+        if (ports[i] != serv_port && holdback_before(peer_ts[i], ports[i], r->cut_ts, r->cut_port))
+            return 0;
+    }
+    return holdback.n == 0 || holdback_before(r->cut_ts, r->cut_port, holdback.heap[0].ts, holdback.heap[0].port);
+}
+
+// event loop: asks the clocks for new requests and fixes the cut of those that are ready, drops the
+// joiners that left the chat
+void xfer_serve()
+{   struct xfer_req **pr, *r;
+    int ask = 0, wake = 0, i;
+
+    pthread_mutex_lock(&lock_xfer);
+    for (pr = &xfer_requests; (r = *pr) != NULL; ) {
+        for (i = 0; i < number_of_users && ports[i] != r->port; i++)
+            ;
+        if (i < number_of_users)
+            r->seen = 1;
+        else if (r->seen) { // it may ask before its join reached us, not after its leave
+            r->gone = 1;
+            wake = 1;
+            *pr = r->next;
+            continue;
+        }
+        if (!r->asked) {
+            r->asked = 1;
+            clock_seen(r->port, r->ts);
+            ask = 1;
+        }
+        if (!xfer_cut_ready(r)) {
+            pr = &r->next;
+            continue;
+        }
+        // what we delivered past the cut is in the DB too, the joiner drops it from its chat
+        if (holdback_before(r->cut_ts, r->cut_port, delivered_ts, delivered_port)) {
+            r->cut_ts = delivered_ts;
+            r->cut_port = delivered_port;
+        }
+        r->key = key;
+        r->ready = 1;
+        wake = 1;
+        *pr = r->next;
+    }
+    if (wake)
+        pthread_cond_broadcast(&xfer_cond);
+    pthread_mutex_unlock(&lock_xfer);
+    if (ask)
+        send_ack(PROTO_ACK_ASK);
+}
+
+// the first list of members came: a late joiner asks for the DB
+void xfer_join()
+{
+    if (xfer.started)
+        return;
+    xfer.started = 1;
+    if (number_of_users <= 1) // the first peer of the chat
+        return;
+    xfer.state = XFER_ACKS;
+    xfer.deadline = now_ms() + XFER_WAIT;
+    xfer.start = metric_now_ns();
+}
+
+// a member answered our join (it may come before the list of members)
+void xfer_join_ack(int port, uint64_t ts)
+{   int i;
+
+    for (i = 0; i < xfer.acks && xfer.ack_ports[i] != port; i++)
+        ;
+    if (i == MAX_PEERS)
+        return;
+    if (i == xfer.acks)
+        xfer.acks++;
+    xfer.ack_ports[i] = port;
+    xfer.ack_ts[i] = ts;
+}
+
+// 1 when a chat message is in the DB that came from the donor
+int xfer_covered(uint64_t ts, int port)
+{
+    return xfer.state == XFER_DONE && !holdback_before(xfer.cut_ts, xfer.cut_port, ts, port);
+}
+
+void xfer_close()
+{
+    if (xfer.fd >= 0)
+        close(xfer.fd); // and out of epoll
+    xfer.fd = -1;
+    xfer.connecting = 0;
+    xfer.in.off = xfer.in.len = 0;
+}
+
+// connects to the next member that was not tried, without blocking: the donor may be on another host
+// that does not answer, xfer_connected asks for the DB when the connection is up
+void xfer_ask()
+{   struct sockaddr_in addr;
+    struct epoll_event ev;
+    int i, j;
+
+    xfer_close();
+    for (i = 0; i < number_of_users; i++) {
+        for (j = 0; j < xfer.ntried && xfer.tried[j] != ports[i]; j++)
+            ;
+        if (ports[i] == serv_port || j < xfer.ntried)
+            continue;
+        xfer.tried[xfer.ntried++] = ports[i];
+        xfer.fd = socket(AF_INET, SOCK_STREAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(ports[i]);
+        addr.sin_addr.s_addr = addrs[i];
+        if (xfer.fd < 0 || set_nonblocking(xfer.fd) < 0
+            || (connect(xfer.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS)) {
+            xfer_close();
+            continue;
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT;
+        ev.data.fd = xfer.fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, xfer.fd, &ev);
+        xfer.connecting = 1;
+        xfer.deadline = now_ms() + XFER_CONNECT_WAIT;
+        xfer.donor = ports[i];
+        xfer.state = XFER_STREAM;
+        return;
+    }
+    printf("No member could send its DB, only the new chat is written\n");
+    xfer.state = XFER_IDLE;
+    deliver();
+}
+
+// the connection to the donor is up (or failed): the request, then its chunks
+void xfer_connected()
+{   struct proto_out o;
+    char frame[SIZE];
+    struct epoll_event ev;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(xfer.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        printf("No connection to %d, asking the next member\n", xfer.donor);
+        xfer_ask();
+        return;
+    }
+    xfer.connecting = 0;
+    proto_init_out(&o, frame, sizeof(frame));
+    proto_begin(&o, PROTO_XFER_REQ, 0);
+    proto_put_u16(&o, serv_port);
+    proto_put_u64(&o, xfer.cut_ts);
+    proto_put_u16(&o, xfer.cut_port);
+    proto_put_u64(&o, lamport);
+    if (proto_end(&o) < 0 || xfer_write(xfer.fd, o.buf, o.len) < 0) { // a new socket has room for it
+        xfer_ask();
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = xfer.fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, xfer.fd, &ev);
+}
+
+// the DB came: the chat up to the cut is in it, the rest is delivered from now on
+void xfer_install(uint64_t cut_ts, int cut_port, uint32_t count)
+{
+    xfer_close();
+    xfer.state = XFER_DONE;
+    xfer.cut_ts = cut_ts;
+    xfer.cut_port = cut_port;
+    if (cut_ts > lamport)
+        lamport = cut_ts;
+    while (holdback.n > 0 && xfer_covered(holdback.heap[0].ts, holdback.heap[0].port)) {
+        free(holdback.heap[0].text);
+        metric_add(&metrics[M_HOLDBACK], -1);
+        holdback_pop();
+    }
+    delivered_ts = cut_ts;
+    delivered_port = cut_port;
+    metric_observe(&metrics[M_XFER_TIME], metric_now_ns() - xfer.start);
+    printf("DB of %d installed: %u entries, %u KB in %.3f s\n", xfer.donor, count, xfer.bytes >> 10,
+           (metric_now_ns() - xfer.start) / 1e9);
+    deliver();
+}
+
+// the chunks of the donor, when its socket is ready
+void xfer_read()
+{   struct proto_frame f;
+    struct proto_in in;
+    char *raw;
+    uint32_t count, len, crc;
+    int n;
+
+    while (1) {
+        if (proto_reserve(&xfer.in, XFER_CHUNK) < 0)
+            break;
+        n = recv(xfer.fd, xfer.in.buf + xfer.in.len, xfer.in.cap - xfer.in.len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        xfer.in.len += n;
+        xfer.bytes += n;
+        metric_add(&metrics[M_XFER_BYTES_IN], n);
+        while ((n = proto_next(&xfer.in, &f)) == 1) {
+            proto_init_in(&in, &f);
+            if (f.kind == PROTO_XFER_CHUNK) {
+                count = proto_get_u32(&in);
+                len = proto_get_u32(&in);
+                crc = proto_get_u32(&in);
+                raw = malloc(len + 1);
+                if (in.err || raw == NULL || lz_decompress(in.p, in.left, raw, len) != (int) len
+                    || crc32_update(0, raw, len) != crc || DB_apply_chunk(raw, len) != (int) count) {
+                    free(raw);
+                    n = -1;
+                    break;
+                }
+                free(raw);
+                xfer.entries += count;
+            }
+            else if (f.kind == PROTO_XFER_DONE) {
+                uint64_t cut_ts = proto_get_u64(&in);
+                int cut_port = proto_get_u16(&in);
+                proto_get_u32(&in); // key, DB_apply_chunk moved ours there
+                count = proto_get_u32(&in);
+                if (in.err || count != xfer.entries) {
+                    n = -1;
+                    break;
+                }
+                xfer_install(cut_ts, cut_port, count);
+                return;
+            }
+        }
+        if (n < 0)
+            break;
+    }
+    printf("DB from %d failed after %u entries, asking the next member\n", xfer.donor, xfer.entries);
+    xfer.entries = 0;
+    xfer_ask();
+}
+
+// a late joiner: the cut once all the members acked our join (or did not in time), the next donor
+// when one does not take the connection in time
+void xfer_timers()
+{   int i, j, missing = 0;
+
+    if (xfer.connecting && now_ms() >= xfer.deadline) {
+        printf("No connection to %d in time, asking the next member\n", xfer.donor);
+        xfer_ask();
+        return;
+    }
+    if (xfer.state != XFER_ACKS)
+        return;
+    xfer.cut_ts = 0;
+    xfer.cut_port = 0;
+    for (i = 0; i < number_of_users; i++) {
+        if (ports[i] == serv_port)
+            continue;
+        for (j = 0; j < xfer.acks && xfer.ack_ports[j] != ports[i]; j++)
+            ;
+        if (j == xfer.acks) {
+            missing++;
+            continue;
+        }
+        if (xfer.ack_ts[j] > peer_ts[i]) // an ack that came before the list
+            peer_ts[i] = xfer.ack_ts[j];
+        if (holdback_before(xfer.cut_ts, xfer.cut_port, xfer.ack_ts[j], ports[i])) {
+            xfer.cut_ts = xfer.ack_ts[j];
+            xfer.cut_port = ports[i];
+        }
+    }
+    if (missing > 0 && now_ms() < xfer.deadline)
+        return;
+    if (missing > 0)
+        printf("No join ack from %d members, asking for the DB anyway\n", missing);
+    xfer_ask();
+}
+
+// milliseconds until the join acks (or the connection to the donor) are given up, -1 if not waiting
+int xfer_next_timeout()
+{   long long now = now_ms();
+
+    if (xfer.state != XFER_ACKS && !xfer.connecting)
+        return -1;
+    return xfer.deadline > now ? (int) (xfer.deadline - now) : 0;
+}
+
+/* ---------- DB: append-only log of segments ----------
+Every chat message is a record appended to the active segment <port>.db/seg-N.log, an edit
+is a new version record of the same entry. The index keeps where the newest version of every
+entry is, so a write is one append and a read one pread. On startup the segments are mapped and
+scanned to rebuild the index, a torn record at the end of a segment is cut off (of the active one, or
+of the one the compaction was writing: it has the highest id and stays the active segment after it).
+Segments that are mostly old versions are rewritten by the compaction thread. */
+
+// crc32 (IEEE) of the records
+uint32_t crc32_update(uint32_t crc, const char *data, uint32_t n)
+{   static uint32_t table[256];
+    static int ready = 0;
+    uint32_t c;
+    int i, j;
+
+    if (!ready) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (j = 0; j < 8; j++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        ready = 1;
+    }
+    crc = ~crc;
+    while (n-- > 0)
+        crc = table[(crc ^ (uint8_t) *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// crc of a record: the header after the crc field and the text
+uint32_t record_crc(struct db_record *rec, const char *text)
+{
+    uint32_t crc = crc32_update(0, (const char *) rec + sizeof(rec->crc), sizeof(*rec) - sizeof(rec->crc));
+    return crc32_update(crc, text, rec->len);
+}
+
+// the file of segment seg_id, path has PATH_MAX bytes
+void segment_name(char *path, uint32_t seg_id)
+{
+    snprintf(path, PATH_MAX, "%s/seg-%06u.log", db_dir, seg_id);
+}
+
+// adds a segment to the table, returns its slot
+int segment_add(uint32_t seg_id, int fd, uint32_t size)
+{
+    if (db.nsegments == db.segments_cap) {
+        db.segments_cap = db.segments_cap ? db.segments_cap * 2 : 16;
+        db.segments = realloc(db.segments, db.segments_cap * sizeof(*db.segments));
+        if (db.segments == NULL){
+            perror("Error on allocating segments");
+            exit(1);
+        }
+    }
+    memset(&db.segments[db.nsegments], 0, sizeof(db.segments[0]));
+    db.segments[db.nsegments].id = seg_id;
+    db.segments[db.nsegments].fd = fd;
+    db.segments[db.nsegments].size = size;
+    if (seg_id >= db.next_id)
+        db.next_id = seg_id + 1;
+    return db.nsegments++;
+}
+
+// makes room in the index for entry
+void index_grow(uint32_t entry)
+{   uint32_t cap;
+
+    if (entry < db.index_cap)
+        return;
+    cap = db.index_cap ? db.index_cap : 1024;
+    while (cap <= entry)
+        cap *= 2;
+    db.index = realloc(db.index, cap * sizeof(*db.index));
+    if (db.index == NULL){
+        perror("Error on allocating index");
+        exit(1);
+    }
+    memset(db.index + db.index_cap, 0, (cap - db.index_cap) * sizeof(*db.index));
+    db.index_cap = cap;
+}
+
+// points the index to a record if it is the newest version of its entry, returns 1 when it is
+int index_set(struct db_record *rec, int slot, uint32_t offset)
+{   struct db_location *loc;
+    uint32_t bytes = sizeof(*rec) + rec->len;
+
+    index_grow(rec->entry);
+    loc = &db.index[rec->entry];
+    if (loc->version != 0 && loc->version >= rec->version) // an older version, dead from the start
+        return 0;
+    if (loc->version != 0) // the old version is dead now
+        db.segments[loc->slot].live -= sizeof(struct db_record) + loc->len;
+    loc->slot = slot;
+    loc->offset = offset;
+    loc->version = rec->version;
+    loc->len = rec->len;
+    loc->dirty = 1;
+    db.segments[slot].live += bytes;
+    if (rec->entry >= (uint32_t) key)
+        key = rec->entry + 1; // key = #entries
+    return 1;
+}
+
+// scans one segment, returns the bytes of whole records
+uint32_t segment_scan(int slot, int fd)
+{   struct stat st;
+    struct db_record rec;
+    char *map;
+    uint32_t offset = 0;
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+        return 0;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED){
+        perror("Error on mapping segment");
+        exit(1);
+    }
+    while (offset + sizeof(rec) <= (uint32_t) st.st_size) {
+        memcpy(&rec, map + offset, sizeof(rec));
+        if (offset + sizeof(rec) + rec.len > (uint32_t) st.st_size
+            || record_crc(&rec, map + offset + sizeof(rec)) != rec.crc)
+            break; // torn write of a crash, the rest is cut off
+        if (index_set(&rec, slot, offset))
+            search_add(rec.entry, rec.version, map + offset + sizeof(rec), rec.len);
+        offset += sizeof(rec) + rec.len;
+    }
+    munmap(map, st.st_size);
+    return offset;
+}
+
+int compare_ids(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// opens the DB of this peer and rebuilds the index from the segments
+void db_open()
+{   DIR *dir;
+    struct dirent *de;
+    uint32_t *ids = NULL, seg_id, size;
+    int n = 0, cap = 0, i, fd, slot;
+    char path[PATH_MAX];
+    pthread_t compact_id;
+
+    snprintf(db_dir, SIZE, "%d.db", serv_port);
+    if (mkdir(db_dir, 0755) < 0 && errno != EEXIST){
+        perror("Error on creating DB directory");
+        exit(1);
+    }
+    dir = opendir(db_dir);
+    if (dir == NULL){
+        perror("Error on opening DB directory");
+        exit(1);
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (sscanf(de->d_name, "seg-%u.log", &seg_id) != 1)
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            ids = realloc(ids, cap * sizeof(*ids));
+        }
+        ids[n++] = seg_id;
+    }
+    closedir(dir);
+    qsort(ids, n, sizeof(*ids), compare_ids);
+    search_load(); // the scan only has to index the versions written after it was saved
+
+    for (i = 0; i < n; i++) {
+        segment_name(path, ids[i]);
+        fd = open(path, O_RDWR);
+        if (fd < 0){
+            perror("Error on opening segment");
+            exit(1);
+        }
+        slot = segment_add(ids[i], fd, 0);
+        size = segment_scan(slot, fd);
+        db.segments[slot].size = size;
+        if (ftruncate(fd, size) < 0) // not only the last one: compaction writes past the active segment
+            perror("Error on truncating segment");
+        if (i == n - 1) // the last one stays the active segment
+            db.active = slot;
+    }
+    free(ids);
+    if (n == 0)
+        segment_roll();
+    lseek(db.segments[db.active].fd, 0, SEEK_END);
+    if (key > 0)
+        printf("DB recovered: %d entries in %d segments\n", key, n);
+    metric_set(&metrics[M_SEARCH_POSTINGS], search.postings);
+
+    if (pthread_create(&compact_id, NULL, compact_thread, NULL) < 0){
+        perror("Error on creating thread");
+        exit(1);
+    }
+    pthread_detach(compact_id);
+}
+
+// seals the active segment and starts a new one, called with lock_db held
+void segment_roll()
+{   char path[PATH_MAX];
+    int fd;
+
+    segment_name(path, db.next_id);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0){
+        perror("Error on creating segment");
+        exit(1);
+    }
+    db.active = segment_add(db.next_id, fd, 0);
+}
+
+// appends a version of an entry to the active segment, version 0 = the next one
+int db_write_record(uint32_t entry, uint32_t version, const char *text, uint32_t len)
+{   struct db_record rec;
+    struct iovec iov[2];
+    struct db_segment *seg;
+    int n;
+    uint64_t start;
+
+    if (len > 0xFFFF)
+        len = 0xFFFF;
+    pthread_mutex_lock(&lock_db);
+    index_grow(entry);
+    seg = &db.segments[db.active];
+    if (seg->size > 0 && seg->size + sizeof(rec) + len > SEGMENT_SIZE) {
+        segment_roll();
+        seg = &db.segments[db.active];
+        pthread_cond_signal(&compact_cond); // a segment was sealed
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.entry = entry;
+    rec.version = version ? version : db.index[entry].version + 1;
+    rec.len = len;
+    rec.crc = record_crc(&rec, text);
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = (void *) text;
+    iov[1].iov_len = len;
+    start = metric_now_ns();
+    n = writev(seg->fd, iov, 2);
+    metric_observe(&metrics[M_DB_WRITE], metric_now_ns() - start);
+    if (n != (int) (sizeof(rec) + len)) {
+        perror("Error on writing DB");
+        pthread_mutex_unlock(&lock_db);
+        return -1;
+    }
+    if (index_set(&rec, db.active, seg->size))
+        search_add(entry, rec.version, text, len);
+    seg->size += n;
+    pthread_mutex_unlock(&lock_db);
+    return entry;
+}
+
+//write message to DB as a new entry
+int DB_write(const char *text)
+{
+    return db_write_record(key, 0, text, strlen(text));
+}
+
+// writes chat messages as the next n entries with one writev, returns the first entry or -1
+int DB_write_batch(char **texts, int n)
+{   struct db_record recs[DELIVER_BATCH];
+    struct iovec iov[2 * DELIVER_BATCH];
+    struct db_segment *seg;
+    uint32_t first = key, bytes = 0, offset;
+    int i, w;
+    uint64_t start;
+
+    if (n > DELIVER_BATCH)
+        n = DELIVER_BATCH;
+    pthread_mutex_lock(&lock_db);
+    index_grow(first + n);
+    for (i = 0; i < n; i++) {
+        memset(&recs[i], 0, sizeof(recs[i]));
+        recs[i].entry = first + i;
+        recs[i].version = db.index[first + i].version + 1;
+        recs[i].len = strlen(texts[i]) > 0xFFFF ? 0xFFFF : strlen(texts[i]);
+        recs[i].crc = record_crc(&recs[i], texts[i]);
+        iov[2*i].iov_base = &recs[i];
+        iov[2*i].iov_len = sizeof(recs[i]);
+        iov[2*i+1].iov_base = texts[i];
+        iov[2*i+1].iov_len = recs[i].len;
+        bytes += sizeof(recs[i]) + recs[i].len;
+    }
+    seg = &db.segments[db.active];
+    if (seg->size > 0 && seg->size + bytes > SEGMENT_SIZE) {
+        segment_roll();
+        seg = &db.segments[db.active];
+        pthread_cond_signal(&compact_cond); // a segment was sealed
+    }
+    start = metric_now_ns();
+    w = writev(seg->fd, iov, 2 * n);
+    metric_observe(&metrics[M_DB_WRITE], metric_now_ns() - start);
+    if (w != (int) bytes) {
+        perror("Error on writing DB");
+        pthread_mutex_unlock(&lock_db);
+        return -1;
+    }
+    offset = seg->size;
+    for (i = 0; i < n; i++) {
+        if (index_set(&recs[i], db.active, offset))
+            search_add(recs[i].entry, recs[i].version, texts[i], recs[i].len);
+        offset += sizeof(recs[i]) + recs[i].len;
+    }
+    seg->size = offset;
+    pthread_mutex_unlock(&lock_db);
+    return first;
+}
+
+//write a new version of an entry
+int DB_write_edit(int entry, const char *text)
+{
+    if (entry < 0)
+        return -1;
+    db_write_record(entry, 0, text, strlen(text));
+    pthread_cond_signal(&compact_cond); // an old version is dead now
+    return entry;
+}
+
+// writes a version of an entry from the server if it is newer than ours
+int DB_apply(uint32_t entry, uint32_t version, const char *text, uint32_t len)
+{   uint32_t have = 0;
+
+    pthread_mutex_lock(&lock_db);
+    if (entry < db.index_cap)
+        have = db.index[entry].version;
+    pthread_mutex_unlock(&lock_db);
+    if (have >= version) // only the event loop writes, it can not change meanwhile
+        return -1;
+    if (have != 0)
+        pthread_cond_signal(&compact_cond);
+    return db_write_record(entry, version, text, len);
+}
+
+// appends the records of buf to the active segment and points the index to them
+int db_append(char *buf, uint32_t bytes)
+{   struct db_segment *seg = &db.segments[db.active];
+    struct db_record rec;
+    uint32_t off;
+
+    if (bytes == 0)
+        return 0;
+    if (write(seg->fd, buf, bytes) != (int) bytes) {
+        perror("Error on writing DB");
+        return -1;
+    }
+    for (off = 0; off < bytes; off += sizeof(rec) + rec.len) {
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (index_set(&rec, db.active, seg->size + off))
+            search_add(rec.entry, rec.version, buf + off + sizeof(rec), rec.len);
+    }
+    seg->size += bytes;
+    return 0;
+}
+
+/* writes the entries of a PROTO_XFER_CHUNK (n * (u32 entry, u32 version, str)) that are newer
+   than ours, with one write per segment instead of one per entry, returns the entries or -1 */
+int DB_apply_chunk(const char *data, uint32_t len)
+{   struct proto_frame f = { 0, 0, len, data };
+    struct proto_in in;
+    struct db_record rec;
+    char *buf;
+    const char *text;
+    uint32_t entry, version, n, bytes = 0;
+    int count = 0;
+
+    buf = malloc(len * 2 + sizeof(rec)); // a record header is 16 bytes, an entry 10 + text
+    if (buf == NULL){
+        perror("Error on allocating DB chunk");
+        exit(1);
+    }
+    proto_init_in(&in, &f);
+    pthread_mutex_lock(&lock_db);
+    while (in.left > 0) {
+        entry = proto_get_u32(&in);
+        version = proto_get_u32(&in);
+        text = proto_get_str(&in, &n);
+        if (text == NULL)
+            break;
+        count++;
+        if (entry < db.index_cap && db.index[entry].version >= version) // we have it
+            continue;
+        index_grow(entry);
+        if (db.segments[db.active].size + bytes + sizeof(rec) + n > SEGMENT_SIZE) {
+            if (db_append(buf, bytes) < 0)
+                break;
+            bytes = 0;
+            segment_roll();
+            pthread_cond_signal(&compact_cond); // a segment was sealed
+        }
+        memset(&rec, 0, sizeof(rec));
+        rec.entry = entry;
+        rec.version = version;
+        rec.len = n;
+        rec.crc = record_crc(&rec, text);
+        memcpy(buf + bytes, &rec, sizeof(rec));
+        memcpy(buf + bytes + sizeof(rec), text, n);
+        bytes += sizeof(rec) + n;
+    }
+    if (db_append(buf, bytes) < 0)
+        in.err = 1;
+    pthread_mutex_unlock(&lock_db);
+    free(buf);
+    return in.err ? -1 : count;
+}
+
+// reads the newest version of an entry into buf, returns its length or -1
+int DB_read(int entry, char *buf, int size)
+{   struct db_location loc;
+    int n;
+
+    pthread_mutex_lock(&lock_db);
+    if (entry < 0 || entry >= key || db.index[entry].version == 0) {
+        pthread_mutex_unlock(&lock_db);
+        return -1;
+    }
+    loc = db.index[entry];
+    n = loc.len < size - 1 ? loc.len : size - 1;
+    n = pread(db.segments[loc.slot].fd, buf, n, loc.offset + sizeof(struct db_record));
+    pthread_mutex_unlock(&lock_db);
+    if (n < 0)
+        return -1;
+    buf[n] = '\0';
+    return n;
+}
+
+// writes the current entries to <port>.txt, one per line
+void DB_dump()
+{   int i;
+    FILE *f;
+    char filename[SIZE], text[SIZE*2];
+
+    sprintf(filename, "%d.txt", serv_port); //file of every peer
+    f = fopen (filename,"wb");
+    if (f == NULL)
+        return;
+    for(i=0;i<key;i++){  // key = #entries
+        if (DB_read(i, text, sizeof(text)) < 0)
+            text[0] = '\0';
+        fprintf(f, "%s\n", text);
+    }
+    fclose(f);
+}
+
+// rewrites the live records of the sealed segments that are mostly dead versions
+void *compact_thread(void *arg)
+{   int slot, i, fd, moved;
+    uint32_t entry, offset, new_slot;
+    struct db_location loc;
+    struct db_record rec;
+    char path[PATH_MAX], text[0x10000 + sizeof(struct db_record)];
+
+    while (1) {
+        pthread_mutex_lock(&lock_db);
+        while (1) { // a sealed segment with less than half of it alive
+            for (slot = 0; slot < db.nsegments; slot++) {
+                if (slot != db.active && !db.segments[slot].removed
+                    && db.segments[slot].live * 2 < db.segments[slot].size)
+                    break;
+            }
+            if (slot < db.nsegments)
+                break;
+            pthread_cond_wait(&compact_cond, &lock_db);
+        }
+        segment_name(path, db.next_id);
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd < 0) {
+            perror("Error on creating segment");
+            pthread_mutex_unlock(&lock_db);
+            return NULL;
+        }
+        new_slot = segment_add(db.next_id, fd, 0);
+        offset = 0;
+        moved = 0;
+        /* copy the newest versions that live in the old segment, edits go on meanwhile
+           in the active segment and simply win with their higher version */
+        for (entry = 0; entry < (uint32_t) key; entry++) {
+            loc = db.index[entry];
+            if (loc.version == 0 || loc.slot != (uint32_t) slot)
+                continue;
+            i = pread(db.segments[slot].fd, text, sizeof(rec) + loc.len, loc.offset);
+            if (i != (int) (sizeof(rec) + loc.len))
+                continue;
+            if (write(fd, text, i) != i)
+                break;
+            db.segments[slot].live -= i;
+            db.index[entry].slot = new_slot;
+            db.index[entry].offset = offset;
+            db.segments[new_slot].live += i;
+            offset += i;
+            moved++;
+            if ((moved & 255) == 0) { // let the writers in now and then
+                pthread_mutex_unlock(&lock_db);
+                pthread_mutex_lock(&lock_db);
+            }
+        }
+        db.segments[new_slot].size = offset;
+        fsync(fd);
+        if (offset == 0) { // nothing was alive, the new segment is not needed
+            close(fd);
+            db.segments[new_slot].removed = 1;
+            segment_name(path, db.segments[new_slot].id);
+            unlink(path);
+        }
+        if (db.segments[slot].live == 0) { // nothing points into it any more
+            close(db.segments[slot].fd);
+            db.segments[slot].removed = 1;
+            segment_name(path, db.segments[slot].id);
+            unlink(path);
+        }
+        pthread_mutex_unlock(&lock_db);
+    }
+    return NULL;
+}
+
+/* ---------- full-text search (/search) ----------
+An inverted index of the entries: every word (letters and digits in lower case, the bytes of UTF-8 count
+as letters) has a list of the entries it is in, with the times it is in each. It is kept where the DB
+index is, under lock_db: a record that becomes the newest version of its entry (a chat message, an edit,
+an entry from the server or from a donor) adds a posting to the list of each of its words. The old version
+is not looked up, its postings just stop counting: a posting has the version it was made for and a query
+checks it against db.index, the lists drop the dead ones when they are sorted again for a query. /exit
+saves the index to <port>.db/search.idx (with a crc) and the next start loads it, the scan of the segments
+then only indexes the versions written after it. A query is the entries that have all its words, ranked
+by tf-idf: the shortest list is walked and the others are searched with galloping steps, so a query costs
+about the entries of its rarest word, not the size of the DB. */
+
+// FNV-1a of a word
+uint32_t search_hash(const char *w, uint32_t n)
+{   uint32_t h = 2166136261u;
+
+    while (n-- > 0)
+        h = (h ^ (uint8_t) *w++) * 16777619u;
+    return h;
+}
+
+// the next word of text from *pos in lower case into word, returns its length or 0 at the end
+uint32_t search_word(const char *text, uint32_t len, uint32_t *pos, char *word)
+{   uint32_t n = 0;
+    unsigned char c;
+
+    while (*pos < len && !isalnum((unsigned char) text[*pos]) && (unsigned char) text[*pos] < 0x80)
+        (*pos)++;
+    while (*pos < len) {
+        c = (unsigned char) text[*pos];
+        if (!isalnum(c) && c < 0x80)
+            break;
+        if (n < SEARCH_MAX_WORD)
+            word[n++] = tolower(c);
+        (*pos)++;
+    }
+    return n;
+}
+
+// a hash table of cap slots (a power of 2, more than the terms) with the terms in it again
+void search_rehash(uint32_t cap)
+{   uint32_t t, i;
+    struct search_term *term;
+
+    free(search.table);
+    search.table = calloc(cap, sizeof(*search.table));
+    if (search.table == NULL){
+        perror("Error on allocating search index");
+        exit(1);
+    }
+    search.table_cap = cap;
+    for (t = 0; t < search.nterms; t++) {
+        term = &search.terms[t];
+        for (i = search_hash(search.words + term->word, term->len) & (cap - 1); search.table[i] != 0; i = (i + 1) & (cap - 1))
+            ;
+        search.table[i] = t + 1;
+    }
+}
+
+// the term of a word, a new one when create is set, NULL when there is none
+struct search_term *search_term(const char *w, uint32_t n, int create)
+{   uint32_t i, t;
+    struct search_term *term;
+
+    if (create && (search.nterms + 1) * 2 > search.table_cap)
+        search_rehash(search.table_cap ? search.table_cap * 2 : 1024);
+    if (search.table_cap == 0)
+        return NULL;
+    for (i = search_hash(w, n) & (search.table_cap - 1); (t = search.table[i]) != 0; i = (i + 1) & (search.table_cap - 1)) {
+        term = &search.terms[t - 1];
+        if (term->len == n && memcmp(search.words + term->word, w, n) == 0)
+            return term;
+    }
+    if (!create)
+        return NULL;
+    if (search.nterms == search.terms_cap) {
+        search.terms_cap = search.terms_cap ? search.terms_cap * 2 : 1024;
+        search.terms = realloc(search.terms, search.terms_cap * sizeof(*search.terms));
+    }
+    if (search.words_len + n > search.words_cap) {
+        search.words_cap = search.words_cap ? search.words_cap * 2 : 16384;
+        search.words = realloc(search.words, search.words_cap);
+    }
+    if (search.terms == NULL || search.words == NULL){
+        perror("Error on allocating search index");
+        exit(1);
+    }
+    term = &search.terms[search.nterms];
+    memset(term, 0, sizeof(*term));
+    term->word = search.words_len;
+    term->len = n;
+    memcpy(search.words + search.words_len, w, n);
+    search.words_len += n;
+    search.table[i] = ++search.nterms;
+    return term;
+}
+
+// indexes the words of a version of an entry, called with lock_db held when it became the newest one
+void search_add(uint32_t entry, uint32_t version, const char *text, uint32_t len)
+{   char word[SEARCH_MAX_WORD];
+    uint32_t pos = 0, n, cap;
+    struct search_term *term;
+    struct search_posting *last;
+
+    if (entry >= search.version_cap) {
+        cap = search.version_cap ? search.version_cap : 1024;
+        while (cap <= entry)
+            cap *= 2;
+        search.version = realloc(search.version, cap * sizeof(*search.version));
+        if (search.version == NULL){
+            perror("Error on allocating search index");
+            exit(1);
+        }
+        memset(search.version + search.version_cap, 0, (cap - search.version_cap) * sizeof(*search.version));
+        search.version_cap = cap;
+    }
+    if (search.version[entry] >= version) // the saved index has it (or a newer version, the scan meets the old ones first)
+        return;
+    search.version[entry] = version;
+    while ((n = search_word(text, len, &pos, word)) > 0) {
+        term = search_term(word, n, 1);
+        last = term->n > 0 ? &term->postings[term->n - 1] : NULL;
+        if (last != NULL && last->entry == entry && last->version == (version & 0xFFFFFF)) { // again in this text
+            if (last->tf < 255)
+                last->tf++;
+            continue;
+        }
+        if (term->n == term->cap) {
+            term->cap = term->cap ? term->cap * 2 : 4;
+            term->postings = realloc(term->postings, term->cap * sizeof(*term->postings));
+            if (term->postings == NULL){
+                perror("Error on allocating search index");
+                exit(1);
+            }
+        }
+        if (term->sorted == term->n && (term->n == 0 || term->postings[term->n - 1].entry < entry)) // still in entry order
+            term->sorted++;
+        term->postings[term->n].entry = entry;
+        term->postings[term->n].version = version;
+        term->postings[term->n].tf = 1;
+        term->n++;
+        search.postings++;
+    }
+}
+
+// the posting is for the newest version of its entry
+int search_live(const struct search_posting *p)
+{
+    return p->entry < db.index_cap && db.index[p->entry].version != 0
+        && (db.index[p->entry].version & 0xFFFFFF) == p->version;
+}
+
+int compare_postings(const void *a, const void *b)
+{
+    const struct search_posting *x = a, *y = b;
+    return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+// sorts the list of a term by entry and drops the postings of old versions
+void search_clean(struct search_term *term)
+{   uint32_t i, n = 0;
+
+    qsort(term->postings, term->n, sizeof(*term->postings), compare_postings);
+    for (i = 0; i < term->n; i++) {
+        if (search_live(&term->postings[i]) && (n == 0 || term->postings[n-1].entry != term->postings[i].entry))
+            term->postings[n++] = term->postings[i];
+    }
+    search.postings -= term->n - n;
+    term->n = term->sorted = n;
+}
+
+// the first posting of a sorted list from from on with an entry >= entry (galloping, then binary search)
+uint32_t search_seek(struct search_term *term, uint32_t from, uint32_t entry)
+{   uint32_t step = 1, lo = from, hi, mid;
+
+    while (lo + step < term->n && term->postings[lo + step].entry < entry) {
+        lo += step;
+        step *= 2;
+    }
+    hi = lo + step < term->n ? lo + step : term->n;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (term->postings[mid].entry < entry)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// natural log of x > 0 for the ranking, without libm (the build does not link it): x = m * 2^e, m in [1, 2)
+double search_log(double x)
+{   int e = 0;
+    double y, y2;
+
+    while (x >= 2) {
+        x /= 2;
+        e++;
+    }
+    while (x < 1) {
+        x *= 2;
+        e--;
+    }
+    y = (x - 1) / (x + 1);
+    y2 = y * y;
+    return e * 0.6931471805599453 + 2 * y * (1 + y2 * (1.0/3 + y2 * (1.0/5 + y2 * (1.0/7 + y2 * (1.0/9 + y2 / 11)))));
+}
+
+int compare_terms(const void *a, const void *b)
+{
+    const struct search_term *x = *(struct search_term * const *) a, *y = *(struct search_term * const *) b;
+    return (x->n > y->n) - (x->n < y->n);
+}
+
+// /search: the entries with all the words of the query, the best SEARCH_RESULTS first
+void search_command(char *query)
+{   char word[SEARCH_MAX_WORD], text[SIZE*2];
+    struct search_term *terms[SEARCH_TERMS];
+    uint32_t pos = 0, n, nterms = 0, i, j, at[SEARCH_TERMS], found = 0, top[SEARCH_RESULTS];
+    double idf[SEARCH_TERMS], score, scores[SEARCH_RESULTS];
+    int ntop = 0, missing = 0;
+    struct search_posting *p, *q;
+    uint64_t start = metric_now_ns();
+
+    pthread_mutex_lock(&lock_db);
+    while (nterms < SEARCH_TERMS && (n = search_word(query, strlen(query), &pos, word)) > 0) {
+        terms[nterms] = search_term(word, n, 0);
+        if (terms[nterms] == NULL) { // no entry has this word
+            missing = 1;
+            break;
+        }
+        for (i = 0; i < nterms && terms[i] != terms[nterms]; i++)
+            ;
+        if (i == nterms) // the same word twice counts once
+            nterms++;
+    }
+    if (nterms == 0 && !missing) {
+        pthread_mutex_unlock(&lock_db);
+        printf("Usage: /search (words)\n");
+        return;
+    }
+    for (i = 0; i < nterms && !missing; i++) {
+        if (terms[i]->sorted < terms[i]->n) // edits came, or old versions to drop
+            search_clean(terms[i]);
+        at[i] = 0;
+    }
+    if (!missing)
+        qsort(terms, nterms, sizeof(terms[0]), compare_terms); // the rarest word leads
+    for (i = 0; i < nterms && !missing; i++) // in the order of terms now
+        idf[i] = search_log(1.0 + (key - terms[i]->n + 0.5) / (terms[i]->n + 0.5));
+    for (j = 0; !missing && j < terms[0]->n; j++) {
+        p = &terms[0]->postings[j];
+        if (!search_live(p))
+            continue;
+        score = (1 + search_log(p->tf)) * idf[0];
+        for (i = 1; i < nterms; i++) {
+            at[i] = search_seek(terms[i], at[i], p->entry);
+            if (at[i] == terms[i]->n)
+                break;
+            q = &terms[i]->postings[at[i]];
+            if (q->entry != p->entry || !search_live(q))
+                break;
+            score += (1 + search_log(q->tf)) * idf[i];
+        }
+        if (i < nterms)
+            continue;
+        found++;
+        /* keep the best ones, the newer entry first on a tie */
+        for (i = ntop < SEARCH_RESULTS ? ntop++ : SEARCH_RESULTS; i > 0 && (scores[i-1] < score
+             || (scores[i-1] == score && top[i-1] < p->entry)); i--) {
+            if (i < SEARCH_RESULTS) {
+                scores[i] = scores[i-1];
+                top[i] = top[i-1];
+            }
+        }
+        if (i < SEARCH_RESULTS) {
+            scores[i] = score;
+            top[i] = p->entry;
+        }
+    }
+    metric_set(&metrics[M_SEARCH_POSTINGS], search.postings);
+    pthread_mutex_unlock(&lock_db);
+    metric_observe(&metrics[M_SEARCH_TIME], metric_now_ns() - start);
+    printf("%u entries in %.3f ms\n", found, (metric_now_ns() - start) / 1e6);
+    for (i = 0; i < (uint32_t) ntop; i++) {
+        if (DB_read(top[i], text, sizeof(text)) < 0)
+            text[0] = '\0';
+        printf("%u (%.2f): %s\n", top[i], scores[i], text);
+    }
+}
+
+// writes n bytes to the index file and adds them to its crc
+int search_put(FILE *f, const void *data, size_t n, uint32_t *crc)
+{
+    *crc = crc32_update(*crc, data, n);
+    return fwrite(data, 1, n, f) == n ? 0 : -1;
+}
+
+/* saves the index to <port>.db/search.idx: magic, terms, entries, bytes of the words, the versions of the
+   entries, the words, every term (word, len, n, sorted) with its postings, then the crc of all that */
+void search_save()
+{   char path[PATH_MAX], tmp[PATH_MAX];
+    uint32_t head[4], t, crc = 0;
+    struct search_term *term;
+    int err = 0;
+    FILE *f;
+
+    snprintf(path, PATH_MAX, "%s/search.idx", db_dir);
+    snprintf(tmp, PATH_MAX, "%s/search.tmp", db_dir);
+    f = fopen(tmp, "wb");
+    if (f == NULL)
+        return;
+    pthread_mutex_lock(&lock_db);
+    head[0] = SEARCH_MAGIC;
+    head[1] = search.nterms;
+    head[2] = search.version_cap;
+    head[3] = search.words_len;
+    err |= search_put(f, head, sizeof(head), &crc);
+    err |= search_put(f, search.version, search.version_cap * sizeof(*search.version), &crc);
+    err |= search_put(f, search.words, search.words_len, &crc);
+    for (t = 0; t < search.nterms && !err; t++) {
+        term = &search.terms[t];
+        err |= search_put(f, term, 4 * sizeof(uint32_t), &crc); // word, len, n, cap
+        err |= search_put(f, &term->sorted, sizeof(term->sorted), &crc);
+        err |= search_put(f, term->postings, term->n * sizeof(*term->postings), &crc);
+    }
+    pthread_mutex_unlock(&lock_db);
+    err |= fwrite(&crc, sizeof(crc), 1, f) != 1;
+    err |= fflush(f) != 0 || fsync(fileno(f)) < 0;
+    err |= fclose(f) != 0;
+    if (err || rename(tmp, path) < 0) {
+        perror("Error on saving search index");
+        unlink(tmp);
+    }
+}
+
+// loads the index saved by the last run, a missing or damaged file leaves it empty (the scan builds it)
+void search_load()
+{   char path[PATH_MAX], *map, *p, *end;
+    struct stat st;
+    uint32_t head[4], t, crc;
+    struct search_term *term;
+    int fd;
+
+    snprintf(path, PATH_MAX, "%s/search.idx", db_dir);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) (sizeof(head) + sizeof(crc))) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+    end = map + st.st_size - sizeof(crc);
+    memcpy(&crc, end, sizeof(crc));
+    memcpy(head, map, sizeof(head));
+    if (head[0] != SEARCH_MAGIC || crc32_update(0, map, end - map) != crc) {
+        printf("Search index %s is damaged, it is built again\n", path);
+        munmap(map, st.st_size);
+        return;
+    }
+    p = map + sizeof(head);
+    search.version_cap = head[2];
+    search.version = malloc(head[2] * sizeof(*search.version) + 1);
+    search.words_len = search.words_cap = head[3];
+    search.words = malloc(head[3] + 1);
+    search.nterms = search.terms_cap = head[1];
+    search.terms = calloc(head[1] + 1, sizeof(*search.terms));
+    if (search.version == NULL || search.words == NULL || search.terms == NULL){
+        perror("Error on allocating search index");
+        exit(1);
+    }
+    memcpy(search.version, p, head[2] * sizeof(*search.version));
+    p += head[2] * sizeof(*search.version);
+    memcpy(search.words, p, head[3]);
+    p += head[3];
+    for (t = 0; t < search.nterms; t++) {
+        term = &search.terms[t];
+        memcpy(term, p, 4 * sizeof(uint32_t));
+        memcpy(&term->sorted, p + 4 * sizeof(uint32_t), sizeof(term->sorted));
+        p += 5 * sizeof(uint32_t);
+        term->cap = term->n;
+        term->postings = malloc(term->n * sizeof(*term->postings) + 1);
+        if (term->postings == NULL){
+            perror("Error on allocating search index");
+            exit(1);
+        }
+        memcpy(term->postings, p, term->n * sizeof(*term->postings));
+        p += term->n * sizeof(*term->postings);
+        search.postings += term->n;
+    }
+    munmap(map, st.st_size);
+    for (t = 1024; t < 2 * (search.nterms + 1); t *= 2)
+        ;
+    search_rehash(t);
+}
+
+/* ---------- sender thread ----------
+The edit requests, the decisions and the votes are not sent by the thread that makes them (the event loop
+must not wait for a fan-out to hundreds of peers) but by one sender thread that lives as long as the peer.
+They go through sendq, a bounded ring of SEND_QUEUE slots that owns a copy of every frame: a slot has a
+sequence number, a caller takes the slot at tail when its number says it is free and publishes the frame
+by moving the number on, the sender takes the slot at head when its number says it is full (compare and
+swap on head and tail, no lock). The sender sleeps on the eventfd sendq.fd while the ring is empty. A
+full ring does what -q says: block waits for the sender to make room (sendq.room), drop takes the oldest
+frame out unless it is a decision, reject refuses the new frame. The chat and the acks are not queued here,
+the event loop sends them itself so that they keep their order. */
+
+// the slots are free for the first turn
+void sender_init()
+{   uint32_t i;
+
+    for (i = 0; i < SEND_QUEUE; i++)
+        sendq.slots[i].seq = i;
+    sendq.fd = eventfd(0, 0);
+    sendq.room = eventfd(0, 0);
+    if (sendq.fd < 0 || sendq.room < 0){
+        perror("Error on creating eventfd");
+        exit(1);
+    }
+}
+
+// copies a frame into the slot at tail, -1 when the ring is full
+int send_push(int port, const char *frame, int len, int keep)
+{   struct send_slot *slot;
+    uint32_t pos = __atomic_load_n(&sendq.tail, __ATOMIC_RELAXED);
+    int32_t diff;
+
+    while (1) {
+        slot = &sendq.slots[pos % SEND_QUEUE];
+        diff = (int32_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) { // free, take it unless another caller did
+            if (__atomic_compare_exchange_n(&sendq.tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) // the sender has not taken it out yet
+            return -1;
+        else
+            pos = __atomic_load_n(&sendq.tail, __ATOMIC_RELAXED);
+    }
+    slot->port = port;
+    slot->len = len;
+    slot->keep = keep;
+    memcpy(slot->frame, frame, len);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE); // full
+    return 0;
+}
+
+/* takes the frame at head out and sends it (send) or drops it, -1 when the ring is empty
+   or, when dropping, the oldest frame is one that must go out */
+int send_pop(int send)
+{   struct send_slot *slot;
+    uint32_t pos = __atomic_load_n(&sendq.head, __ATOMIC_RELAXED);
+    int32_t diff;
+
+    while (1) {
+        slot = &sendq.slots[pos % SEND_QUEUE];
+        diff = (int32_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (!send && slot->keep)
+                return -1;
+            if (__atomic_compare_exchange_n(&sendq.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return -1;
+        else
+            pos = __atomic_load_n(&sendq.head, __ATOMIC_RELAXED);
+    }
+    if (send && slot->port == 0)
+        multicast(slot->frame, slot->len);
+    else if (send)
+        rel_unicast(slot->port, slot->frame, slot->len);
+    __atomic_store_n(&slot->seq, pos + SEND_QUEUE, __ATOMIC_RELEASE); // free for the next turn
+    metric_add(&metrics[M_SEND_QUEUE], -1);
+    if (__atomic_load_n(&sendq.waiting, __ATOMIC_SEQ_CST) > 0)
+        eventfd_write(sendq.room, 1);
+    return 0;
+}
+
+/* queues a frame for the sender thread (port 0: all the peers), a full queue does what policy says;
+   -1 when the frame was refused */
+int send_post(int port, const char *frame, int len, int policy)
+{   eventfd_t value;
+    int n;
+
+    if (len > (int) sizeof(sendq.slots[0].frame))
+        return -1;
+    while (send_push(port, frame, len, policy == SEND_BLOCK) < 0) {
+        if (policy == SEND_REJECT) {
+            metric_add(&metrics[M_SEND_DROPPED], 1);
+            return -1;
+        }
+        if (policy == SEND_DROP && send_pop(0) == 0) {
+            metric_add(&metrics[M_SEND_DROPPED], 1);
+            continue;
+        }
+        // wait for the sender to take a frame out (also when the oldest one may not be dropped)
+        __atomic_add_fetch(&sendq.waiting, 1, __ATOMIC_SEQ_CST);
+        n = send_push(port, frame, len, policy == SEND_BLOCK);
+        if (n < 0)
+            eventfd_read(sendq.room, &value);
+        __atomic_sub_fetch(&sendq.waiting, 1, __ATOMIC_SEQ_CST);
+        if (n == 0)
+            break;
+    }
+    metric_add(&metrics[M_SEND_QUEUE], 1);
+    eventfd_write(sendq.fd, 1);
+    return 0;
+}
+
+// sends the queued frames to the peers until the peer exits
+void *sender_thread(void *arg)
+{   eventfd_t value;
+
+    while (1) {
+        if (eventfd_read(sendq.fd, &value) < 0 && errno != EINTR) {
+            perror("Error on reading eventfd");
+            exit(1);
+        }
+        while (send_pop(1) == 0)
+            ;
+    }
+    return NULL;
+}
+
+// rebuilds the cached addresses of the peers after a new list of the server
+void build_destinations()
+{   int i, j;
+    struct rel_peer *p;
+
+    pthread_mutex_lock(&lock);
+    for(i=0;i<number_of_users;i++){
+        memset(&dest_addr[i], 0, sizeof(dest_addr[i]));
+        dest_addr[i].sin_family = AF_INET;
+        dest_addr[i].sin_port = htons(ports[i]);
+        dest_addr[i].sin_addr.s_addr = addrs[i];
+        if ((p = rel_peer_get(ports[i], 0)) != NULL) // its frames came before the server told us where it is
+            p->addr.sin_addr.s_addr = addrs[i];
+    }
+    number_of_dests = number_of_users;
+    number_of_tree = 0;
+    /* sorted from the port after ours round to the one before, so the tree of a frame changes little with the
+       members and every sender has other peers near its root (the forwarding is spread over all the peers) */
+    for (i = 0; i < number_of_users; i++) {
+        if (ports[i] == serv_port)
+            continue;
+        for (j = number_of_tree++; j > 0 && (uint16_t) (ntohs(tree_ports[j-1]) - serv_port) > (uint16_t) (ports[i] - serv_port); j--)
+            tree_ports[j] = tree_ports[j-1];
+        tree_ports[j] = htons(ports[i]);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* ---------- reliable UDP between the peers ----------
+Every frame to a peer goes in a PROTO_REL envelope with a sequence number of its own for that peer
+(and the incarnation of the sender, a peer that restarts starts again from 0). The receiver passes
+the frames on in sequence order, keeps the ones that came early (up to REL_WINDOW) and drops the
+copies. It acks with a PROTO_SACK: the next sequence it expects, a bitmap of the ones it already has
+after it and the room it has left, at once for a gap or a copy and otherwise every REL_ACK_EVERY frames
+or REL_ACK_DELAY ms, so one ack covers a burst. The sender keeps every frame until it is acked, sends it
+again when a later one was acked (lost, not late) or after rto ms (srtt + 4 rttvar, doubled while the
+peer does not answer) and never has more than the room of the receiver in flight; the rest waits in a
+queue. The frames are shared by all the peers (one body, a small header per peer), so a multicast
+is still one sendmmsg. With -l (percent) the peer drops that share of the datagrams it receives,
+to test all this. */
+
+// one frame for the peers, shared by the windows of all of them
+struct rel_body *rel_body_new(const char *frame, int len)
+{   struct rel_body *b = malloc(sizeof(*b) + len);
+    if (b == NULL){
+        perror("Error on allocating frame");
+        exit(1);
+    }
+    b->refs = 1;
+    b->len = len;
+    memcpy(b->data, frame, len);
+    return b;
+}
+
+void rel_body_put(struct rel_body *b)
+{
+    if (b != NULL && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(b);
+}
+
+// the channel to and from port, called with lock held
+struct rel_peer *rel_peer_get(int port, int create)
+{   struct rel_peer *p;
+    int bucket = port % REL_BUCKETS;
+
+    for (p = rel_peers[bucket]; p != NULL; p = p->next) {
+        if (p->port == port)
+            return p;
+    }
+    if (!create)
+        return NULL;
+    p = calloc(1, sizeof(*p));
+    if (p == NULL){
+        perror("Error on allocating channel");
+        exit(1);
+    }
+    p->port = port;
+    p->addr.sin_family = AF_INET;
+    p->addr.sin_port = htons(port);
+    p->addr.sin_addr.s_addr = peer_addr(port);
+    p->wnd = REL_WINDOW;
+    p->rto = REL_RTO;
+    p->next = rel_peers[bucket];
+    rel_peers[bucket] = p;
+    return p;
+}
+
+// the address of a member from the destinations, loopback for a port the server has not told us yet
+// (build_destinations fixes the channel when it does), called with lock held
+uint32_t peer_addr(int port)
+{   int i;
+
+    for (i = 0; i < number_of_dests; i++) {
+        if (ntohs(dest_addr[i].sin_port) == port)
+            return dest_addr[i].sin_addr.s_addr;
+    }
+    return htonl(INADDR_LOOPBACK);
+}
+
+// drops the channel of a peer that left or joined again, called with lock held
+void rel_forget(int port)
+{   struct rel_peer **pp, *p;
+    struct rel_queued *q;
+    int i;
+
+    for (pp = &rel_peers[port % REL_BUCKETS]; (p = *pp) != NULL; pp = &p->next) {
+        if (p->port != port)
+            continue;
+        *pp = p->next;
+        for (i = 0; i < REL_WINDOW; i++) {
+            rel_body_put(p->out[i].body);
+            free(p->in[i]);
+        }
+        while ((q = p->queue) != NULL) {
+            p->queue = q->next;
+            rel_body_put(q->body);
+            free(q);
+        }
+        if (p->shm_box != NULL) // a peer that comes back has new shared memory
+            shm_detach(p->shm_box);
+        free(p);
+        return;
+    }
+}
+
+// the envelope of a frame for p, fills hdr (REL_HEADER bytes)
+void rel_header(char *hdr, struct rel_peer *p, uint32_t seq, int len)
+{   struct proto_out o;
+
+    proto_init_out(&o, hdr, REL_HEADER);
+    proto_begin(&o, PROTO_REL, 0);
+    proto_put_u16(&o, serv_port);
+    proto_put_u32(&o, incarnation);
+    proto_put_u32(&o, p->acked); // a receiver that does not know us starts here
+    proto_put_u32(&o, seq);
+    o.len += len; // the frame follows in its own iovec
+    proto_end(&o);
+}
+
+// 1 when the window of p has room for one more frame (always one, a closed window opens with its ack)
+int rel_can_send(struct rel_peer *p)
+{
+    uint32_t wnd = p->wnd < REL_WINDOW ? p->wnd : REL_WINDOW;
+    return p->next_seq == p->acked || p->next_seq - p->acked < wnd;
+}
+
+// puts body in the window of p with the next sequence number, returns it
+uint32_t rel_track(struct rel_peer *p, struct rel_body *b, long long now)
+{   struct rel_out *out = &p->out[p->next_seq % REL_WINDOW];
+
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_ACQ_REL);
+    out->seq = p->next_seq;
+    out->body = b;
+    out->sent = now;
+    out->tries = 0;
+    return p->next_seq++;
+}
+
+// sends one frame of the window of p with sendmsg (retransmits, the queue and unicasts)
+void rel_send_one(struct rel_peer *p, struct rel_out *out)
+{   char hdr[REL_HEADER];
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    rel_header(hdr, p, out->seq, out->body->len);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = REL_HEADER;
+    iov[1].iov_base = out->body->data;
+    iov[1].iov_len = out->body->len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &p->addr;
+    msg.msg_namelen = sizeof(p->addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    trace_add2(&trace, TRACE_DGRAM_OUT, 0, ntohs(p->addr.sin_port), hdr, REL_HEADER, out->body->data, out->body->len);
+    if (shm_send(p, iov, 2) == 0 || sendmsg(udp_sock, &msg, 0) > 0) {
+        metric_add(&metrics[M_DATAGRAMS_OUT], 1);
+        metric_add(&metrics[M_BYTES_OUT], REL_HEADER + out->body->len);
+    }
+}
+
+// sends the frames that waited for room in the window of p, called with lock held
+void rel_flush_queue(struct rel_peer *p)
+{   struct rel_queued *q;
+    long long now = now_ms();
+
+    while ((q = p->queue) != NULL && rel_can_send(p)) {
+        p->queue = q->next;
+        if (p->queue == NULL)
+            p->queue_tail = NULL;
+        rel_track(p, q->body, now);
+        rel_send_one(p, &p->out[(p->next_seq - 1) % REL_WINDOW]);
+        rel_body_put(q->body);
+        free(q);
+    }
+}
+
+// keeps a frame for p until its window has room, called with lock held
+void rel_enqueue(struct rel_peer *p, struct rel_body *b)
+{   struct rel_queued *q = malloc(sizeof(*q));
+
+    if (q == NULL){
+        perror("Error on allocating frame");
+        exit(1);
+    }
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_ACQ_REL);
+    q->body = b;
+    q->next = NULL;
+    if (p->queue_tail != NULL)
+        p->queue_tail->next = q;
+    else
+        p->queue = q;
+    p->queue_tail = q;
+}
+
+// sends a frame to one peer, reliably
+void rel_unicast(int port, const char *frame, int len)
+{   struct rel_body *b = rel_body_new(frame, len);
+    struct rel_peer *p;
+
+    pthread_mutex_lock(&lock);
+    p = rel_peer_get(port, 1);
+    if (p->queue == NULL && rel_can_send(p)) {
+        rel_track(p, b, now_ms());
+        rel_send_one(p, &p->out[(p->next_seq - 1) % REL_WINDOW]);
+    }
+    else
+        rel_enqueue(p, b);
+    pthread_mutex_unlock(&lock);
+    rel_body_put(b);
+}
+
+/* a PROTO_REL envelope from port: the frames that are next in its sequence go to peer_frame,
+   copies are dropped and the early ones are kept */
+void rel_receive(int port, uint32_t inc, uint32_t base, uint32_t seq, const char *frame, uint32_t len)
+{   struct rel_peer *p;
+    struct rel_in *ready[REL_WINDOW], *in;
+    struct proto_frame f;
+    int n = 0, i;
+
+    pthread_mutex_lock(&lock);
+    p = rel_peer_get(port, 1);
+    if (p->in_inc != inc) { // a new peer on this port, the same one restarted, or we did
+        for (i = 0; i < REL_WINDOW; i++) {
+            free(p->in[i]);
+            p->in[i] = NULL;
+        }
+        p->in_inc = inc;
+        p->expected = base; // everything before was acked by the peer we replaced
+        p->buffered = 0;
+    }
+    if (p->ack_due++ == 0)
+        p->ack_at = now_ms() + REL_ACK_DELAY;
+    if (seq - p->expected >= REL_WINDOW) { // a copy of a frame we passed on, or beyond the window
+        if ((int32_t) (seq - p->expected) < 0) {
+            metric_add(&metrics[M_DUPLICATES], 1);
+            p->ack_at = 0; // our ack was lost, send it again at once
+        }
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if (p->in[seq % REL_WINDOW] != NULL) { // a copy of a frame we keep
+        metric_add(&metrics[M_DUPLICATES], 1);
+        p->ack_at = 0;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if (seq == p->expected && p->buffered == 0) { // the usual case, passed on from the datagram
+        p->expected++;
+        pthread_mutex_unlock(&lock);
+        if (proto_parse(frame, len, &f) == 1)
+            peer_frame(&f);
+        return;
+    }
+    p->ack_at = 0; // a gap, the sender learns of it at once
+    in = malloc(sizeof(*in) + len);
+    if (in == NULL) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    in->len = len;
+    memcpy(in->data, frame, len);
+    p->in[seq % REL_WINDOW] = in;
+    p->buffered++;
+    while ((in = p->in[p->expected % REL_WINDOW]) != NULL) { // in order from the next one
+        p->in[p->expected % REL_WINDOW] = NULL;
+        p->expected++;
+        p->buffered--;
+        ready[n++] = in;
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < n; i++) { // peer_frame may multicast, so not with lock held
+        if (proto_parse(ready[i]->data, ready[i]->len, &f) == 1)
+            peer_frame(&f);
+        free(ready[i]);
+    }
+}
+
+// a round trip to p was rtt ms, the retransmit timeout follows it (srtt + 4 rttvar, as TCP)
+void rel_rtt(struct rel_peer *p, int rtt)
+{
+    if (p->srtt == 0) {
+        p->srtt = rtt + 1; // never 0 once measured
+        p->rttvar = rtt / 2 + 1;
+    }
+    else {
+        p->rttvar += (abs(p->srtt - rtt) - p->rttvar) / 4;
+        p->srtt += (rtt - p->srtt) / 8;
+    }
+    p->rto = p->srtt + 4 * p->rttvar; // also ends a backoff, it is alive and taking frames
+    if (p->rto < REL_RTO_MIN)
+        p->rto = REL_RTO_MIN;
+    if (p->rto > REL_RTO_MAX)
+        p->rto = REL_RTO_MAX;
+}
+
+// a PROTO_SACK of port: frees the acked frames, sends again the ones it is missing before the last
+// one it has (lost, not late) and what the window lets through
+void rel_ack(int port, uint32_t inc, uint32_t next, const uint32_t *bitmap, uint32_t wnd)
+{   struct rel_peer *p;
+    struct rel_out *out;
+    uint32_t seq, last = next;
+    long long now = now_ms();
+    int i, rtt = -1;
+
+    pthread_mutex_lock(&lock);
+    p = rel_peer_get(port, 0);
+    if (p == NULL || inc != incarnation || next - p->acked > p->next_seq - p->acked) {
+        pthread_mutex_unlock(&lock); // for an older incarnation of us, or nonsense
+        return;
+    }
+    for (seq = p->acked; seq != next; seq++) {
+        out = &p->out[seq % REL_WINDOW];
+        if (out->body != NULL && out->tries == 0)
+            rtt = now - out->sent;
+        rel_body_put(out->body);
+        out->body = NULL;
+    }
+    p->acked = next;
+    for (i = 0; i < REL_WINDOW - 1; i++) { // the frames it has after the gap
+        seq = next + 1 + i;
+        if (seq - p->acked >= p->next_seq - p->acked)
+            break;
+        if (!(bitmap[i / 32] & (1u << (i % 32))))
+            continue;
+        last = seq;
+        out = &p->out[seq % REL_WINDOW];
+        if (out->body != NULL && out->seq == seq) {
+            if (out->tries == 0)
+                rtt = now - out->sent;
+            rel_body_put(out->body);
+            out->body = NULL;
+        }
+    }
+    if (rtt >= 0)
+        rel_rtt(p, rtt);
+    for (seq = next; seq != last; seq++) { // frames after them came: lost, do not wait for the timer
+        out = &p->out[seq % REL_WINDOW];
+        if (out->body == NULL || out->tries > 0)
+            continue;
+        rel_send_one(p, out);
+        out->sent = now;
+        out->tries++;
+        metric_add(&metrics[M_RETRANSMITS], 1);
+    }
+    p->wnd = wnd;
+    rel_flush_queue(p);
+    pthread_mutex_unlock(&lock);
+}
+
+// answers with a PROTO_SACK the senders whose acks are due: after REL_ACK_DELAY ms, every
+// REL_ACK_EVERY frames, or at once for a gap or a copy
+void rel_send_acks()
+{   struct rel_peer *p;
+    char frame[SIZE];
+    struct proto_out o;
+    uint32_t bitmap[REL_WINDOW / 32];
+    long long now = now_ms();
+    int b, i;
+
+    pthread_mutex_lock(&lock);
+    for (b = 0; b < REL_BUCKETS; b++) {
+        for (p = rel_peers[b]; p != NULL; p = p->next) {
+            if (p->ack_due == 0 || (p->ack_due < REL_ACK_EVERY && p->ack_at > now))
+                continue;
+            p->ack_due = 0;
+            memset(bitmap, 0, sizeof(bitmap));
+            for (i = 0; p->buffered > 0 && i < REL_WINDOW - 1; i++) {
+                if (p->in[(p->expected + 1 + i) % REL_WINDOW] != NULL)
+                    bitmap[i / 32] |= 1u << (i % 32);
+            }
+            proto_init_out(&o, frame, sizeof(frame));
+            proto_begin(&o, PROTO_SACK, 0);
+            proto_put_u16(&o, serv_port);
+            proto_put_u32(&o, p->in_inc);
+            proto_put_u32(&o, p->expected);
+            for (i = 0; i < REL_WINDOW / 32; i++)
+                proto_put_u32(&o, bitmap[i]);
+            proto_put_u32(&o, REL_WINDOW - p->buffered);
+            if (proto_end(&o) >= 0) {
+                struct iovec iov = { o.buf, o.len };
+                trace_add(&trace, TRACE_DGRAM_OUT, 0, ntohs(p->addr.sin_port), o.buf, o.len);
+                if (shm_send(p, &iov, 1) < 0)
+                    sendto(udp_sock, o.buf, o.len, 0, (struct sockaddr *) &p->addr, sizeof(p->addr));
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// sends again the frames whose ack did not come in time
+void rel_timers()
+{   struct rel_peer *p;
+    struct rel_out *out;
+    long long now = now_ms();
+    uint32_t seq;
+    int b, backoff;
+
+    pthread_mutex_lock(&lock);
+    for (b = 0; b < REL_BUCKETS; b++) {
+        for (p = rel_peers[b]; p != NULL; p = p->next) {
+            backoff = 0;
+            for (seq = p->acked; seq != p->next_seq; seq++) {
+                out = &p->out[seq % REL_WINDOW];
+                if (out->body == NULL || out->sent + p->rto > now)
+                    continue;
+                if (seq == p->acked && out->tries > 0) // even the retransmit of the oldest was not acked
+                    backoff = 1;
+                rel_send_one(p, out);
+                out->sent = now;
+                out->tries++;
+                metric_add(&metrics[M_RETRANSMITS], 1);
+            }
+            if (backoff) // back off while it does not answer
+                p->rto = p->rto * 2 < REL_RTO_MAX ? p->rto * 2 : REL_RTO_MAX;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    rel_send_acks(); // the delayed ones
+}
+
+// milliseconds until the next retransmit or delayed ack, -1 if there is none
+int rel_next_timeout()
+{   struct rel_peer *p;
+    struct rel_out *out;
+    long long next = -1, now = now_ms();
+    uint32_t seq;
+    int b;
+
+    pthread_mutex_lock(&lock);
+    for (b = 0; b < REL_BUCKETS; b++) {
+        for (p = rel_peers[b]; p != NULL; p = p->next) {
+            for (seq = p->acked; seq != p->next_seq; seq++) {
+                out = &p->out[seq % REL_WINDOW];
+                if (out->body != NULL && (next < 0 || out->sent + p->rto < next))
+                    next = out->sent + p->rto;
+            }
+            if (p->ack_due > 0 && (next < 0 || p->ack_at < next))
+                next = p->ack_at;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    if (next < 0)
+        return -1;
+    return next > now ? (int) (next - now) : 0;
+}
+
+// sends one frame to every peer of the destination table with a single sendmmsg
+void multicast(const char *frame, int len)
+{   int i, n, sent = 0, count = 0, shared = 0;
+    struct mmsghdr msgs[MAX_PEERS];
+    struct iovec iov[MAX_PEERS][2];
+    char hdrs[MAX_PEERS][REL_HEADER];
+    struct rel_peer *p;
+    struct rel_body *body;
+    long long now = now_ms();
+    uint64_t start = metric_now_ns();
+
+    if (fanout != FANOUT_MESH) { // the table has our port too: we get our frames like the mesh does (our vote)
+        rel_unicast(serv_port, frame, len);
+        if (fanout == FANOUT_RELAY)
+            relay_send(frame, len);
+        else
+            tree_multicast(frame, len);
+        return;
+    }
+    body = rel_body_new(frame, len);
+    pthread_mutex_lock(&lock); //-->Total order multicast chat
+    memset(msgs, 0, number_of_dests * sizeof(msgs[0]));
+    for(i=0;i<number_of_dests;i++){ // all datagrams share the same frame, each has its own envelope
+        p = rel_peer_get(ntohs(dest_addr[i].sin_port), 1);
+        if (p->queue != NULL || !rel_can_send(p)) { // the window of this peer is full
+            rel_enqueue(p, body);
+            continue;
+        }
+        rel_header(hdrs[count], p, rel_track(p, body, now), len);
+        iov[count][0].iov_base = hdrs[count];
+        iov[count][0].iov_len = REL_HEADER;
+        iov[count][1].iov_base = body->data;
+        iov[count][1].iov_len = len;
+        msgs[count].msg_hdr.msg_name = &p->addr;
+        msgs[count].msg_hdr.msg_namelen = sizeof(p->addr);
+        msgs[count].msg_hdr.msg_iov = iov[count];
+        msgs[count].msg_hdr.msg_iovlen = 2;
+        trace_add2(&trace, TRACE_DGRAM_OUT, 0, ntohs(p->addr.sin_port), hdrs[count], REL_HEADER, body->data, len);
+        if (shm_send(p, iov[count], 2) == 0) { // a peer of this host, its slot is used by the next one
+            shared++;
+            continue;
+        }
+        count++;
+    }
+    while (sent < count) {
+        n = sendmmsg(udp_sock, msgs + sent, count - sent, MSG_CONFIRM);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { // socket buffer full, wait for room
+                struct pollfd pfd = { udp_sock, POLLOUT, 0 };
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            perror("Error on sendmmsg");
+            break; // the frames are in the windows, rel_timers sends them again
+        }
+        sent += n;
+    }
+    pthread_mutex_unlock(&lock);
+    rel_body_put(body);
+    metric_add(&metrics[M_DATAGRAMS_OUT], sent + shared);
+    metric_add(&metrics[M_BYTES_OUT], (int64_t) (sent + shared) * (REL_HEADER + len));
+    metric_observe(&metrics[M_MULTICAST], metric_now_ns() - start);
+}
+
+/* ---------- fan-out (-f relay, -f tree) ----------
+With the mesh a frame is one datagram to every peer, the sender pays for all of them. With -f relay it is
+one PROTO_RELAY frame to the server, which already has a TCP connection to every peer and writes the
+frames it got in one pass of its loop to each peer with one write. With -f tree the sender splits the
+other peers (by port, starting after its own) in tree_children parts and sends the frame in
+PROTO_FORWARD to the first peer of each part with the rest of the part, which does the same with its
+rest: log(N) hops, and no peer sends more than tree_children datagrams for a frame. Every hop is a reliable channel, and the
+frames of one sender take the same path while the members do not change, so they still arrive in
+order; a peer that leaves loses what it had not passed on yet, like a sender that leaves in the mesh.
+The modes can be mixed, a peer takes the frames from the server, the mesh and the trees alike. */
+
+// -f relay: the frame goes to all the other members through the server
+void relay_send(const char *frame, int len)
+{   char *buf;
+    struct proto_out o;
+
+    buf = malloc(PROTO_HEADER + len);
+    if (buf == NULL){
+        perror("Error on allocating relay frame");
+        exit(1);
+    }
+    proto_init_out(&o, buf, PROTO_HEADER + len);
+    proto_begin(&o, PROTO_RELAY, 0);
+    proto_put(&o, frame, len);
+    if (proto_end(&o) >= 0) {
+        send_server(o.buf, o.len);
+        metric_add(&metrics[M_RELAYED], 1);
+        metric_add(&metrics[M_BYTES_OUT], o.len);
+    }
+    free(buf);
+}
+
+// -f tree: our frame down our tree of all the other peers
+void tree_multicast(const char *frame, int len)
+{   uint16_t below[MAX_PEERS];
+    int n;
+
+    pthread_mutex_lock(&lock);
+    n = number_of_tree;
+    memcpy(below, tree_ports, n * sizeof(below[0]));
+    pthread_mutex_unlock(&lock);
+    tree_send(serv_port, (const char *) below, n, frame, len);
+}
+
+// a peer left (or joined again), a tree from an older list of members skips it (passes it on)
+void set_departed(int port, int gone)
+{
+    if (gone)
+        departed[port >> 3] |= 1 << (port & 7);
+    else
+        departed[port >> 3] &= ~(1 << (port & 7));
+}
+
+/* passes a frame of origin on to the n peers below (u16 ports, network order): tree_children parts,
+   the first member of each part gets the frame with the rest of its part */
+void tree_send(int origin, const char *below, int n, const char *frame, int len)
+{   char *buf;
+    struct proto_out o;
+    int part, first, last, cap = PROTO_HEADER + 4 + 2 * n + len;
+    uint16_t child = 0;
+
+    buf = malloc(cap);
+    if (buf == NULL){
+        perror("Error on allocating tree frame");
+        exit(1);
+    }
+    for (part = 0; part < tree_children; part++) {
+        first = part * n / tree_children;
+        last = (part + 1) * n / tree_children;
+        for (; first < last; first++) { // a peer that left is skipped, its part is not
+            memcpy(&child, below + 2 * first, 2);
+            child = ntohs(child);
+            if (!(departed[child >> 3] & (1 << (child & 7)))) // one we do not know yet may have just joined
+                break;
+        }
+        if (first == last)
+            continue;
+        proto_init_out(&o, buf, cap);
+        proto_begin(&o, PROTO_FORWARD, 0);
+        proto_put_u16(&o, origin);
+        proto_put_u16(&o, last - first - 1);
+        proto_put(&o, below + 2 * (first + 1), 2 * (last - first - 1));
+        proto_put(&o, frame, len);
+        if (proto_end(&o) >= 0)
+            rel_unicast(child, o.buf, o.len);
+    }
+    free(buf);
+}
+
+/* ---------- coalescing (-b) ----------
+The chat messages and acks the event loop multicasts go into one PROTO_BATCH datagram (up to
+BATCH_MTU) instead of one datagram each: a burst of /msg or the acks of a burst of received
+messages become a few datagrams, one sendmmsg and one ack per batch on the other side. A batch
+goes out at the end of the pass of the event loop that filled it, so a light load waits for
+nothing; only when the previous batch went out less than batch_us ago (heavy load) it waits until
+batch_us after that one, to fill up. A marker flushes the batch first (FIFO for the snapshot). */
+
+// multicasts a chat message or an ack, coalesced with the next ones when -b is on
+void batch_multicast(const char *frame, int len)
+{   long long now;
+
+    if (batch_us < 0) {
+        multicast(frame, len);
+        return;
+    }
+    if (batch.frames > 0 && batch.o.len + len > batch.o.cap)
+        batch_flush(); // full
+    if (batch.frames == 0) {
+        now = metric_now_ns() / 1000;
+        batch.deadline = now - batch.last_flush < batch_us ? batch.last_flush + batch_us : 0;
+        proto_init_out(&batch.o, batch.buf, sizeof(batch.buf));
+        proto_begin(&batch.o, PROTO_BATCH, 0);
+    }
+    proto_put(&batch.o, frame, len);
+    batch.frames++;
+}
+
+// sends the batch now
+void batch_flush()
+{
+    if (batch.frames == 0)
+        return;
+    if (batch.frames == 1) // alone, without the batch header
+        multicast(batch.o.buf + PROTO_HEADER, batch.o.len - PROTO_HEADER);
+    else if (proto_end(&batch.o) >= 0) {
+        multicast(batch.o.buf, batch.o.len);
+        metric_add(&metrics[M_BATCHES], 1);
+        metric_add(&metrics[M_BATCHED], batch.frames);
+    }
+    batch.frames = 0;
+    batch.last_flush = metric_now_ns() / 1000;
+}
+
+// end of a pass of the event loop: sends the batch unless it may still wait
+void batch_timers()
+{
+    if (batch.frames > 0 && batch.deadline <= (long long) (metric_now_ns() / 1000))
+        batch_flush();
+}
+
+// milliseconds until a batch that waits must go out, -1 if none
+int batch_next_timeout()
+{   long long now;
+
+    if (batch.frames == 0)
+        return -1;
+    now = metric_now_ns() / 1000;
+    return batch.deadline > now ? (int) ((batch.deadline - now + 999) / 1000) : 0;
+}
+
+// opens the UDP socket of the peer server
+void server_peer()
+{   struct sockaddr_in serv_addr;
+    int n;
+    
+    //connection for all peers
+    if ( (udp_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) { // UDP connection
+        perror("socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    n = 4 << 20; // room for bursts of messages and acks
+    setsockopt(udp_sock, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+    
+    memset(&serv_addr, 0, sizeof(serv_addr));
+      
+    // Filling server information
+    serv_addr.sin_family    = AF_INET; // IPv4
+    serv_addr.sin_addr = local_addr; // -a, or all of them
+    serv_addr.sin_port = htons(serv_port);
+      
+    // Bind the socket with the server address
+    if ( bind(udp_sock, (const struct sockaddr *)&serv_addr, 
+            sizeof(serv_addr)) < 0 )
+    {
+        perror("bind failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// reads the datagrams of the other peers when the socket is ready
+void peer_messages(int sock)
+{   int n;
+    static char buffer[1 << 16]; // a datagram, PROTO_FORWARD adds the ports below to a batch
+    socklen_t len;
+    struct sockaddr_in cli_addr;
+    
+    while(1) {
+        /* read datagram into buffer*/
+        len = sizeof(cli_addr);
+        n = recvfrom(sock, (char *)buffer, sizeof(buffer), 
+                0, ( struct sockaddr *) &cli_addr,
+                &len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            rel_send_acks(); // drained, the acks of the whole batch
+            return;
+        }
+        peer_datagram(buffer, n, ntohs(cli_addr.sin_port));
+    }
+}
+
+// one datagram of the peer on port from, by UDP or through our shared memory
+void peer_datagram(char *buffer, int n, int from)
+{   int port;
+    struct proto_frame f, inner;
+    struct proto_in in;
+    uint32_t inc, base, seq, next, bitmap[REL_WINDOW / 32], wnd;
+
+    trace_add(&trace, TRACE_DGRAM_IN, 0, from, buffer, n);
+    if (loss_percent > 0 && rand() % 100 < loss_percent) // -l: lost on the way
+        return;
+    // one datagram = one frame
+    metric_add(&metrics[M_DATAGRAMS_IN], 1);
+    metric_add(&metrics[M_BYTES_IN], n);
+    if (proto_parse(buffer, n, &f) != 1)
+        return;
+    proto_init_in(&in, &f);
+    port = proto_get_u16(&in);
+    if (f.kind == PROTO_REL) { // a frame of port, in its sequence
+        inc = proto_get_u32(&in);
+        base = proto_get_u32(&in);
+        seq = proto_get_u32(&in);
+        if (!in.err && proto_parse(in.p, in.left, &inner) == 1)
+            rel_receive(port, inc, base, seq, in.p, PROTO_HEADER + inner.len);
+    }
+    else if (f.kind == PROTO_SACK) { // port got our frames up to next
+        inc = proto_get_u32(&in);
+        next = proto_get_u32(&in);
+        for (n = 0; n < REL_WINDOW / 32; n++)
+            bitmap[n] = proto_get_u32(&in);
+        wnd = proto_get_u32(&in);
+        if (!in.err)
+            rel_ack(port, inc, next, bitmap, wnd);
+    }
+    else
+        peer_frame(&f);
+}
+
+/* ---------- shared memory (-M) ----------
+The peers of one host do not need the UDP stack to talk: with -M every peer has a ring for each peer of
+the host that writes to it in its shared memory (shm.h), and the datagrams of the reliable channel (frames,
+acks, retransmits) go there instead of sendmsg. A peer tries the shared memory of the peers it reaches by
+loopback or by its own address (-a), once a second until it is there; one that is on another host, or
+runs without -M, or whose ring is full, gets the datagram by UDP, and the reliable channel takes the frames
+from both in its order. The event loop reads the rings at every pass; only when it is about to sleep a
+writer has to wake it, through the futex of the shared memory, shm_thread and shm_fd. */
+
+// 1 when the peer is on this host as far as we can tell: loopback or the address we bind (-a)
+int shm_local(struct rel_peer *p)
+{
+    return (ntohl(p->addr.sin_addr.s_addr) >> 24) == 127
+           || (local_addr.s_addr != INADDR_ANY && p->addr.sin_addr.s_addr == local_addr.s_addr);
+}
+
+// writes a datagram for p to its shared memory, -1 when it has none or no room (then it goes by UDP),
+// called with lock held: the ring has one writer
+int shm_send(struct rel_peer *p, struct iovec *iov, int iovcnt)
+{   long long now;
+
+    if (shm_box == NULL)
+        return -1;
+    if (p->shm == NULL) {
+        if (!shm_local(p) || (now = now_ms()) < p->shm_retry)
+            return -1;
+        p->shm_retry = now + 1000;
+        if ((p->shm = shm_attach(p->port, serv_port, &p->shm_box)) == NULL)
+            return -1;
+    }
+    if (shm_put(p->shm, iov, iovcnt) < 0)
+        return -1;
+    shm_ring_bell(p->shm_box);
+    metric_add(&metrics[M_SHM_OUT], 1);
+    return 0;
+}
+
+// the datagrams the peers of this host wrote to us, a burst of each ring per pass
+void shm_messages()
+{   static char buffer[1 << 16];
+    uint32_t i, used;
+    int n, k, got = 0;
+
+    if (shm_box == NULL)
+        return;
+    used = __atomic_load_n(&shm_box->used, __ATOMIC_ACQUIRE);
+    for (i = 0; i < used; i++) {
+        for (k = 0; k < REL_WINDOW && (n = shm_get(&shm_box->rings[i], buffer, sizeof(buffer))) > 0; k++, got++) {
+            metric_add(&metrics[M_SHM_IN], 1);
+            peer_datagram(buffer, n, shm_box->rings[i].owner);
+        }
+    }
+    if (got > 0)
+        rel_send_acks();
+}
+
+// waits on the futex of our shared memory, a writer rang it because the event loop sleeps
+void *shm_thread(void *arg)
+{   uint32_t seen = 0;
+
+    while (1) {
+        seen = shm_wait(shm_box, seen);
+        eventfd_write(shm_fd, 1);
+    }
+    return NULL;
+}
+
+// the frames of a PROTO_BATCH, the chat messages in it get one ack and one DB write
+void peer_batch(struct proto_frame *f)
+{   struct proto_frame inner;
+    uint32_t off = 0;
+
+    batch.receiving = 1;
+    batch.chats = 0;
+    while (off < f->len && proto_parse(f->payload + off, f->len - off, &inner) == 1) {
+        off += PROTO_HEADER + inner.len;
+        peer_frame(&inner);
+    }
+    batch.receiving = 0;
+    if (batch.chats > 0)
+        send_ack(0); // our clock is past all of them
+    deliver();
+}
+
+// chat message, edit request or vote of another peer
+void peer_frame(struct proto_frame *f)
+{   char message[SIZE];
+    struct proto_in in;
+    int port, entry, vote;
+    uint64_t ts, txn;
+
+    if (f->kind == PROTO_BATCH && !batch.receiving) {
+        peer_batch(f);
+        return;
+    }
+    proto_init_in(&in, f);
+    port = proto_get_u16(&in);
+    if(f->kind == PROTO_EDIT_REQ){
+        txn = proto_get_u64(&in);
+        entry = (int) proto_get_u32(&in);
+        proto_get_cstr(&in, message, SIZE);
+        if (!in.err)
+            edit_prepare(port, txn, entry, message);
+    }
+    else if(f->kind == PROTO_VOTE){
+        txn = proto_get_u64(&in);
+        vote = proto_get_u8(&in);
+        if (!in.err)
+            edit_vote(port, txn, vote);
+    }
+    else if(f->kind == PROTO_CHAT){
+        ts = proto_get_u64(&in);
+        proto_get_cstr(&in, message, SIZE);
+        if (in.err || port == serv_port) // our own message is already held back
+            return;
+        hop_record(&hops, HOP_RECEIVED, hop_id(port, ts), 0);
+        if (snapshot_recording(port)) // sent before the marker of port, after our state
+            snapshot_record(port, ts, message);
+        // the new messages of the chat wait for their turn
+        clock_seen(port, ts);
+        if (!xfer_covered(ts, port)) // not in the DB this peer got when it joined
+            holdback_push(ts, port, message);
+        if (batch.receiving) { // one ack and one delivery for the whole batch
+            batch.chats++;
+            return;
+        }
+        send_ack(0);
+        deliver();
+    }
+    else if(f->kind == PROTO_ACK){
+        ts = proto_get_u64(&in);
+        if (in.err || port == serv_port)
+            return;
+        clock_seen(port, ts);
+        if (f->flags & PROTO_ACK_JOIN)
+            xfer_join_ack(port, ts);
+        if (f->flags & PROTO_ACK_ASK) // a donor waits for our clock
+            send_ack(0);
+        if (!batch.receiving)
+            deliver();
+    }
+    else if(f->kind == PROTO_EDIT_COMMIT){
+        txn = proto_get_u64(&in);
+        entry = (int) proto_get_u32(&in);
+        proto_get_cstr(&in, message, SIZE);
+        if (!in.err)
+            edit_finish(port, txn, PROTO_GO, entry, message);
+    }
+    else if(f->kind == PROTO_EDIT_ABORT){
+        txn = proto_get_u64(&in);
+        if (!in.err)
+            edit_finish(port, txn, PROTO_ABORT, 0, NULL);
+    }
+    else if(f->kind == PROTO_FORWARD){ // a frame of port in its tree: ours, and on to the peers below us
+        struct proto_frame inner;
+        uint32_t n = proto_get_u16(&in);
+        const char *below = proto_get(&in, 2 * n);
+        if (below == NULL || proto_parse(in.p, in.left, &inner) != 1)
+            return;
+        if (n > 0) {
+            tree_send(port, below, n, in.p, PROTO_HEADER + inner.len);
+            metric_add(&metrics[M_FORWARDED], 1);
+        }
+        peer_frame(&inner);
+    }
+    else if(f->kind == PROTO_MARKER){ // the snapshot reached port before its later messages
+        uint32_t snap_id = proto_get_u32(&in);
+        int full = proto_get_u8(&in);
+        uint32_t last_complete = proto_get_u32(&in);
+        if (!in.err && port != serv_port)
+            snapshot_marker(port, snap_id, full, last_complete);
+    }
+}
+
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// sending to server the local state i order to create global consistent states
+void consistent(char* message, int entry, int option){
+    char frame[SIZE*2];
+    struct proto_out o;
+    
+    proto_init_out(&o, frame, sizeof(frame));
+    proto_begin(&o, PROTO_STATE, 0);
+    proto_put_u8(&o, option); // 1 = /msg, 2 = /edit
+    proto_put_u64(&o, lamport); // TS
+    proto_put_u32(&o, entry);
+    proto_put_str(&o, message, strlen(message));
+    if (proto_end(&o) >= 0)
+        send_server(o.buf, o.len); // we write the message we received to server with its TS
 }
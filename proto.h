@@ -0,0 +1,311 @@
+/*
+Wire protocol shared by the server and the peers.
+
+Every frame is an 8 byte header followed by the payload:
+    byte 0     PROTO_MAGIC (never '/', so a text client is told apart by its first byte)
+    byte 1     PROTO_VERSION
+    byte 2     kind (enum proto_kind)
+    byte 3     flags
+    bytes 4-7  payload length, network order
+Integers in the payloads are in network order, strings are a u16 length and the bytes (no '\0'),
+so a message may contain '|', '-' or any other character.
+
+The server greets with one text line ending in '\n' and then a peer talks in frames.
+A connection whose first byte is '/' stays in the old text mode (/help, /list, /msg ... lines)
+for interactive use, e.g. with telnet or nc.
+
+Frames are parsed in place: proto_next() returns pointers into the receive buffer and
+waits for more bytes when a frame is cut by the read.
+*/
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define PROTO_MAGIC 0xFA
+#define PROTO_VERSION 1
+#define PROTO_HEADER 8
+#define PROTO_MAX_PAYLOAD (1 << 20)
+
+enum proto_kind {
+    PROTO_HELLO = 1,    // peer -> server: u16 port, u32 IPv4 address (0: the one the server sees)
+    PROTO_COMMAND,      // peer -> server: str line (/help, /list, /exit ...)
+    PROTO_TEXT,         // server -> peer: str text to print
+    PROTO_PEER_LIST,    // server -> peer: u32 epoch, u32 count, count * (u32 id, u16 port, u32 address) all the members
+    PROTO_STATE,        // peer -> server: u8 option (1 msg, 2 edit), u64 TS, i32 entry, str message
+    PROTO_CHAT,         // peer -> peer: u16 port, u64 TS, str message
+    PROTO_EDIT_REQ,     // peer -> peer: u16 port, u64 txn, i32 entry, str message
+    PROTO_VOTE,         // peer -> peer: u16 port, u64 txn, u8 vote (PROTO_GO or PROTO_ABORT)
+    PROTO_EDIT_COMMIT,  // peer -> peer: u16 port, u64 txn, i32 entry, str message (all voted /GO)
+    PROTO_ACK,          // peer -> peer: u16 port, u64 TS (Lamport clock after a chat message)
+    PROTO_EDIT_ABORT,   // peer -> peer: u16 port, u64 txn (an /ABORT or the votes timed out)
+    PROTO_MARKER,       // server -> peer, peer -> peer: u16 port (0 server), u32 snapshot, u8 full, u32 last complete
+    PROTO_SNAP_STATE,   // peer -> server: u32 snapshot, u8 full, u64 TS, u32 key, u32 n, n * (u32 entry, u32 version, str)
+    PROTO_SNAP_CHANNEL, // peer -> server: u32 snapshot, u32 n, n * (u16 port, u64 TS, str) chat not yet delivered, last report
+    PROTO_SYNC_REQ,     // peer -> server: u32 key (entries the peer has)
+    PROTO_SYNC,         // server -> peer: u64 TS, u32 n, n * (u32 entry, u32 version, str)
+    PROTO_SYNC_DONE,    // server -> peer: u32 snapshot, u32 entries sent
+    PROTO_MEMBER,       // server -> peer: u32 epoch, u8 op (PROTO_JOIN or PROTO_LEAVE), u32 id, u16 port, u32 address
+    PROTO_REL,          // peer -> peer: u16 port, u32 incarnation, u32 base (oldest not acked), u32 seq, the frame
+    PROTO_SACK,         // peer -> peer: u16 port, u32 incarnation acked, u32 next seq, 8 * u32 bitmap of next+1.., u32 window
+    PROTO_BATCH,        // peer -> peer: whole frames (chat and acks) one after the other, up to a datagram
+    PROTO_XFER_REQ,     // peer -> peer (TCP): u16 port, u64 cut TS, u16 cut port, u64 TS (clock of the joiner)
+    PROTO_XFER_CHUNK,   // peer -> peer (TCP): u32 n, u32 bytes, u32 crc32, the bytes lz compressed: n * (u32 entry, u32 version, str)
+    PROTO_XFER_DONE,    // peer -> peer (TCP): u64 cut TS, u16 cut port, u32 key, u32 entries sent
+    PROTO_RELAY,        // peer -> server: whole frames, the server writes them as they are to all the other members
+                        // (server -> server: the frames of its members, for the members of the other one)
+    PROTO_FORWARD,      // peer -> peer: u16 port (origin), u16 n, n * u16 ports below us in its tree, the frame
+    PROTO_REDIRECT,     // server -> peer: u32 address, u16 port of the server of the cluster that has this peer
+    PROTO_SERVER_HELLO, // server -> server: u16 index in the cluster list (-c), the first frame of a link
+    PROTO_SERVER_MEMBER,// server -> server: u8 op (PROTO_JOIN or PROTO_LEAVE), u32 id, u16 port, u32 address
+    PROTO_SERVER_REPORT // server -> server: u16 port, the PROTO_STATE or PROTO_SNAP_* frame of a member
+};
+
+#define PROTO_GO 0
+#define PROTO_ABORT 1
+
+#define PROTO_JOIN 0
+#define PROTO_LEAVE 1
+
+// flags of PROTO_HELLO
+#define PROTO_HELLO_MOVED 1 // the peer was redirected or its server is gone: it stays a member, no new join
+
+// flags of PROTO_ACK
+#define PROTO_ACK_JOIN 1 // the first ack to a peer that joined: its TS is where the chat of the joiner starts
+#define PROTO_ACK_ASK 2  // answer with an ack, the clocks of all the peers have to pass this one
+
+struct proto_frame { /*a parsed frame, payload points into the reader buffer*/
+    uint8_t kind, flags;
+    uint32_t len;
+    const char *payload;
+};
+
+struct proto_reader { /*receive buffer of a stream, frames are parsed from buf+off*/
+    char *buf;
+    uint32_t off, len, cap;
+};
+
+struct proto_out { /*frames being built, err is set when buf is too small*/
+    char *buf;
+    uint32_t len, cap, start;
+    int err;
+};
+
+struct proto_in { /*cursor over a payload*/
+    const char *p;
+    uint32_t left;
+    int err;
+};
+
+/* ---------- building frames ---------- */
+
+static inline void proto_init_out(struct proto_out *o, char *buf, uint32_t cap)
+{
+    o->buf = buf;
+    o->cap = cap;
+    o->len = 0;
+    o->start = 0;
+    o->err = 0;
+}
+
+static inline void proto_put(struct proto_out *o, const void *data, uint32_t n)
+{
+    if (o->err || o->len + n > o->cap) {
+        o->err = 1;
+        return;
+    }
+    memcpy(o->buf + o->len, data, n);
+    o->len += n;
+}
+
+static inline void proto_put_u8(struct proto_out *o, uint8_t v)
+{
+    proto_put(o, &v, 1);
+}
+
+static inline void proto_put_u16(struct proto_out *o, uint16_t v)
+{
+    v = htons(v);
+    proto_put(o, &v, 2);
+}
+
+static inline void proto_put_u32(struct proto_out *o, uint32_t v)
+{
+    v = htonl(v);
+    proto_put(o, &v, 4);
+}
+
+static inline void proto_put_u64(struct proto_out *o, uint64_t v)
+{
+    proto_put_u32(o, (uint32_t) (v >> 32));
+    proto_put_u32(o, (uint32_t) v);
+}
+
+static inline void proto_put_str(struct proto_out *o, const char *s, uint32_t n)
+{
+    if (n > 0xFFFF)
+        n = 0xFFFF;
+    proto_put_u16(o, (uint16_t) n);
+    proto_put(o, s, n);
+}
+
+// starts a frame, the length is filled in by proto_end
+static inline void proto_begin(struct proto_out *o, uint8_t kind, uint8_t flags)
+{
+    o->start = o->len;
+    proto_put_u8(o, PROTO_MAGIC);
+    proto_put_u8(o, PROTO_VERSION);
+    proto_put_u8(o, kind);
+    proto_put_u8(o, flags);
+    proto_put_u32(o, 0);
+}
+
+// closes the frame started by proto_begin, returns the bytes of the buffer or -1
+static inline int proto_end(struct proto_out *o)
+{
+    uint32_t n;
+
+    if (o->err)
+        return -1;
+    n = htonl(o->len - o->start - PROTO_HEADER);
+    memcpy(o->buf + o->start + 4, &n, 4);
+    return (int) o->len;
+}
+
+/* ---------- reading payloads ---------- */
+
+static inline void proto_init_in(struct proto_in *in, const struct proto_frame *f)
+{
+    in->p = f->payload;
+    in->left = f->len;
+    in->err = 0;
+}
+
+static inline const char *proto_get(struct proto_in *in, uint32_t n)
+{
+    const char *p = in->p;
+
+    if (in->err || in->left < n) {
+        in->err = 1;
+        return NULL;
+    }
+    in->p += n;
+    in->left -= n;
+    return p;
+}
+
+static inline uint8_t proto_get_u8(struct proto_in *in)
+{
+    const char *p = proto_get(in, 1);
+    return p ? (uint8_t) p[0] : 0;
+}
+
+static inline uint16_t proto_get_u16(struct proto_in *in)
+{
+    uint16_t v;
+    const char *p = proto_get(in, 2);
+    if (p == NULL)
+        return 0;
+    memcpy(&v, p, 2);
+    return ntohs(v);
+}
+
+static inline uint32_t proto_get_u32(struct proto_in *in)
+{
+    uint32_t v;
+    const char *p = proto_get(in, 4);
+    if (p == NULL)
+        return 0;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static inline uint64_t proto_get_u64(struct proto_in *in)
+{
+    uint64_t hi = proto_get_u32(in);
+    return (hi << 32) | proto_get_u32(in);
+}
+
+// returns the string in place (not '\0' terminated), its length in *n
+static inline const char *proto_get_str(struct proto_in *in, uint32_t *n)
+{
+    *n = proto_get_u16(in);
+    return proto_get(in, *n);
+}
+
+// copies a string of the payload into dst as a C string, cut to size-1
+static inline void proto_get_cstr(struct proto_in *in, char *dst, uint32_t size)
+{
+    uint32_t n;
+    const char *s = proto_get_str(in, &n);
+
+    if (s == NULL)
+        n = 0;
+    if (n > size - 1)
+        n = size - 1;
+    memcpy(dst, s, n);
+    dst[n] = '\0';
+}
+
+/* ---------- parsing a stream ---------- */
+
+// makes room for at least n more bytes at buf+len, returns -1 when out of memory
+static inline int proto_reserve(struct proto_reader *r, uint32_t n)
+{
+    if (r->off > 0 && r->len + n > r->cap) { // drop what was already parsed
+        memmove(r->buf, r->buf + r->off, r->len - r->off);
+        r->len -= r->off;
+        r->off = 0;
+    }
+    if (r->len + n > r->cap) {
+        uint32_t cap = r->cap ? r->cap : 4096;
+        while (cap < r->len + n)
+            cap *= 2;
+        char *tmp = realloc(r->buf, cap);
+        if (tmp == NULL)
+            return -1;
+        r->buf = tmp;
+        r->cap = cap;
+    }
+    return 0;
+}
+
+/* returns 1 and fills f when a whole frame is buffered, 0 when more bytes are needed
+   and -1 on a frame that is not ours (bad magic, version or length) */
+static inline int proto_parse(const char *data, uint32_t avail, struct proto_frame *f)
+{
+    uint32_t n;
+
+    if (avail < PROTO_HEADER)
+        return 0;
+    if ((uint8_t) data[0] != PROTO_MAGIC || (uint8_t) data[1] != PROTO_VERSION)
+        return -1;
+    memcpy(&n, data + 4, 4);
+    n = ntohl(n);
+    if (n > PROTO_MAX_PAYLOAD)
+        return -1;
+    if (avail < PROTO_HEADER + n)
+        return 0;
+    f->kind = (uint8_t) data[2];
+    f->flags = (uint8_t) data[3];
+    f->len = n;
+    f->payload = data + PROTO_HEADER;
+    return 1;
+}
+
+// next frame of a stream, the payload stays valid until the next proto_reserve
+static inline int proto_next(struct proto_reader *r, struct proto_frame *f)
+{
+    int n = proto_parse(r->buf + r->off, r->len - r->off, f);
+
+    if (n == 1)
+        r->off += PROTO_HEADER + f->len;
+    if (r->off == r->len) // everything parsed, start again from the beginning
+        r->off = r->len = 0;
+    return n;
+}
+
+#endif
@@ -0,0 +1,501 @@
+/*
+Replay of a traffic trace (trace.h) that the server or a peer recorded with -T.
+
+A server trace is replayed against a fresh server: replay opens a connection for every connection of
+the trace and writes what the peers sent, in the order of the trace. A peer trace is replayed into a fresh
+peer that replay starts with -e: replay is its server (it listens on -P, the peer needs -S 127.0.0.1:port)
+and the other peers (their datagrams go to the port of the peer from a socket on the port of the sender),
+and it types the commands the user typed. The peer picks a new incarnation for its reliable channels on
+every start: the acks of the other peers in the trace name the one of the recording and replay puts the
+new one (the one in the datagrams of the peer) in their place. The datagrams of the peer to itself are
+its own business and are not replayed.
+
+-x is the speed: 1 = as recorded, 10 = ten times faster, 0 (default) = as fast as possible in lockstep:
+before every input replay waits until the program has written (on every connection, and in datagrams) as
+many frames as it had at that point of the trace, so every input meets the state it met in the recording
+and the order of the events is the same at any speed. An answer that does not come in -w ms is a stall
+and the replay goes on.
+
+The result is one JSON object like bench_load: the time of the replay against the time of the trace,
+inputs/sec, p50/p99 of the time until the answers to an input came (lockstep) and the frames the program
+wrote against the ones of the trace, with the kinds that differ. E.g. to compare two builds of the server:
+    ./bench_load -T load.trace ...         (or ./server -s 0 -T load.trace and the peers)
+    ./server -s 0 & ./replay load.trace >> results.jsonl
+The server must start empty (no checkpoints) with the options of the recording; the snapshots of its
+timer and the links of a cluster are not inputs of the trace and are not replayed. A peer starts with no
+DB (its state transfer from the other peers is not in the trace).
+
+compile: gcc replay.c -o replay
+Run: ./replay trace [-x speed] [-w stall ms] [-s server address:port] (a server trace)
+     ./replay trace -e "peer command" [-P port] [-x speed] [-w stall ms] (a peer trace)
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "proto.h"
+#include "trace.h"
+#include "samples.h"
+
+#define MAX_POLL 4096
+
+struct stream { /*frames counted on the bytes of one direction of a connection*/
+    struct proto_reader r;
+    int line; // a text line first (the welcome of the server)
+    int text; // a text client: one line = one answer
+    long frames;
+};
+
+struct conn { /*a connection of the trace*/
+    int fd; // ours, -1 = not open
+    int sent; // bytes written to it
+    struct stream want, got; // what the program wrote in the trace, and now
+};
+
+struct udp { /*the socket of another peer, on its port*/
+    int port, fd;
+};
+
+struct conn *conns;
+int conns_cap;
+struct udp udps[MAX_POLL];
+int number_of_udps;
+long want_kinds[256], got_kinds[256]; // frames (0 = text lines) of the trace and of the replay, by kind
+long want_dgrams, got_dgrams;
+uint32_t old_incarnation, new_incarnation; // of the reliable channels of the peer, in the trace and now
+int role, peer_port, listen_fd = -1, stall_ms = 1000;
+struct sockaddr_in server_addr;
+FILE *peer_in; // stdin of the peer (-e)
+struct samples answers;
+long stalls;
+
+long long now_us()
+{   struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// the connection number n of the trace
+struct conn *conn_get(uint32_t n)
+{
+    if (n >= (uint32_t) conns_cap) {
+        int cap = conns_cap ? conns_cap : 64, i;
+        while ((uint32_t) cap <= n)
+            cap *= 2;
+        conns = realloc(conns, cap * sizeof(*conns));
+        if (conns == NULL) {
+            perror("Error on allocating connections");
+            exit(1);
+        }
+        memset(conns + conns_cap, 0, (cap - conns_cap) * sizeof(*conns));
+        for (i = conns_cap; i < cap; i++)
+            conns[i].fd = -1;
+        conns_cap = cap;
+    }
+    return &conns[n];
+}
+
+// counts the frames (or lines) in len more bytes of s, into kinds
+void stream_feed(struct stream *s, const char *data, uint32_t len, long *kinds)
+{
+    struct proto_frame f;
+    char *end;
+    int n;
+
+    if (proto_reserve(&s->r, len) < 0) {
+        perror("Error on allocating stream");
+        exit(1);
+    }
+    memcpy(s->r.buf + s->r.len, data, len);
+    s->r.len += len;
+    while (s->line || s->text) {
+        end = memchr(s->r.buf + s->r.off, '\n', s->r.len - s->r.off);
+        if (end == NULL)
+            break;
+        s->r.off = end - s->r.buf + 1;
+        s->line = 0;
+        s->frames++;
+        kinds[0]++;
+    }
+    if (s->text || s->line) {
+        if (s->r.off == s->r.len)
+            s->r.off = s->r.len = 0;
+        return;
+    }
+    while ((n = proto_next(&s->r, &f)) == 1) {
+        s->frames++;
+        kinds[f.kind]++;
+    }
+    if (n < 0) // not a frame, nothing after it can be counted
+        s->r.off = s->r.len = 0;
+}
+
+void stream_reset(struct stream *s, int line)
+{
+    s->r.off = s->r.len = 0;
+    s->line = line;
+    s->text = 0;
+    s->frames = 0;
+}
+
+// the socket of the other peer on port (datagrams from it and to it), -1 when the port is taken
+int udp_get(int port)
+{
+    struct sockaddr_in addr;
+    int i, fd;
+
+    for (i = 0; i < number_of_udps; i++) {
+        if (udps[i].port == port)
+            return udps[i].fd;
+    }
+    if (number_of_udps == MAX_POLL)
+        return -1;
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (fd >= 0 && bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    udps[number_of_udps].port = port;
+    udps[number_of_udps++].fd = fd;
+    return fd;
+}
+
+// the incarnation of the sender of PROTO_REL, or the acked one of PROTO_SACK (after the u16 port)
+uint32_t incarnation_of(struct proto_frame *f)
+{
+    uint32_t inc;
+
+    memcpy(&inc, f->payload + 2, 4);
+    return ntohl(inc);
+}
+
+// reads what the program wrote until timeout ms pass with nothing (0 = only what is there)
+void pump(int timeout)
+{
+    struct pollfd pfds[MAX_POLL];
+    struct conn *c[MAX_POLL];
+    char buffer[1 << 16];
+    struct proto_frame f;
+    int i, n, count = 0;
+
+    for (i = 0; i < conns_cap && count < MAX_POLL; i++) {
+        if (conns[i].fd >= 0) {
+            c[count] = &conns[i];
+            pfds[count].fd = conns[i].fd;
+            pfds[count++].events = POLLIN;
+        }
+    }
+    for (i = 0; i < number_of_udps && count < MAX_POLL; i++) {
+        if (udps[i].fd >= 0) {
+            c[count] = NULL;
+            pfds[count].fd = udps[i].fd;
+            pfds[count++].events = POLLIN;
+        }
+    }
+    if (poll(pfds, count, timeout) <= 0)
+        return;
+    for (i = 0; i < count; i++) {
+        if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        if (c[i] == NULL) { // datagrams of the peer to another one
+            while ((n = recv(pfds[i].fd, buffer, sizeof(buffer), 0)) > 0) {
+                got_dgrams++;
+                if (proto_parse(buffer, n, &f) == 1) {
+                    got_kinds[f.kind]++;
+                    if (f.kind == PROTO_REL && f.len >= 6)
+                        new_incarnation = incarnation_of(&f);
+                }
+            }
+            continue;
+        }
+        while ((n = recv(c[i]->fd, buffer, sizeof(buffer), 0)) > 0)
+            stream_feed(&c[i]->got, buffer, n, got_kinds);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) { // the program closed it
+            close(c[i]->fd);
+            c[i]->fd = -1;
+        }
+    }
+}
+
+// 1 when the program has written everything it had written at this point of the trace
+int answered()
+{
+    int i;
+
+    if (got_dgrams < want_dgrams)
+        return 0;
+    for (i = 0; i < conns_cap; i++) {
+        if (conns[i].fd >= 0 && conns[i].got.frames < conns[i].want.frames)
+            return 0;
+    }
+    return 1;
+}
+
+// lockstep: waits up to stall_ms for the answers to the last input (sent at us)
+void wait_answers(long long since, int due)
+{
+    long long deadline = now_us() + stall_ms * 1000LL;
+
+    pump(0);
+    while (!answered()) {
+        if (now_us() >= deadline) {
+            stalls++;
+            return;
+        }
+        pump(1);
+    }
+    if (due)
+        sample_add(&answers, now_us() - since);
+}
+
+// writes all of data to fd, reading the program meanwhile so that neither side blocks
+void write_all(int fd, const char *data, uint32_t len)
+{
+    int n;
+
+    while (len > 0) {
+        n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            pump(1);
+            continue;
+        }
+        if (n < 0)
+            return;
+        data += n;
+        len -= n;
+    }
+}
+
+// a connection of the trace starts: we dial the server, or the peer dials us
+void replay_open(struct conn *c)
+{
+    int fd, one = 1, waited;
+
+    if (c->fd >= 0)
+        close(c->fd);
+    stream_reset(&c->want, role == 'S');
+    stream_reset(&c->got, role == 'S');
+    c->sent = 0;
+    if (role == 'S') {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+            perror("Error on connecting to server");
+            exit(1);
+        }
+    }
+    else {
+        for (waited = 0; (fd = accept(listen_fd, NULL, NULL)) < 0; waited += 10) {
+            if (waited > 10000) {
+                fprintf(stderr, "The peer did not connect\n");
+                exit(1);
+            }
+            usleep(10000);
+        }
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    c->fd = fd;
+}
+
+// one input of the trace goes to the program
+void replay_input(struct trace_rec *r)
+{
+    struct conn *c = conn_get(r->conn);
+    struct sockaddr_in to;
+    struct proto_frame f;
+    long long deadline;
+    uint32_t inc;
+    int fd;
+
+    if (r->kind == TRACE_OPEN)
+        replay_open(c);
+    else if (r->kind == TRACE_CLOSE && c->fd >= 0) {
+        deadline = now_us() + stall_ms * 1000LL; // the last answers on it come first (timed replay)
+        pump(0);
+        while (c->fd >= 0 && c->got.frames < c->want.frames && now_us() < deadline)
+            pump(1);
+        if (c->fd < 0) // the program closed it
+            return;
+        close(c->fd);
+        c->fd = -1;
+    }
+    else if (r->kind == TRACE_IN && c->fd >= 0) {
+        if (c->sent == 0 && role == 'S' && r->len > 0 && (uint8_t) r->data[0] != PROTO_MAGIC)
+            c->want.text = c->got.text = 1; // a text client, the server answers it in lines
+        write_all(c->fd, r->data, r->len);
+        c->sent += r->len;
+    }
+    else if (r->kind == TRACE_DGRAM_IN && r->port != peer_port) {
+        if (proto_parse(r->data, r->len, &f) == 1 && f.kind == PROTO_SACK && f.len >= 6
+            && incarnation_of(&f) == old_incarnation && new_incarnation != 0) {
+            inc = htonl(new_incarnation); // acks our frames of this run
+            memcpy(r->data + PROTO_HEADER + 2, &inc, 4);
+        }
+        memset(&to, 0, sizeof(to));
+        to.sin_family = AF_INET;
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        to.sin_port = htons(peer_port);
+        if ((fd = udp_get(r->port)) < 0)
+            fd = udp_get(0);
+        sendto(fd, r->data, r->len, 0, (struct sockaddr *) &to, sizeof(to));
+    }
+    else if (r->kind == TRACE_STDIN && peer_in != NULL) {
+        fwrite(r->data, 1, r->len, peer_in);
+        fflush(peer_in);
+    }
+}
+
+// an output of the trace: what the program wrote then, the replay must see it too
+void replay_output(struct trace_rec *r)
+{
+    struct conn *c = conn_get(r->conn);
+    struct proto_frame f;
+
+    if (r->kind == TRACE_OUT && c->fd >= 0)
+        stream_feed(&c->want, r->data, r->len, want_kinds);
+    else if (r->kind == TRACE_DGRAM_OUT && proto_parse(r->data, r->len, &f) == 1) {
+        if (f.kind == PROTO_REL && f.len >= 6)
+            old_incarnation = incarnation_of(&f);
+        if (udp_get(r->port) >= 0) { // a port we could not take (ours) is not counted
+            want_dgrams++;
+            want_kinds[f.kind]++;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{   int opt, n, i, due = 0, port = 7000, first = 1;
+    double speed = 0, elapsed, trace_seconds = 0;
+    char *command = NULL, *colon, *data = NULL;
+    uint32_t cap = 0;
+    uint16_t header_port;
+    char file_role;
+    long records = 0, inputs = 0, want = 0, got = 0;
+    long long start, at = 0;
+    struct trace_rec r;
+    struct sockaddr_in addr;
+    FILE *f;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port = htons(6000);
+    while ((opt = getopt(argc, argv, "x:w:s:e:P:")) != -1) {
+        switch (opt) {
+        case 'x': speed = atof(optarg); break;
+        case 'w': stall_ms = atoi(optarg); break;
+        case 'e': command = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        case 's':
+            if ((colon = strchr(optarg, ':')) != NULL) {
+                *colon = '\0';
+                server_addr.sin_port = htons(atoi(colon + 1));
+            }
+            if (inet_pton(AF_INET, optarg, &server_addr.sin_addr) != 1) {
+                fprintf(stderr, "Not an IPv4 address: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s trace [-x speed, 0 = lockstep] [-w stall ms] [-s server address:port] [-e \"peer command\"] [-P port]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind >= argc || (f = fopen(argv[optind], "r")) == NULL || trace_read_header(f, &file_role, &header_port) < 0) {
+        fprintf(stderr, "%s: not a trace\n", optind < argc ? argv[optind] : "(none)");
+        exit(1);
+    }
+    role = file_role;
+    peer_port = header_port;
+    if (role == 'P' && command == NULL) {
+        fprintf(stderr, "A peer trace needs the command of the peer (-e)\n");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (role == 'P') { // we are its server
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        n = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 4) < 0) {
+            perror("Error on binding");
+            exit(1);
+        }
+        fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+        if ((peer_in = popen(command, "w")) == NULL) {
+            perror("Error on starting the peer");
+            exit(1);
+        }
+    }
+
+    start = now_us();
+    while ((n = trace_read(f, &r, &data, &cap)) == 1) {
+        records++;
+        trace_seconds = r.ns / 1e9;
+        if (r.kind == TRACE_OUT || r.kind == TRACE_DGRAM_OUT) {
+            replay_output(&r);
+            due = 1;
+            continue;
+        }
+        if (speed > 0) { // the time of the trace, faster
+            long long when = start + (long long) (r.ns / 1000 / speed);
+            while (now_us() < when)
+                pump((int) ((when - now_us()) / 1000) + 1);
+            pump(0);
+        }
+        else if (!first)
+            wait_answers(at, due);
+        first = 0;
+        due = 0;
+        at = now_us();
+        replay_input(&r);
+        inputs++;
+    }
+    if (n < 0)
+        fprintf(stderr, "The trace is cut short after %ld records\n", records);
+    wait_answers(at, due); // the answers to the last input
+    elapsed = (now_us() - start) / 1e6;
+
+    for (i = 0; i < conns_cap; i++) {
+        want += conns[i].want.frames;
+        got += conns[i].got.frames;
+        if (conns[i].fd >= 0)
+            close(conns[i].fd);
+    }
+    if (peer_in != NULL)
+        pclose(peer_in); // its server is gone, it exits
+
+    qsort(answers.v, answers.n, sizeof(double), compare_double);
+    printf("{\"role\":\"%s\",\"records\":%ld,\"inputs\":%ld,\"trace_seconds\":%.3f,\"seconds\":%.3f,\"speedup\":%.1f,"
+           "\"inputs_per_sec\":%.1f,\"stalls\":%ld,\"answer_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+           "\"frames_trace\":%ld,\"frames_replay\":%ld,\"datagrams_trace\":%ld,\"datagrams_replay\":%ld,\"kinds_differ\":{",
+           role == 'S' ? "server" : "peer", records, inputs, trace_seconds, elapsed, elapsed > 0 ? trace_seconds / elapsed : 0,
+           elapsed > 0 ? inputs / elapsed : 0, stalls, percentile(&answers, 50), percentile(&answers, 99), percentile(&answers, 100),
+           want, got, want_dgrams, got_dgrams);
+    for (i = 0, n = 0; i < 256; i++) {
+        if (want_kinds[i] != got_kinds[i])
+            printf("%s\"%d\":[%ld,%ld]", n++ ? "," : "", i, want_kinds[i], got_kinds[i]);
+    }
+    printf("}}\n");
+    return 0;
+}
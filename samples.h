@@ -0,0 +1,46 @@
+/*
+Latency samples of the tools (bench_load.c, replay.c, hopstat.c): a growing array of values in us, sorted
+with compare_double before percentile reads it in ms.
+*/
+#ifndef SAMPLES_H
+#define SAMPLES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct samples { /*latencies in us*/
+    double *v;
+    long n, cap;
+};
+
+static inline void sample_add(struct samples *s, double v)
+{
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->v = realloc(s->v, s->cap * sizeof(*s->v));
+        if (s->v == NULL) {
+            perror("Error on allocating samples");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = v;
+}
+
+static inline int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// percentile p (0-100) of sorted samples, in ms
+static inline double percentile(struct samples *s, double p)
+{
+    long i;
+
+    if (s->n == 0)
+        return 0;
+    i = (long) (p / 100.0 * (s->n - 1) + 0.5);
+    return s->v[i] / 1000.0;
+}
+
+#endif
@@ -5,20 +5,43 @@ The server can:
 2) keep the list of connected users/peers
 3) create global consistent states and recover the system
 4) handle the signals of a peer departure
+5) take Chandy-Lamport snapshots of the peers and resync a peer that lost its DB after a crash
 
 The server is built using:
-- as many threads as the peers (1 new peer = 1 new thread)
+- one thread with an epoll event loop for the listening socket and all the peers (no thread per peer)
 - signals for exiting of the peers are implemented
-- locking of shared_id of the connected peers and shared_buffer for sending messages to all peers
+- a registry of the connected peers: ids are reused (lowest first), lookup by id and by socket, the
+/list payloads are built once per change of the members
+- membership push: joins and leaves go to every peer as deltas with an epoch, a new peer gets the whole list once
+- addresses: a peer registers its port and the address it advertises (or the one it connected from), the list
+and the deltas carry both, so the peers may be on any hosts; a port already taken by a member is refused
+- metrics (metrics.h): /stats, and a Prometheus text dump for whoever connects to the Unix socket of -m
+- relay: the frames a peer sends in PROTO_RELAY (peers with -f relay) go to all the other members, the ones of
+one pass of the event loop with a single write per peer
+- history: the /msg and /edit reports in a ring of -H records (slabs allocated once, the memory stays flat),
+the ones it overwrites go to the -D file; /history [from] [count] pages through them
+- cluster (-c): several servers split the peers on a consistent hash ring of their ports, they are linked to each other
+and share the joins and leaves, the state reports and the relayed frames; the peers of a server that dies move to
+the others within CLUSTER_GRACE ms and nobody sees them leave
+- trace (-T file, trace.h): every recv and write of the connections with its time, for replay.c
+- admission: every peer has a token bucket (-R frames/sec, -B burst), a state report over the rate is refused
+and the other frames wait for their tokens; each pass of the loop runs at most FAIR_QUANTUM frames of a peer,
+and a peer whose unread frames reach -Q bytes is not read until they drain, so a flooding peer slows down itself
 
-menu of commands: /help --> /msg (message), /edit (message) - (number of entry you want to edit), /list
+menu of commands: /help --> /msg (message), /edit (message) - (number of entry you want to edit), /list, /snapshot,
+/history [from] [count]
+Peers talk in the binary frames of proto.h, a client that starts with '/' gets the old text mode (one command per line).
 Consistent states: everytime the local txt file of a peer is changed (/msg or /edit) the local states are sent to the server.
 The server must check the time of arrival to all peer (TS) and the state of the key-edit.
+Snapshots: every -s seconds (or /snapshot) a marker goes to every peer, the peers report their DB and the chat
+in flight, the server keeps the checkpoints in snapshots/ (full every SNAPSHOT_FULL_EVERY, incremental in between).
+With -r the server starts from the latest checkpoints and a peer that reconnects gets back the entries it lost.
 
 Protocols used: Total Order Multicast (chat) , 2 PC (edit), consistent global states (server)
 Technologies used: Ubuntu 18.04, gcc 7.5, Coded in C
 compile: gcc server.c -o server -lpthread
-Run: ./server
+Run: ./server [-s snapshot seconds, 0 = only /snapshot] [-r] [-m metrics socket] [-H history records] [-D history spill file]
+[-P port] [-c host:port,host:port... [-i index]] [-T trace file] [-R frames/sec per peer [-B burst]] [-Q inbound bytes]
 */
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,32 +49,306 @@ Run: ./server
 #include <unistd.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
 #include <signal.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "proto.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define SIZE 256
+#define MAX_EVENTS 64 // events returned by one epoll_wait
+#define MODE_UNKNOWN 0 // nothing received yet
+#define MODE_TEXT 1 // old text commands, one per line
+#define MODE_BINARY 2 // frames of proto.h
+#define SERVER_PORT 6000 // -P
+#define SNAPSHOT_DIR "snapshots" // "snapshots-<port>" for a port other than SERVER_PORT
+#define SNAPSHOT_FULL_EVERY 8 // the other snapshots only have what changed
+#define SNAPSHOT_TIMEOUT 10000 // ms for every peer to report
+#define SYNC_CHUNK 60000 // bytes of entries in one PROTO_SYNC frame
+#define HISTORY_SLAB 256 // records of the history allocated at once
+#define HISTORY_PAGE 20 // records of /history without a count
+#define HISTORY_MAX_PAGE 200
+#define CLUSTER_MAX 16 // servers in -c
+#define CLUSTER_VNODES 64 // points of a server on the hash ring
+#define CLUSTER_RETRY 1000 // ms between tries to link a server that is not there, and between rebalance checks
+#define CLUSTER_GRACE 3000 // ms a member of a server that went away (or a peer we redirected) has to come back
+#define FAIR_QUANTUM 64 // frames of one peer in one pass of the loop
+#define INBOUND_MAX (256 * 1024) // -Q: unread bytes of a peer before the server stops reading it
+
+struct peer_conn { /*contains the information about a connected peer*/
+    int sock;
+    int id;
+    int mode; // MODE_TEXT or MODE_BINARY, from the first byte received
+    int port; // UDP port of the peer, from PROTO_HELLO
+    uint32_t addr; // IPv4 address the peer advertised in PROTO_HELLO (host order), or the one it connected from
+    struct proto_reader in; // bytes received and not yet parsed
+    char *outbuf; // bytes the socket did not accept yet, flushed on EPOLLOUT
+    int outlen, outcap;
+    int closed; // freed after the current batch of events
+    struct peer_conn *next_closed;
+    uint32_t snap_id; // snapshot whose report is still expected, 0 = none
+    int member; // a peer of the chat (said PROTO_HELLO), gets the membership changes
+    int relay_pending; // relayed frames wait in outbuf for relay_flush
+    struct peer_conn *next_relay;
+    int link; // index + 1 of the server at the other end of a server-to-server link, 0 = a peer
+    int moving; // index + 1 of the server we sent this peer to with PROTO_REDIRECT
+    int skip_line; // a link we opened: the welcome line of the other server comes before its frames
+    int dialing; // index + 1 of the server a link we opened connects to, until EPOLLOUT says it is up
+    double tokens; // -R: frames it may send now, admit_rate more every second up to admit_burst
+    uint64_t refilled; // ns of the last refill
+    int backlog; // frames left for the next pass (its share of this one or its tokens are used up)
+    int in_paused; // unread frames reached in_max: not read until they drain
+    struct peer_conn *next_backlog;
+};
+
+struct remote_member { /*a member of another server of the cluster*/
+    int id, port;
+    uint32_t addr;
+    int server; // index of the server that has it
+    long long gone_at; // 0, or when it leaves if no server says it has it by then (its server went away, it moved)
+    int moved; // it was ours and we redirected it, the others still think it is ours
+};
+
+struct snapshot { /*the snapshot being taken*/
+    int active, full, failed;
+    uint32_t id;
+    int fd; // snapshots/snap-N.tmp
+    int expected, reported; // peers
+    long long deadline;
+    uint64_t start; // ns
+};
+
+struct pending_msg { /*chat that was in flight when the snapshot was taken*/
+    int port;
+    uint64_t ts;
+    char text[SIZE];
+};
+
+struct hist_rec { /*a chat message or an edit reported by a peer, fixed size so that record n is at n * size*/
+    uint64_t seq; // number of the report since the start (or the recovery)
+    uint64_t ts; // Lamport TS, the port of the peer breaks ties
+    int32_t port, entry;
+    uint8_t option; // 1 /msg, 2 /edit
+    char text[SIZE];
+};
+
+struct image { /*the DB of a peer as the checkpoints have it*/
+    int port;
+    uint64_t lamport;
+    uint32_t key, cap; // entries, allocated entries
+    struct { uint32_t version; char *text; } *entries;
+    struct pending_msg *pending;
+    uint32_t npending, pending_cap;
+    struct image *next;
+};
 
-void *client_thread(void*);
+void accept_peers();
+void read_peer(struct peer_conn *conn);
+void serve_peer(struct peer_conn *conn);
+int admit(struct peer_conn *conn, int report);
+void backlog_add(struct peer_conn *conn);
+void backlog_serve();
+int backlog_next_timeout();
+void peer_events(struct peer_conn *conn);
+void handle_frame(struct peer_conn *conn, struct proto_frame *f);
+void handle_command(struct peer_conn *conn, char *line);
+void state_report(int option, char *amessage, uint64_t ts, int port, int entry);
+int reply_text(struct peer_conn *conn, const char *text);
+void send_list(struct peer_conn *conn);
+void close_peer(struct peer_conn *conn);
+int send_peer(struct peer_conn *conn, const char *data, int len);
+void flush_peer(struct peer_conn *conn);
+int set_nonblocking(int fd);
 void signal_handler(int);
+void trace_end();
+int registry_add(struct peer_conn *conn);
+void registry_remove(struct peer_conn *conn);
+void registry_build();
+void registry_join(struct peer_conn *conn);
+int registry_port_taken(struct peer_conn *conn);
+void registry_delta(struct peer_conn *conn, int op);
+long long now_ms();
+void snapshot_name(char *path, uint32_t id, const char *ext);
+void snapshot_write(int port, const char *frame, uint32_t len);
+void snapshot_start();
+void snapshot_state(int option, char *message, uint64_t ts, int port, int entry);
+void snapshot_report(struct peer_conn *conn, struct proto_frame *f);
+void cluster_redirect(struct peer_conn *conn, int i);
+void snapshot_finish();
+void snapshot_timers();
+int snapshot_next_timeout();
+struct image *image_get(int port, int create);
+int image_grow(struct image *im, uint32_t entry);
+void image_set(struct image *im, uint32_t entry, uint32_t version, const char *text, uint32_t len);
+int checkpoint_apply(uint32_t id, int restore);
+int compare_pending(const void *a, const void *b);
+int compare_ids(const void *a, const void *b);
+void checkpoints_load(int recover);
+void sync_peer(struct peer_conn *conn, uint32_t have);
+void relay(struct peer_conn *from, const char *frames, int len);
+void relay_flush();
+void history_open(const char *spill);
+void history_reset();
+struct hist_rec *history_add(int option, const char *text, uint64_t ts, int port, int entry);
+struct hist_rec *history_slot(uint64_t seq);
+int history_get(uint64_t seq, struct hist_rec *r);
+void history_command(struct peer_conn *conn, char *args);
+void relay_queue(struct peer_conn *to, const char *data, int len);
+void registry_push(int id, int port, uint32_t addr, int op, struct peer_conn *except);
+int registry_gid(struct peer_conn *conn);
+void snapshot_frame(int port, struct proto_frame *f);
+void cluster_parse(char *list, int port, int self);
+uint32_t cluster_hash(uint32_t x);
+void cluster_ring();
+int cluster_owner(int port);
+int cluster_leader();
+void cluster_dial(int i);
+void cluster_connected(struct peer_conn *conn);
+void cluster_link_up(struct peer_conn *conn, int i);
+void cluster_link_down(struct peer_conn *conn);
+void cluster_send(const char *frame, int len, int only);
+void cluster_member(int op, struct peer_conn *conn);
+void cluster_remote(int server, int op, int id, int port, uint32_t addr);
+struct remote_member *cluster_find(int port);
+void cluster_drop(struct remote_member *m);
+struct remote_member *cluster_keep(int server, int id, int port, uint32_t addr);
+void cluster_moved(struct peer_conn *conn);
+void cluster_rebalance();
+void cluster_report(int port, const char *frame, int len, int only);
+void cluster_state(int option, char *message, uint64_t ts, int port, int entry);
+void cluster_frame(struct peer_conn *conn, struct proto_frame *f);
+void cluster_timers();
+int cluster_next_timeout();
 
-int sockfd, shared_id = 258, clisockfds[SIZE], climax, k=0, sec[SIZE], rec[SIZE], l=0, j=0, keys[SIZE], edit_keys[SIZE];
-char shared_buffer[SIZE*4], shared_users[SIZE][SIZE], *shared_user, archive[SIZE][SIZE], edit[SIZE][SIZE];
+int sockfd, epfd;
+struct peer_conn **conns, *closed_conns; // connections indexed by socket, departed ones
+struct peer_conn *relay_conns; // with relayed frames not written yet
+struct peer_conn *backlog_head, *backlog_tail; // with frames waiting for the next pass, in turn
+double admit_rate, admit_burst; // -R, -B: 0 = no limit
+int in_max = INBOUND_MAX; // -Q
+int conns_cap;
 pthread_mutex_t lock;
 
-struct thread_args { /*contains the information about the thread*/
-    int sock;
-    int id;
+struct { /*the connected peers, ids are reused lowest first*/
+    struct peer_conn **by_id; // NULL = free id
+    int cap, count, next_id; // ids below next_id were given out
+    int members; // connections that said PROTO_HELLO
+    uint32_t epoch; // +1 for every join or leave of a member
+    int *free_ids, nfree, free_cap; // min-heap of the released ids
+    char *list_frame, *list_text; // PROTO_PEER_LIST and "Peers: ..." of the current members
+    int list_frame_len, list_text_len, list_cap, dirty; // dirty = members changed, rebuild the lists
+} registry;
+struct { /*the reports of the peers, a ring of the last cap ones in slabs allocated once*/
+    struct hist_rec **slabs; // record n is slot n % cap, slab slot / HISTORY_SLAB
+    uint32_t cap; // -H
+    uint64_t next; // seq of the next report, the ring has max(0, next - cap) .. next - 1
+    uint64_t last[3]; // seq + 1 of the last /msg and /edit, 0 = none
+    int spill_fd; // -D: the records that leave the ring, at seq * sizeof(struct hist_rec), -1 = none
+} history = { .cap = 4096, .spill_fd = -1 };
+struct snapshot snap;
+struct image *images; // per port, from the completed checkpoints
+uint32_t next_snap_id = 1, last_complete, first_checkpoint; // last_complete = 0: none yet
+int snapshot_interval = 30; // seconds, 0 = only on /snapshot
+long long next_snap_at;
+char snapshot_dir[64] = SNAPSHOT_DIR;
+struct { /*the servers of -c, each has the peers of its part of the hash ring*/
+    int n, self; // servers, our index; n = 0: a single server
+    struct sockaddr_in addr[CLUSTER_MAX];
+    struct peer_conn *links[CLUSTER_MAX]; // NULL = that server is not there (or it is us)
+    struct peer_conn *dialing[CLUSTER_MAX]; // our connections to them that are not up yet
+    struct { uint32_t hash; int server; } ring[CLUSTER_MAX * CLUSTER_VNODES]; // of the servers that are there
+    int ring_len;
+    struct remote_member *remote; // the members of the other servers
+    int nremote, remote_cap;
+    long long next_check;
+} cluster;
+
+enum { M_PEERS, M_FRAMES_IN, M_BYTES_IN, M_BYTES_OUT, M_OUT_QUEUED, M_COMMANDS, M_STATE_REPORTS,
+       M_SNAPSHOTS, M_SNAPSHOT_TIME, M_RECOVERY_TIME, M_LOOP_BATCH, M_RELAYED, M_RELAY_WRITES,
+       M_HISTORY, M_HISTORY_SPILLED, M_HISTORY_MEMORY, M_CLUSTER_LINKS, M_CLUSTER_REMOTE, M_REDIRECTS,
+       M_REJECTED, M_THROTTLED, M_DEFERRED, M_IN_PAUSED, M_COUNT };
+struct metric metrics[M_COUNT] = {
+    [M_PEERS] = { "peers", "connected peers", METRIC_GAUGE },
+    [M_FRAMES_IN] = { "frames_in_total", "frames received from the peers", METRIC_COUNTER },
+    [M_BYTES_IN] = { "bytes_in_total", "bytes received from the peers", METRIC_COUNTER },
+    [M_BYTES_OUT] = { "bytes_out_total", "bytes written to the peers", METRIC_COUNTER },
+    [M_OUT_QUEUED] = { "out_queued_bytes", "bytes waiting for slow peers to read", METRIC_GAUGE },
+    [M_COMMANDS] = { "commands_total", "commands of the peers (/list, /help ...)", METRIC_COUNTER },
+    [M_STATE_REPORTS] = { "state_reports_total", "local states reported by the peers", METRIC_COUNTER },
+    [M_SNAPSHOTS] = { "snapshots_total", "completed snapshots", METRIC_COUNTER },
+    [M_SNAPSHOT_TIME] = { "snapshot_seconds", "time from the markers to the checkpoint", METRIC_HISTOGRAM },
+    [M_RECOVERY_TIME] = { "recovery_seconds", "time to load the checkpoints on startup", METRIC_HISTOGRAM },
+    [M_LOOP_BATCH] = { "loop_batch_seconds", "time to handle one batch of epoll events", METRIC_HISTOGRAM },
+    [M_RELAYED] = { "relayed_frames_total", "PROTO_RELAY frames of the peers passed on to the others", METRIC_COUNTER },
+    [M_RELAY_WRITES] = { "relay_writes_total", "writes of relayed frames, one per peer per pass of the loop", METRIC_COUNTER },
+    [M_HISTORY] = { "history_records", "reports of the peers in the history ring", METRIC_GAUGE },
+    [M_HISTORY_SPILLED] = { "history_spilled_total", "reports that left the ring for the spill file", METRIC_COUNTER },
+    [M_HISTORY_MEMORY] = { "history_bytes", "memory of the slabs of the history ring", METRIC_GAUGE },
+    [M_CLUSTER_LINKS] = { "cluster_links", "servers of the cluster linked to this one", METRIC_GAUGE },
+    [M_CLUSTER_REMOTE] = { "cluster_remote_members", "members of the other servers of the cluster", METRIC_GAUGE },
+    [M_REDIRECTS] = { "redirects_total", "peers sent to the server of the cluster that owns them", METRIC_COUNTER },
+    [M_REJECTED] = { "admission_rejected_total", "state reports refused because the peer was over its rate (-R)", METRIC_COUNTER },
+    [M_THROTTLED] = { "admission_throttled_total", "times a peer had frames waiting for its tokens (-R)", METRIC_COUNTER },
+    [M_DEFERRED] = { "fair_deferred_total", "times a peer used up its share of a pass and waited for the next", METRIC_COUNTER },
+    [M_IN_PAUSED] = { "inbound_paused", "peers not read because their unread frames reached -Q bytes", METRIC_GAUGE },
 };
+int metrics_fd = -1; // Unix socket of the Prometheus dump, -1 = none
+struct trace trace = { .fd = -1 }; // -T: every byte the peers send and get
 
 int main(int argc, char *argv[])
 {
-    int clisockfd, n, i = 0;;
-    socklen_t clilen; /*for the accept*/
-    pthread_t thread_id;
-    struct sockaddr_in serv_addr, cli_addr;
+    int n, i, nfds, recover = 0, port = SERVER_PORT, self = -1;
+    uint64_t start;
+    char *metrics_path = NULL, *spill_path = NULL, *cluster_list = NULL, *trace_path = NULL;
+    struct sockaddr_in serv_addr;
+    struct epoll_event ev, events[MAX_EVENTS];
+
+    while ((n = getopt(argc, argv, "s:rm:H:D:P:c:i:T:R:B:Q:")) != -1) {
+        if (n == 's')
+            snapshot_interval = atoi(optarg);
+        else if (n == 'r')
+            recover = 1;
+        else if (n == 'm')
+            metrics_path = optarg;
+        else if (n == 'H' && atoi(optarg) >= 2)
+            history.cap = atoi(optarg);
+        else if (n == 'D')
+            spill_path = optarg;
+        else if (n == 'P' && atoi(optarg) > 0)
+            port = atoi(optarg);
+        else if (n == 'c')
+            cluster_list = optarg;
+        else if (n == 'i')
+            self = atoi(optarg);
+        else if (n == 'T')
+            trace_path = optarg;
+        else if (n == 'R' && atof(optarg) >= 0)
+            admit_rate = atof(optarg);
+        else if (n == 'B' && atof(optarg) >= 1)
+            admit_burst = atof(optarg);
+        else if (n == 'Q' && atoi(optarg) > 0)
+            in_max = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-s snapshot seconds] [-r] [-m metrics socket] [-H history records] [-D history spill file]"
+                    " [-P port] [-c host:port,host:port... [-i index]] [-T trace file] [-R frames/sec per peer [-B burst]]"
+                    " [-Q inbound bytes]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (admit_rate > 0 && admit_burst < 1) // a second of frames at once
+        admit_burst = admit_rate < 1 ? 1 : admit_rate;
 
     sockfd = socket(AF_INET, SOCK_STREAM, 0); /*TCP/IP conection*/
     if (sockfd < 0){
@@ -59,186 +356,2189 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    n = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n));
+
     bzero((char *) &serv_addr, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(6000);
+    serv_addr.sin_port = htons(port);
 
     if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0){
         perror("Error on binding");
         exit(1);
     }
 
-    listen(sockfd, 1); /*from one machine so the number of the backlog doesn't matter*/
-
-    clilen = sizeof(cli_addr);
+    listen(sockfd, SOMAXCONN); /*peers can connect in bursts so use the full backlog*/
+    set_nonblocking(sockfd);
 
     if (pthread_mutex_init(&lock, NULL) < 0){ //mutex initialization
         perror("Error on initializing mutex");
         exit(1);
     }
 
-    /* zero out shared_users */
-    for (n = 0; n < SIZE; n++) {
-        memset(shared_users[n], 0, SIZE);
+    epfd = epoll_create1(0);
+    if (epfd < 0){
+        perror("Error on creating epoll");
+        exit(1);
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL = the listening socket
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0){
+        perror("Error on epoll_ctl");
+        exit(1);
+    }
+
+    if (metrics_path != NULL) {
+        metrics_fd = metrics_listen(metrics_path);
+        ev.data.ptr = &metrics_fd;
+        if (metrics_fd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, metrics_fd, &ev) < 0){
+            perror("Error on metrics socket");
+            exit(1);
+        }
     }
 
     signal(SIGINT,signal_handler); //signals for the peer departure
+    signal(SIGPIPE, SIG_IGN); // a peer that left must not kill the server on write
+
+    if (trace_path != NULL) {
+        if (trace_open(&trace, trace_path, 'S', 0) < 0){
+            perror("Error on opening trace");
+            exit(1);
+        }
+        atexit(trace_end);
+    }
+
+    if (port != SERVER_PORT) // several servers in one directory
+        snprintf(snapshot_dir, sizeof(snapshot_dir), "%s-%d", SNAPSHOT_DIR, port);
+    if (cluster_list != NULL)
+        cluster_parse(cluster_list, port, self);
+
+    start = metric_now_ns();
+    history_open(spill_path);
+    checkpoints_load(recover);
+    metric_observe(&metrics[M_RECOVERY_TIME], metric_now_ns() - start);
+    next_snap_at = now_ms() + snapshot_interval * 1000LL;
 
     printf("Running Messenger Server...\n");
 
-    /* infinite loop*/
+    /* event loop: sleeps in epoll_wait until a socket is ready or a snapshot is due */
     while (1) {
-        // accepting all peer connection requests
-        clisockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-
-        if (clisockfd < 0){
-            perror("Error on accept");
+        n = snapshot_next_timeout();
+        if (cluster.n > 0 && (n < 0 || cluster_next_timeout() < n))
+            n = cluster_next_timeout();
+        if (trace.fd >= 0 && (n < 0 || n > 1000)) // the trace is written once a second
+            n = 1000;
+        i = backlog_next_timeout(); // 0 while a peer has frames it may run
+        if (i >= 0 && (n < 0 || i < n))
+            n = i;
+        nfds = epoll_wait(epfd, events, MAX_EVENTS, n);
+        if (nfds < 0){
+            if (errno == EINTR)
+                continue;
+            perror("Error on epoll_wait");
             exit(1);
         }
 
-        /* create new thread for client */
-        struct thread_args args;
-        args.sock = clisockfd;
-        j++; // number of peers
-        if(strlen(shared_users[j-1]) == 0){
-                args.id = j-1;
+        start = metric_now_ns();
+        for (i = 0; i < nfds; i++) {
+            struct peer_conn *conn = events[i].data.ptr;
+
+            if (conn == NULL) { // accepting all peer connection requests
+                accept_peers();
+                continue;
+            }
+            if (events[i].data.ptr == &metrics_fd) {
+                metrics_serve(metrics_fd, "chat_server", metrics, M_COUNT);
+                continue;
+            }
+            if (!conn->closed && conn->dialing) {
+                cluster_connected(conn);
+                continue;
+            }
+            if (!conn->closed && (events[i].events & EPOLLOUT))
+                flush_peer(conn);
+            if (!conn->closed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                read_peer(conn);
         }
 
-        /* set default username to shared_users*/
-        bzero(shared_users[args.id], SIZE);
-        sprintf(shared_users[args.id], "%d", args.id);
+        backlog_serve(); // a share of the frames of the peers that had more than their share
+        relay_flush(); // what the peers relayed in this batch, one write per peer
 
-        if (pthread_create(&thread_id, NULL, client_thread, (void*) &args) < 0) { /*client_thread= pointer to function*/ 
-            perror("Error on creating thread");
-            exit(1);
+        /* nothing of this batch points to the departed peers any more */
+        while (closed_conns != NULL) {
+            struct peer_conn *conn = closed_conns;
+            closed_conns = conn->next_closed;
+            metric_add(&metrics[M_OUT_QUEUED], -conn->outlen); // never sent
+            free(conn->in.buf);
+            free(conn->outbuf);
+            free(conn);
         }
-
+        snapshot_timers();
+        if (cluster.n > 0)
+            cluster_timers();
+        trace_tick(&trace);
+        if (nfds > 0)
+            metric_observe(&metrics[M_LOOP_BATCH], metric_now_ns() - start);
     }
 
-    pthread_join(thread_id, NULL);
     pthread_mutex_destroy(&lock);
+    close(epfd);
     close(sockfd);
     return 0;
 }
 
-// created with every accept
-void *client_thread(void *args_ptr) {
+// accepts every pending connection on the listening socket
+void accept_peers()
+{
+    int clisockfd, n;
+    socklen_t clilen; /*for the accept*/
+    struct sockaddr_in cli_addr;
+    struct epoll_event ev;
+    struct peer_conn *conn;
+    char buffer[SIZE];
+
+    while (1) {
+        clilen = sizeof(cli_addr);
+        clisockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
+        if (clisockfd < 0){
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Error on accept");
+            return;
+        }
+
+        set_nonblocking(clisockfd);
+        n = 1; // relayed chat is small frames that must not wait for the ack of the previous ones
+        setsockopt(clisockfd, IPPROTO_TCP, TCP_NODELAY, &n, sizeof(n));
+        if (clisockfd >= conns_cap) { // grow the connection table
+            n = conns_cap ? conns_cap : 64;
+            while (n <= clisockfd)
+                n *= 2;
+            conns = realloc(conns, n * sizeof(*conns));
+            if (conns == NULL){
+                perror("Error on allocating connections");
+                exit(1);
+            }
+            memset(conns + conns_cap, 0, (n - conns_cap) * sizeof(*conns));
+            conns_cap = n;
+        }
+        conn = calloc(1, sizeof(*conn));
+        if (conn == NULL){
+            perror("Error on allocating connection");
+            exit(1);
+        }
+        conn->sock = clisockfd;
+        conn->tokens = admit_burst;
+        conn->refilled = metric_now_ns();
+        conn->id = registry_add(conn); // lowest free id
+        trace_add(&trace, TRACE_OPEN, clisockfd, 0, NULL, 0);
+        conns[clisockfd] = conn;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, clisockfd, &ev) < 0){
+            perror("Error on epoll_ctl");
+            close_peer(conn);
+            continue;
+        }
 
-    struct thread_args *args = (struct thread_args *) args_ptr;
-    int sock, id, n, i;
-    char buffer[SIZE*2], message[SIZE], command[SIZE], msg_token, *amessage;
+        /* send welcome message to user, a text line for both modes */
+        sprintf(buffer, "Welcome to the Messenger Server: type /help for available commands\n");
+        if (send_peer(conn, buffer, strlen(buffer)) < 0) {
+            close_peer(conn);
+            continue;
+        }
 
-    // individual socket info
-    sock = args->sock;
-    id = args->id;
-	
-    /* send welcome message to user */
-    bzero(buffer, SIZE);
-    sprintf(buffer, "Welcome to the Messenger Server: type /help for available commands\n");
-    n = write(sock, buffer, SIZE);
-    if (n < 0) 
-        return NULL;
+        /* write new connections to shared buffer*/
+        printf("%d has joined\n", conn->id);
+        metric_add(&metrics[M_PEERS], 1);
+    }
+}
+
+// reads what the peer sent and runs its share of the complete frames or text lines
+void read_peer(struct peer_conn *conn)
+{
+    int n;
+    char *end;
 
-    /* write new connections to shared buffer*/
-    printf("%s has joined\n", shared_users[id]);
-	
+    if (conn->in_paused) { // epoll does not wait for its bytes, this is a hangup or an error
+        close_peer(conn);
+        return;
+    }
     while (1) {
+        if (proto_reserve(&conn->in, SIZE*4) < 0) {
+            close_peer(conn);
+            return;
+        }
+        n = recv(conn->sock, conn->in.buf + conn->in.len, conn->in.cap - conn->in.len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) { // peer departed without /exit
+            close_peer(conn);
+            return;
+        }
+        trace_add(&trace, TRACE_IN, conn->sock, conn->port, conn->in.buf + conn->in.len, n);
+        conn->in.len += n;
+        metric_add(&metrics[M_BYTES_IN], n);
+        if (conn->skip_line) { // the welcome line of the server we linked to
+            end = memchr(conn->in.buf + conn->in.off, '\n', conn->in.len - conn->in.off);
+            if (end == NULL)
+                continue;
+            conn->in.off = end - conn->in.buf + 1;
+            conn->skip_line = 0;
+        }
 
-        /* read new message into buffer */
-        bzero(buffer, SIZE);
-        recv(sock, buffer, SIZE-1, MSG_DONTWAIT); /* non-blocking read */
-        n = 0;
-        msg_token = buffer[0];
-        if (msg_token == '/') {
-
-            /* read buffer into command and message strings */
-            bzero(command, SIZE);
-            bzero(message, SIZE);
-            sscanf(buffer, "%s %[^\n]", command, message);
-
-            /* process chat commands */
-            if (strcmp(command, "/help") == 0) {
-                bzero(buffer, SIZE);
-
-                /* send list of commands */
-                sprintf(buffer, "Commands: /msg, /edit, /list, /help, /exit\n");
-                n = write(sock, buffer, SIZE);
-                if (n < 0 ) break;
-            } 
-            else if (strcmp(command, "/list") == 0) { //list of connected users
-                bzero(buffer, SIZE);
-                strncat(buffer, "Peers: ", SIZE); 
-                for (n = 0; n < SIZE; n++) {
-                    if (strlen(shared_users[n]) > 0) {
-                        strncat(buffer, shared_users[n], SIZE); // shared_users--> socket id
-                        strncat(buffer, " ", SIZE);
-                    }
-                }
-                strncat(buffer, "\n", SIZE);
-                printf("%s\n", buffer);
-                n = write(sock, buffer, strlen(buffer)); //write message to peer
-                if (n < 0)
-                    break;
-                strcpy(buffer,shared_buffer);
-            } else if (strcmp(command, "/exit") == 0) { // in case a peer wants to depart
-
-                /* send final confirmation to client */
-                sprintf(buffer, "You have been disconnected");
-                n = write(sock, buffer, strlen(buffer));
-                break;
-                // global consistent states
-            } 
-            else if (strcmp(command, "/msg") == 0){ // for when multiple users try to send messages at the same time
-                amessage = strtok(message, "|");
-                strcpy(archive[l], amessage);
-                rec[l] = atoi(strtok(NULL, "|"));
-                keys[l] = atoi(strtok(NULL, "|"));
-                printf("message received: %s with TS: %d and key: %d\n", archive[l], rec[l], keys[l]);
-                if(l>0){
-                    if((strcmp(archive[l-1],archive[l])!=0)&(rec[l-1]==rec[l])) // two peers try to access at the same time
-                        printf(" %s goes first and %s goes second\n", archive[l-1], archive[l]);
-                }
-                l = l+1;
-            } else if (strcmp(command, "/edit") == 0){ // for when multiple users try to edit a message at the same time
-                amessage = strtok(message, "|");
-                strcpy(edit[k], amessage);
-                sec[k] = atoi(strtok(NULL, "|"));
-                edit_keys[k] = atoi(strtok(NULL, "|"));
-                printf("message received: %s with TS: %d and key: %d\n", edit[k], sec[k], edit_keys[k]);
-                if(k>0){
-                    if((strcmp(edit[k-1],edit[k])!=0)&(sec[k-1]==sec[k])&(edit_keys[k-1]==edit_keys[k])) // two peers try to access at the same time
-                        printf(" %s goes first and %s goes second\n", edit[k-1], edit[k]);
-                }
-                k = k+1;
-            }else { // if the command is not found in /help
-                bzero(buffer, SIZE);
-                sprintf(buffer, "%s: command not found, try /help\n", command);
-                n = write(sock, buffer, strlen(buffer));
-                if (n < 0)
-                    break;
+        if (conn->mode == MODE_UNKNOWN) // the first byte tells a peer from a text client
+            conn->mode = ((uint8_t) conn->in.buf[0] == PROTO_MAGIC) ? MODE_BINARY : MODE_TEXT;
+
+        if (!conn->backlog) // waiting for its turn, backlog_serve runs it
+            serve_peer(conn);
+        if (conn->closed)
+            return;
+        if (conn->backlog && conn->in.len - conn->in.off >= (uint32_t) in_max) { // enough queued, TCP holds the rest
+            conn->in_paused = 1;
+            metric_add(&metrics[M_IN_PAUSED], 1);
+            peer_events(conn);
+            return;
+        }
+    }
+}
+
+// runs the buffered frames (or text lines) of a peer, at most FAIR_QUANTUM and as many as its tokens allow,
+// the rest waits in the backlog for the next pass of the loop
+void serve_peer(struct peer_conn *conn)
+{
+    int n, done, ok;
+    char *line, *end;
+    struct proto_frame f;
+
+    for (done = 0; !conn->closed; done++) {
+        if (conn->mode == MODE_BINARY) {
+            if ((n = proto_parse(conn->in.buf + conn->in.off, conn->in.len - conn->in.off, &f)) < 0) {
+                printf("%d sent a bad frame\n", conn->id);
+                close_peer(conn);
+                return;
             }
         }
+        else {
+            end = memchr(conn->in.buf + conn->in.off, '\n', conn->in.len - conn->in.off);
+            n = end != NULL;
+        }
+        if (n == 0)
+            break;
+        if (done == FAIR_QUANTUM) {
+            metric_add(&metrics[M_DEFERRED], 1);
+            backlog_add(conn);
+            break;
+        }
+        if (conn->mode == MODE_BINARY) {
+            if ((ok = admit(conn, f.kind == PROTO_STATE)) == 0)
+                break;
+            proto_next(&conn->in, &f);
+            if (ok > 0)
+                handle_frame(conn, &f);
+        }
+        else { /* text mode: one command per line */
+            line = conn->in.buf + conn->in.off;
+            if ((ok = admit(conn, strncmp(line, "/msg", 4) == 0 || strncmp(line, "/edit", 5) == 0)) == 0)
+                break;
+            *end = '\0';
+            conn->in.off = end - conn->in.buf + 1;
+            if (ok > 0)
+                handle_command(conn, line);
+        }
+    }
+    if (conn->closed)
+        return;
+    if (conn->mode == MODE_TEXT) {
+        if (conn->in.off == conn->in.len)
+            conn->in.off = conn->in.len = 0;
+        else if (!conn->backlog && conn->in.len - conn->in.off > SIZE*4) { // no newline in sight, drop it
+            conn->in.off = conn->in.len = 0;
+        }
+    }
+    if (conn->in_paused && conn->in.len - conn->in.off < (uint32_t) in_max / 2) { // drained, read it again
+        conn->in_paused = 0;
+        metric_add(&metrics[M_IN_PAUSED], -1);
+        peer_events(conn);
+    }
+}
+
+// runs one frame of a peer
+void handle_frame(struct peer_conn *conn, struct proto_frame *f)
+{
+    struct proto_in in;
+    char line[SIZE], message[SIZE];
+    uint8_t option;
+    uint64_t ts;
+    int entry;
+
+    metric_add(&metrics[M_FRAMES_IN], 1);
+    proto_init_in(&in, f);
+    switch (f->kind) {
+    case PROTO_HELLO:
+        conn->port = proto_get_u16(&in);
+        conn->addr = in.left >= 4 ? proto_get_u32(&in) : 0;
+        if (conn->addr == 0) { // it did not say, it is where it connected from
+            struct sockaddr_in from;
+            socklen_t len = sizeof(from);
+            if (getpeername(conn->sock, (struct sockaddr *) &from, &len) == 0)
+                conn->addr = ntohl(from.sin_addr.s_addr);
+        }
+        if (!conn->member && conn->port != 0 && registry_port_taken(conn)) {
+            snprintf(line, sizeof(line), "Port %d is taken by another peer", conn->port);
+            reply_text(conn, line);
+            close_peer(conn);
+            break;
+        }
+        /* a peer of another part of the ring goes there, unless it was sent here (the views of the servers
+           may differ for a moment, the rebalance check moves it later) */
+        if (!conn->member && conn->port != 0 && cluster.n > 0 && !(f->flags & PROTO_HELLO_MOVED)
+            && cluster_owner(conn->port) != cluster.self) {
+            cluster_redirect(conn, cluster_owner(conn->port));
+            break;
+        }
+        inet_ntop(AF_INET, &(struct in_addr) { htonl(conn->addr) }, line, sizeof(line));
+        printf("%d listens on %s:%d\n", conn->id, line, conn->port);
+        if (!conn->member && conn->port != 0)
+            registry_join(conn);
+        break;
+    case PROTO_COMMAND:
+        proto_get_cstr(&in, line, SIZE);
+        handle_command(conn, line);
+        break;
+    case PROTO_STATE: // local state of a peer for the global consistent states
+        option = proto_get_u8(&in);
+        ts = proto_get_u64(&in);
+        entry = (int) proto_get_u32(&in);
+        proto_get_cstr(&in, message, SIZE);
+        if (!in.err) {
+            state_report(option, message, ts, conn->port, entry);
+            cluster_state(option, message, ts, conn->port, entry);
+        }
+        break;
+    case PROTO_SNAP_STATE:
+    case PROTO_SNAP_CHANNEL:
+        if (cluster.n > 0 && cluster_leader() != cluster.self) // the leader takes the snapshots
+            cluster_report(conn->port, f->payload - PROTO_HEADER, PROTO_HEADER + f->len, cluster_leader());
+        else
+            snapshot_report(conn, f);
+        break;
+    case PROTO_SYNC_REQ: // a peer (re)joined, it has the entries below key
+        sync_peer(conn, proto_get_u32(&in));
+        break;
+    case PROTO_RELAY: // chat, acks and edits of a peer with -f relay (or of the members of a linked server)
+        relay(conn, f->payload, f->len);
+        break;
+    case PROTO_SERVER_HELLO:
+    case PROTO_SERVER_MEMBER:
+    case PROTO_SERVER_REPORT:
+        cluster_frame(conn, f);
+        break;
+    default:
+        printf("%d sent unknown frame %d\n", conn->id, f->kind);
+        break;
+    }
+}
+
+// process chat commands, same as before for every peer
+void handle_command(struct peer_conn *conn, char *line)
+{
+    char buffer[SIZE*2], message[SIZE], command[SIZE], msg_token, *amessage, *ts, *entry;
+
+    msg_token = line[0];
+    if (msg_token != '/')
+        return;
+    metric_add(&metrics[M_COMMANDS], 1);
+
+    /* read buffer into command and message strings */
+    bzero(command, SIZE);
+    bzero(message, SIZE);
+    sscanf(line, "%255s %255[^\n]", command, message);
+
+    if (strcmp(command, "/help") == 0) {
+        /* send list of commands */
+        reply_text(conn, "Commands: /msg, /edit, /list, /history [from] [count], /snapshot, /stats, /help, /exit\n");
+    } 
+    else if (strcmp(command, "/stats") == 0) { // the metrics of the server
+        char stats[SIZE*8];
+        metrics_summary(metrics, M_COUNT, stats, sizeof(stats));
+        reply_text(conn, stats);
+    }
+    else if (strcmp(command, "/snapshot") == 0) { // a global consistent state now
+        if (cluster.n > 0 && cluster_leader() != cluster.self) {
+            snprintf(buffer, SIZE, "Snapshots are taken by server %d of the cluster\n", cluster_leader());
+            reply_text(conn, buffer);
+        }
+        else if (snap.active)
+            reply_text(conn, "A snapshot is already running\n");
+        else {
+            snapshot_start();
+            snprintf(buffer, SIZE, "Snapshot %u started\n", snap.id);
+            reply_text(conn, buffer);
+        }
+    }
+    else if (strcmp(command, "/list") == 0) { //list of connected users
+        send_list(conn);
+    } else if (strcmp(command, "/history") == 0) { // a page of the reports of the peers
+        history_command(conn, message);
+    } else if (strcmp(command, "/exit") == 0) { // in case a peer wants to depart
 
+        /* send final confirmation to client */
+        reply_text(conn, "You have been disconnected");
+        close_peer(conn);
+        // global consistent states
+    } 
+    else if (strcmp(command, "/msg") == 0 || strcmp(command, "/edit") == 0){ // state report of the text mode: message | TS | key
+        amessage = strtok(message, "|");
+        ts = strtok(NULL, "|");
+        entry = strtok(NULL, "|");
+        if (amessage == NULL || ts == NULL || entry == NULL)
+            return;
+        state_report(command[1] == 'm' ? 1 : 2, amessage, strtoull(ts, NULL, 10), conn->port, atoi(entry));
+        cluster_state(command[1] == 'm' ? 1 : 2, amessage, strtoull(ts, NULL, 10), conn->port, atoi(entry));
+    }else { // if the command is not found in /help
+        bzero(buffer, sizeof(buffer));
+        snprintf(buffer, sizeof(buffer), "%s: command not found, try /help\n", command);
+        reply_text(conn, buffer);
     }
-    printf("%s has exited\n", shared_users[id]);
+}
+
+// checks the TS and the key of a local state (option 1 = /msg, 2 = /edit)
+void state_report(int option, char *amessage, uint64_t ts, int port, int entry)
+{
+    struct hist_rec *cur, *prev;
+    uint64_t last;
+
+    metric_add(&metrics[M_STATE_REPORTS], 1);
+    if (option != 1 && option != 2)
+        return;
+    last = history.last[option]; // the report of the same kind before this one
+    cur = history_add(option, amessage, ts, port, entry);
+    printf("message received: %s with TS: %llu and key: %d\n", cur->text, (unsigned long long) ts, entry);
+    prev = last > 0 ? history_slot(last - 1) : NULL;
+    if (prev == NULL || strcmp(prev->text, cur->text) == 0 || prev->ts != cur->ts)
+        return;
+    if (option == 1 || prev->entry == cur->entry) // same Lamport TS (and entry for an edit), the lower port goes first
+        printf(" %s goes first and %s goes second\n", prev->port < cur->port ? prev->text : cur->text,
+               prev->port < cur->port ? cur->text : prev->text);
+}
+
+// sends a text to the peer, as a PROTO_TEXT frame or as it is in text mode
+int reply_text(struct peer_conn *conn, const char *text)
+{
+    char buffer[SIZE*12];
+    struct proto_out o;
+
+    if (conn->mode != MODE_BINARY)
+        return send_peer(conn, text, strlen(text));
+    proto_init_out(&o, buffer, sizeof(buffer));
+    proto_begin(&o, PROTO_TEXT, 0);
+    proto_put_str(&o, text, strlen(text));
+    if (proto_end(&o) < 0)
+        return -1;
+    return send_peer(conn, o.buf, o.len);
+}
+
+// sends the list of the connected peers, built once for every change of the members
+void send_list(struct peer_conn *conn)
+{
     pthread_mutex_lock(&lock);
-    memset(shared_users[id], 0, SIZE);  // critical region, all threads have access
-	
+    if (registry.dirty)
+        registry_build();
     pthread_mutex_unlock(&lock);
-    close(sock);
-    return NULL;
+
+    if (conn->mode == MODE_BINARY) {
+        send_peer(conn, registry.list_frame, registry.list_frame_len);
+        return;
+    }
+    printf("%s\n", registry.list_text);
+    send_peer(conn, registry.list_text, registry.list_text_len); //write message to peer
 }
 
-// server departing
-void signal_handler(int signnum){
+// removes a departed peer from the loop and from the registry
+void close_peer(struct peer_conn *conn)
+{
+    if (conn->closed)
+        return;
+    if (conn->dialing)
+        cluster.dialing[conn->dialing - 1] = NULL;
+    if (conn->link > 0)
+        cluster_link_down(conn);
+    else if (conn->link == 0) {
+        printf("%d has exited\n", conn->id);
+        metric_add(&metrics[M_PEERS], -1);
+        registry_remove(conn);
+    }
+    if (conn->member && conn->moving)
+        cluster_moved(conn); // it is on its way to another server, still a member
+    else if (conn->member)
+        registry_delta(conn, PROTO_LEAVE);
 
-        int i;
+    if (conn->backlog) { // its frames go with it
+        struct peer_conn **p, *prev = NULL;
+        for (p = &backlog_head; *p != NULL && *p != conn; p = &(*p)->next_backlog)
+            prev = *p;
+        if (*p == conn) { // not in the part backlog_serve is running
+            *p = conn->next_backlog;
+            if (backlog_tail == conn)
+                backlog_tail = prev;
+        }
+    }
+    if (conn->in_paused)
+        metric_add(&metrics[M_IN_PAUSED], -1);
+    trace_add(&trace, TRACE_CLOSE, conn->sock, conn->port, NULL, 0);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+    conns[conn->sock] = NULL;
+    close(conn->sock);
+    conn->closed = 1;
+    if (snap.active && conn->snap_id == snap.id) { // its report will not come
+        snap.expected--;
+        if (snap.reported >= snap.expected)
+            snapshot_finish();
+    }
+    conn->next_closed = closed_conns;
+    closed_conns = conn;
+}
 
-        printf("\nServer shutting down.. \n");  //the handler for the signal SIGINT ( ctrl-c )
-		
-        pthread_mutex_destroy(&lock);                                              
-        close(sockfd);
-        sleep(1);
-        exit(0);
+// writes to a peer without blocking the loop, the rest is kept until EPOLLOUT
+int send_peer(struct peer_conn *conn, const char *data, int len)
+{
+    int n = 0;
+
+    if (conn->closed)
+        return -1;
+    trace_add(&trace, TRACE_OUT, conn->sock, conn->port, data, len);
+    if (conn->outlen == 0) {
+        n = write(conn->sock, data, len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            n = 0;
+        }
+        metric_add(&metrics[M_BYTES_OUT], n);
+        if (n == len)
+            return 0;
+    }
+
+    if (conn->outlen + len - n > conn->outcap) {
+        int cap = conn->outcap ? conn->outcap : SIZE*4;
+        while (cap < conn->outlen + len - n)
+            cap *= 2;
+        char *tmp = realloc(conn->outbuf, cap);
+        if (tmp == NULL)
+            return -1;
+        conn->outbuf = tmp;
+        conn->outcap = cap;
+    }
+    memcpy(conn->outbuf + conn->outlen, data + n, len - n);
+    conn->outlen += len - n;
+    metric_add(&metrics[M_OUT_QUEUED], len - n);
+    if (conn->outlen == len - n) // first pending bytes, wait until the socket is writable
+        peer_events(conn);
+    return 0;
+}
+
+// sends the pending bytes of a peer when its socket becomes writable
+void flush_peer(struct peer_conn *conn)
+{
+    int n;
+
+    if (conn->outlen == 0)
+        return;
+    n = write(conn->sock, conn->outbuf, conn->outlen);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            close_peer(conn);
+        return;
+    }
+    memmove(conn->outbuf, conn->outbuf + n, conn->outlen - n);
+    conn->outlen -= n;
+    metric_add(&metrics[M_BYTES_OUT], n);
+    metric_add(&metrics[M_OUT_QUEUED], -n);
+    if (conn->outlen == 0) // nothing left, stop waiting for EPOLLOUT
+        peer_events(conn);
+}
+
+// what epoll waits for on a peer: its bytes unless it is paused (-Q), EPOLLOUT while it has bytes to take
+void peer_events(struct peer_conn *conn)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (conn->in_paused ? 0 : EPOLLIN) | (conn->outlen > 0 ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sock, &ev);
+}
+
+/* ---------- admission ----------
+A peer can send faster than the server runs its frames, the others must not wait behind it. Every
+pass of the loop runs at most FAIR_QUANTUM frames of a peer; one that has more goes to the backlog,
+which gets its turn at the end of the pass (in the order the peers came) and keeps the loop from
+sleeping. With -R every peer also has a token bucket: a frame costs a token, admit_rate come back every
+second, up to admit_burst. A state report (/msg, /edit) without a token is refused and counted, it only
+feeds the history; any other frame (relayed chat, snapshot reports, commands) must not be lost, it waits
+in the backlog until the tokens are back. The frames that wait stay in the inbound buffer of the peer:
+when it reaches -Q bytes the server stops reading the socket, TCP fills up and the flood stops at the
+peer. The links of a cluster carry the frames of every member of a server, they are not limited. */
+
+// 1: run the next frame of conn, -1: refuse it (a report over the rate), 0: it waits in the backlog
+int admit(struct peer_conn *conn, int report)
+{
+    uint64_t now;
+
+    if (admit_rate <= 0 || conn->link != 0)
+        return 1;
+    now = metric_now_ns();
+    conn->tokens += (now - conn->refilled) / 1e9 * admit_rate;
+    if (conn->tokens > admit_burst)
+        conn->tokens = admit_burst;
+    conn->refilled = now;
+    if (conn->tokens >= 1) {
+        conn->tokens -= 1;
+        return 1;
+    }
+    if (report) {
+        metric_add(&metrics[M_REJECTED], 1);
+        return -1;
+    }
+    metric_add(&metrics[M_THROTTLED], 1);
+    backlog_add(conn);
+    return 0;
+}
+
+void backlog_add(struct peer_conn *conn)
+{
+    if (conn->backlog)
+        return;
+    conn->backlog = 1;
+    conn->next_backlog = NULL;
+    if (backlog_tail != NULL)
+        backlog_tail->next_backlog = conn;
+    else
+        backlog_head = conn;
+    backlog_tail = conn;
+}
+
+// one more share for every peer of the backlog, the ones that still have more go back at the end
+void backlog_serve()
+{
+    struct peer_conn *conn, *list = backlog_head;
+
+    backlog_head = backlog_tail = NULL;
+    while ((conn = list) != NULL) {
+        list = conn->next_backlog;
+        conn->backlog = 0;
+        if (!conn->closed)
+            serve_peer(conn);
+    }
+}
+
+// ms until a peer of the backlog may run a frame, 0 = now, -1 = the backlog is empty
+int backlog_next_timeout()
+{
+    struct peer_conn *conn;
+    double wait, min = -1;
+
+    for (conn = backlog_head; conn != NULL; conn = conn->next_backlog) {
+        if (admit_rate <= 0 || conn->link != 0)
+            return 0;
+        wait = (1 - conn->tokens) / admit_rate * 1000 - (metric_now_ns() - conn->refilled) / 1e6;
+        if (wait <= 0)
+            return 0;
+        if (min < 0 || wait < min)
+            min = wait;
+    }
+    return min < 0 ? -1 : (int) min + 1;
+}
+
+/* ---------- history of the reports ----------
+The /msg and /edit reports of the peers go into a ring of the last history.cap (-H) records. The records
+have a fixed size and come from slabs of HISTORY_SLAB that are allocated when the ring first reaches them
+and then reused, so the memory stops growing once the ring is full. Every report gets the next seq, and
+record seq is in slot seq % cap, so /history [from] [count] goes straight to its first record. With -D a
+record that the ring overwrites is written to the spill file at seq * its size, a page older than the
+ring is read from there with one pread per record; without it the page starts at the oldest one kept. */
+
+// the spill file (NULL = none), it starts empty: the checkpoints have what an older server reported
+void history_open(const char *spill)
+{
+    history.slabs = calloc((history.cap + HISTORY_SLAB - 1) / HISTORY_SLAB, sizeof(*history.slabs));
+    if (history.slabs == NULL) {
+        perror("Error on allocating history");
+        exit(1);
+    }
+    if (spill == NULL)
+        return;
+    history.spill_fd = open(spill, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (history.spill_fd < 0) {
+        perror("Error on opening history spill file");
+        exit(1);
+    }
+}
+
+// forgets the reports (a checkpoint is restored), the slabs stay for the next ones
+void history_reset()
+{
+    history.next = 0;
+    memset(history.last, 0, sizeof(history.last));
+    metric_set(&metrics[M_HISTORY], 0);
+    if (history.spill_fd >= 0 && ftruncate(history.spill_fd, 0) < 0)
+        perror("Error on truncating history spill file");
+}
+
+// the record seq if the ring still has it, NULL otherwise
+struct hist_rec *history_slot(uint64_t seq)
+{
+    uint32_t slot;
+
+    if (seq >= history.next || history.next - seq > history.cap)
+        return NULL;
+    slot = seq % history.cap;
+    return &history.slabs[slot / HISTORY_SLAB][slot % HISTORY_SLAB];
+}
+
+// keeps a report as record history.next, the one it replaces goes to the spill file
+struct hist_rec *history_add(int option, const char *text, uint64_t ts, int port, int entry)
+{
+    uint32_t slot = history.next % history.cap, n;
+    struct hist_rec *r, **slab = &history.slabs[slot / HISTORY_SLAB];
+
+    if (*slab == NULL) { // the ring reached a new slab, the last one may be smaller
+        n = history.cap - slot < HISTORY_SLAB ? history.cap - slot : HISTORY_SLAB;
+        *slab = malloc(n * sizeof(**slab));
+        if (*slab == NULL) {
+            perror("Error on allocating history");
+            exit(1);
+        }
+        metric_add(&metrics[M_HISTORY_MEMORY], n * sizeof(**slab));
+    }
+    r = &(*slab)[slot % HISTORY_SLAB];
+    if (history.next >= history.cap && history.spill_fd >= 0) {
+        if (pwrite(history.spill_fd, r, sizeof(*r), (off_t) (r->seq * sizeof(*r))) != sizeof(*r))
+            perror("Error on writing history spill file");
+        metric_add(&metrics[M_HISTORY_SPILLED], 1);
+    }
+    memset(r, 0, sizeof(*r)); // the spill file gets no old bytes behind the text
+    r->seq = history.next++;
+    r->ts = ts;
+    r->port = port;
+    r->entry = entry;
+    r->option = option;
+    snprintf(r->text, SIZE, "%s", text);
+    history.last[option] = history.next;
+    metric_set(&metrics[M_HISTORY], history.next < history.cap ? history.next : history.cap);
+    return r;
+}
+
+// copies the record seq from the ring or the spill file, -1 when it is in neither
+int history_get(uint64_t seq, struct hist_rec *r)
+{
+    struct hist_rec *slot = history_slot(seq);
+
+    if (slot != NULL) {
+        *r = *slot;
+        return 0;
+    }
+    if (history.spill_fd < 0 || seq >= history.next)
+        return -1;
+    if (pread(history.spill_fd, r, sizeof(*r), (off_t) (seq * sizeof(*r))) != sizeof(*r) || r->seq != seq)
+        return -1;
+    return 0;
+}
+
+/* /history [from] [count]: count records (HISTORY_PAGE) from record from, without from the last ones;
+   the reply ends with the command of the next page */
+void history_command(struct peer_conn *conn, char *args)
+{
+    char page[SIZE*8], line[SIZE*2];
+    long long from = -1, count = HISTORY_PAGE;
+    uint64_t seq, oldest, end;
+    struct hist_rec r;
+    int len = 0, n;
+
+    sscanf(args, "%lld %lld", &from, &count);
+    if (count < 1)
+        count = 1;
+    if (count > HISTORY_MAX_PAGE)
+        count = HISTORY_MAX_PAGE;
+    oldest = history.spill_fd >= 0 || history.next <= history.cap ? 0 : history.next - history.cap;
+    if (from < 0) // the last page
+        from = history.next > (uint64_t) count ? history.next - count : 0;
+    if ((uint64_t) from < oldest)
+        from = oldest;
+    end = (uint64_t) from + count < history.next ? (uint64_t) from + count : history.next;
+    len = snprintf(page, sizeof(page), "History %llu..%llu of %llu-%llu\n", (unsigned long long) from,
+                   (unsigned long long) (end > 0 ? end - 1 : 0), (unsigned long long) oldest,
+                   (unsigned long long) (history.next > 0 ? history.next - 1 : 0));
+    for (seq = from; seq < end; seq++) {
+        if (history_get(seq, &r) < 0)
+            continue;
+        n = snprintf(line, sizeof(line), "#%llu %s TS %llu port %d key %d: %s\n", (unsigned long long) r.seq,
+                     r.option == 1 ? "msg" : "edit", (unsigned long long) r.ts, r.port, r.entry, r.text);
+        if (len + n >= (int) sizeof(page)) { // full, this part goes now
+            reply_text(conn, page);
+            len = 0;
+        }
+        memcpy(page + len, line, n + 1);
+        len += n;
+    }
+    if (end < history.next)
+        len += snprintf(page + len, sizeof(page) - len, "next: /history %llu %lld\n", (unsigned long long) end, count);
+    reply_text(conn, page);
+}
+
+/* ---------- relay (-f relay of the peers) ----------
+A relayed frame is appended to the outbuf of every other member instead of being written at once, and
+relay_flush writes each outbuf once at the end of the pass of the event loop: a burst of N peers each
+relaying a frame costs N writes, not N * N. The bytes stay in outbuf behind anything send_peer queued
+before, so a peer gets the frames of the server and of every other peer in the order they came. */
+
+// queues the frames of a peer for all the other members
+void relay(struct peer_conn *from, const char *frames, int len)
+{
+    int id;
+    char header[PROTO_HEADER];
+    struct peer_conn *to;
+    struct proto_out o;
+
+    if (!from->member && !from->link)
+        return;
+    metric_add(&metrics[M_RELAYED], 1);
+    for (id = 0; id < registry.next_id; id++) {
+        to = registry.by_id[id];
+        if (to == NULL || to == from || !to->member || to->closed || to->moving)
+            continue;
+        relay_queue(to, frames, len);
+    }
+    if (from->link) // the members of the other servers have them from their own
+        return;
+    proto_init_out(&o, header, sizeof(header)); // a PROTO_RELAY header, the frames follow it in the outbuf of a link
+    proto_begin(&o, PROTO_RELAY, 0);
+    o.len += len;
+    proto_end(&o);
+    for (id = 0; id < cluster.n; id++) {
+        if ((to = cluster.links[id]) != NULL && !to->closed) {
+            relay_queue(to, header, PROTO_HEADER);
+            relay_queue(to, frames, len);
+        }
+    }
+}
+
+// appends to the outbuf of a peer (or a link), written by relay_flush
+void relay_queue(struct peer_conn *to, const char *data, int len)
+{
+    int cap;
+
+    if (to->closed)
+        return;
+    trace_add(&trace, TRACE_OUT, to->sock, to->port, data, len);
+    if (to->outlen + len > to->outcap) {
+        cap = to->outcap ? to->outcap : SIZE*4;
+        while (cap < to->outlen + len)
+            cap *= 2;
+        char *tmp = realloc(to->outbuf, cap);
+        if (tmp == NULL) {
+            close_peer(to);
+            return;
+        }
+        to->outbuf = tmp;
+        to->outcap = cap;
+    }
+    memcpy(to->outbuf + to->outlen, data, len);
+    to->outlen += len;
+    metric_add(&metrics[M_OUT_QUEUED], len);
+    if (!to->relay_pending) {
+        to->relay_pending = 1;
+        to->next_relay = relay_conns;
+        relay_conns = to;
+    }
+}
+
+// writes the relayed frames of this pass, what a slow peer does not take waits for EPOLLOUT
+void relay_flush()
+{
+    struct peer_conn *conn;
+
+    while ((conn = relay_conns) != NULL) {
+        relay_conns = conn->next_relay;
+        conn->relay_pending = 0;
+        if (conn->closed)
+            continue;
+        metric_add(&metrics[M_RELAY_WRITES], 1);
+        flush_peer(conn);
+        if (!conn->closed && conn->outlen > 0)
+            peer_events(conn);
+    }
+}
+
+/* ---------- registry of the peers ----------
+by_id is indexed by the id and conns by the socket, both grow on demand, so a lookup is one index
+and there is no limit on the peers. A departed id goes to the min-heap free_ids and is given out
+again before a new one. /list sends the cached payloads, they are rebuilt only after a join or a leave.
+The peers do not poll /list: a peer that says PROTO_HELLO becomes a member and gets the whole list once,
+then every join and leave is pushed to all the members as a PROTO_MEMBER delta with the next epoch. */
+
+// gives the peer the lowest free id
+int registry_add(struct peer_conn *conn)
+{
+    int id, i, child, last, n;
+
+    pthread_mutex_lock(&lock);
+    if (registry.nfree > 0) { // pop the smallest released id
+        id = registry.free_ids[0];
+        last = registry.free_ids[--registry.nfree];
+        i = 0;
+        while ((child = 2 * i + 1) < registry.nfree) {
+            if (child + 1 < registry.nfree && registry.free_ids[child+1] < registry.free_ids[child])
+                child++;
+            if (registry.free_ids[child] >= last)
+                break;
+            registry.free_ids[i] = registry.free_ids[child];
+            i = child;
+        }
+        registry.free_ids[i] = last;
+    }
+    else
+        id = registry.next_id++;
+    if (id >= registry.cap) {
+        n = registry.cap ? registry.cap * 2 : 64;
+        registry.by_id = realloc(registry.by_id, n * sizeof(*registry.by_id));
+        if (registry.by_id == NULL){
+            perror("Error on allocating registry");
+            exit(1);
+        }
+        memset(registry.by_id + registry.cap, 0, (n - registry.cap) * sizeof(*registry.by_id));
+        registry.cap = n;
+    }
+    registry.by_id[id] = conn;
+    registry.count++;
+    registry.dirty = 1;
+    pthread_mutex_unlock(&lock);
+    return id;
+}
+
+// releases the id of a departed peer
+void registry_remove(struct peer_conn *conn)
+{
+    int i, parent, id = conn->id;
+
+    pthread_mutex_lock(&lock);
+    if (registry.by_id[id] != conn) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    registry.by_id[id] = NULL;
+    registry.count--;
+    registry.dirty = 1;
+    if (registry.nfree == registry.free_cap) {
+        registry.free_cap = registry.free_cap ? registry.free_cap * 2 : 64;
+        registry.free_ids = realloc(registry.free_ids, registry.free_cap * sizeof(*registry.free_ids));
+        if (registry.free_ids == NULL){
+            perror("Error on allocating registry");
+            exit(1);
+        }
+    }
+    i = registry.nfree++;
+    while (i > 0 && registry.free_ids[parent = (i - 1) / 2] > id) {
+        registry.free_ids[i] = registry.free_ids[parent];
+        i = parent;
+    }
+    registry.free_ids[i] = id;
+    pthread_mutex_unlock(&lock);
+}
+
+// serializes the members into the /list payloads, called with lock held
+void registry_build()
+{
+    int id, cap, n;
+    struct proto_out o;
+
+    cap = PROTO_HEADER + 8 + (registry.members + cluster.nremote) * 10;
+    n = 8 + (registry.count + cluster.nremote) * 12 + 2; // "Peers: ", the ids and "\n"
+    if (n > cap)
+        cap = n;
+    if (cap > registry.list_cap) {
+        free(registry.list_frame);
+        free(registry.list_text);
+        registry.list_frame = malloc(cap);
+        registry.list_text = malloc(cap);
+        if (registry.list_frame == NULL || registry.list_text == NULL){
+            perror("Error on allocating peer list");
+            exit(1);
+        }
+        registry.list_cap = cap;
+    }
+
+    proto_init_out(&o, registry.list_frame, registry.list_cap);
+    proto_begin(&o, PROTO_PEER_LIST, 0);
+    proto_put_u32(&o, registry.epoch);
+    proto_put_u32(&o, registry.members + cluster.nremote);
+    n = sprintf(registry.list_text, "Peers: ");
+    for (id = 0; id < registry.next_id; id++) {
+        if (registry.by_id[id] == NULL)
+            continue;
+        if (registry.by_id[id]->member) {
+            proto_put_u32(&o, registry_gid(registry.by_id[id]));
+            proto_put_u16(&o, registry.by_id[id]->port);
+            proto_put_u32(&o, registry.by_id[id]->addr);
+        }
+        n += sprintf(registry.list_text + n, "%d ", registry_gid(registry.by_id[id]));
+    }
+    for (id = 0; id < cluster.nremote; id++) { // the members of the other servers, the merged view
+        proto_put_u32(&o, cluster.remote[id].id);
+        proto_put_u16(&o, cluster.remote[id].port);
+        proto_put_u32(&o, cluster.remote[id].addr);
+        n += sprintf(registry.list_text + n, "%d ", cluster.remote[id].id);
+    }
+    n += sprintf(registry.list_text + n, "\n");
+    registry.list_frame_len = proto_end(&o);
+    registry.list_text_len = n;
+    registry.dirty = 0;
+}
+
+/* the port is the id of a peer in the chat (frames, Lamport ties, its DB), so it is unique among the
+   members even when they are on different hosts */
+int registry_port_taken(struct peer_conn *conn)
+{
+    int id, taken = 0;
+
+    pthread_mutex_lock(&lock);
+    for (id = 0; id < registry.next_id && !taken; id++) {
+        if (registry.by_id[id] != NULL && registry.by_id[id] != conn && registry.by_id[id]->member
+            && !registry.by_id[id]->moving && registry.by_id[id]->port == conn->port)
+            taken = 1;
+    }
+    pthread_mutex_unlock(&lock);
+    return taken;
+}
+
+// a peer said PROTO_HELLO: the others get the delta, it gets the whole list
+void registry_join(struct peer_conn *conn)
+{
+    struct remote_member *m = cluster_find(conn->port);
+
+    pthread_mutex_lock(&lock);
+    conn->member = 1;
+    registry.members++;
+    pthread_mutex_unlock(&lock);
+    if (m != NULL) { // it was a member of another server (moved or failed over), the members stay the same
+        cluster_drop(m);
+        registry.dirty = 1;
+        cluster_member(PROTO_JOIN, conn);
+    }
+    else
+        registry_delta(conn, PROTO_JOIN);
+    send_list(conn);
+}
+
+// the id of a peer in the lists, unique in the cluster (the ids of a server are its index modulo CLUSTER_MAX)
+int registry_gid(struct peer_conn *conn)
+{
+    return cluster.n > 0 ? conn->id * CLUSTER_MAX + cluster.self : conn->id;
+}
+
+// tells the other members (and the other servers) that conn joined or left
+void registry_delta(struct peer_conn *conn, int op)
+{
+    pthread_mutex_lock(&lock);
+    if (op == PROTO_LEAVE)
+        registry.members--;
+    pthread_mutex_unlock(&lock);
+    registry_push(registry_gid(conn), conn->port, conn->addr, op, conn);
+    cluster_member(op, conn);
+}
+
+// a join or leave goes to our members as a PROTO_MEMBER delta with the next epoch
+void registry_push(int id, int port, uint32_t addr, int op, struct peer_conn *except)
+{
+    char buffer[SIZE];
+    struct proto_out o;
+    struct peer_conn *other;
+
+    pthread_mutex_lock(&lock);
+    registry.epoch++;
+    registry.dirty = 1;
+    proto_init_out(&o, buffer, sizeof(buffer));
+    proto_begin(&o, PROTO_MEMBER, 0);
+    proto_put_u32(&o, registry.epoch);
+    proto_put_u8(&o, op);
+    proto_put_u32(&o, id);
+    proto_put_u16(&o, port);
+    proto_put_u32(&o, addr);
+    proto_end(&o);
+    pthread_mutex_unlock(&lock);
+    for (id = 0; id < registry.next_id; id++) {
+        other = registry.by_id[id];
+        if (other != NULL && other != except && other->member)
+            send_peer(other, o.buf, o.len);
+    }
+}
+
+/* ---------- cluster (-c) ----------
+Several servers split the peers: every server that is there puts CLUSTER_VNODES points on a hash ring
+(the same ring on all of them, it only depends on which servers are linked) and a peer belongs to the first
+point after the hash of its port. A peer that says PROTO_HELLO to the wrong server gets a PROTO_REDIRECT to
+its owner and says PROTO_HELLO again there with PROTO_HELLO_MOVED. Every pair of servers has one TCP link,
+opened by the one with the higher index (and opened again every CLUSTER_RETRY ms while it is missing); a
+link is a connection whose first frame is PROTO_SERVER_HELLO. Over the links the servers tell each other the
+joins and leaves of their members (all of them when a link comes up), the state reports of the members
+(every server keeps the whole history) and the relayed frames, and the reports of a snapshot go to the
+leader (the lowest index that is there), the only server that starts snapshots. /list and PROTO_PEER_LIST
+are the merged view: our members and the ones of the other servers.
+When a server comes or goes the ring changes and every server redirects the members that now belong to
+another one (and checks again every CLUSTER_RETRY ms, the views may differ for a moment). The members of a
+server that went away, and a peer we redirected, stay in the view for CLUSTER_GRACE ms: the peer comes
+back through another server, which tells the others it has it, and for the peers nothing changed. Only
+when that does not happen in time the members get a leave. */
+
+// reads -c host:port,host:port..., we are the one of -i or the one on our port
+void cluster_parse(char *list, int port, int self)
+{
+    char *item, *colon, *save;
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    cluster.self = -1;
+    for (item = strtok_r(list, ",", &save); item != NULL && cluster.n < CLUSTER_MAX; item = strtok_r(NULL, ",", &save)) {
+        colon = strrchr(item, ':');
+        if (colon != NULL)
+            *colon = '\0';
+        if (getaddrinfo(item, NULL, &hints, &res) != 0 || res == NULL) {
+            fprintf(stderr, "Error on resolving server %s\n", item);
+            exit(1);
+        }
+        cluster.addr[cluster.n] = *(struct sockaddr_in *) res->ai_addr;
+        cluster.addr[cluster.n].sin_port = htons(colon != NULL ? atoi(colon + 1) : SERVER_PORT);
+        freeaddrinfo(res);
+        if (cluster.self < 0 && ntohs(cluster.addr[cluster.n].sin_port) == port)
+            cluster.self = cluster.n;
+        cluster.n++;
+    }
+    if (self >= 0)
+        cluster.self = self;
+    if (cluster.self < 0 || cluster.self >= cluster.n) {
+        fprintf(stderr, "This server (port %d) is not in -c, use -i\n", port);
+        exit(1);
+    }
+    cluster_ring();
+    printf("Server %d of a cluster of %d\n", cluster.self, cluster.n);
+}
+
+// spreads the bits of x (the finalizer of murmur3)
+uint32_t cluster_hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x;
+}
+
+int compare_points(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// the points of the servers that are there (us and the linked ones)
+void cluster_ring()
+{
+    int i, v;
+
+    cluster.ring_len = 0;
+    for (i = 0; i < cluster.n; i++) {
+        if (i != cluster.self && cluster.links[i] == NULL)
+            continue;
+        for (v = 0; v < CLUSTER_VNODES; v++) {
+            cluster.ring[cluster.ring_len].hash = cluster_hash((i << 16) | v);
+            cluster.ring[cluster.ring_len].server = i;
+            cluster.ring_len++;
+        }
+    }
+    qsort(cluster.ring, cluster.ring_len, sizeof(cluster.ring[0]), compare_points); // by hash, the first member
+}
+
+// the server of the peer on port: the first point after its hash, round the ring
+int cluster_owner(int port)
+{
+    uint32_t h = cluster_hash(0x80000000u | port); // apart from the points of the servers
+    int lo = 0, hi = cluster.ring_len, mid;
+
+    if (cluster.ring_len == 0)
+        return cluster.self;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cluster.ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return cluster.ring[lo == cluster.ring_len ? 0 : lo].server;
+}
+
+// the lowest index that is there, it takes the snapshots
+int cluster_leader()
+{
+    int i;
+
+    for (i = 0; i < cluster.n; i++) {
+        if (i == cluster.self || cluster.links[i] != NULL)
+            return i;
+    }
+    return cluster.self;
+}
+
+// opens the link to server i (a lower index) without waiting for it: cluster_connected finishes it
+// when the socket is writable, a host that does not answer is tried again by cluster_timers
+void cluster_dial(int i)
+{
+    int fd, one = 1;
+    struct peer_conn *conn;
+    struct epoll_event ev;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return;
+    if (set_nonblocking(fd) < 0
+        || (connect(fd, (struct sockaddr *) &cluster.addr[i], sizeof(cluster.addr[i])) < 0 && errno != EINPROGRESS)) {
+        close(fd);
+        return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (fd >= conns_cap) {
+        int n = conns_cap ? conns_cap : 64;
+        while (n <= fd)
+            n *= 2;
+        conns = realloc(conns, n * sizeof(*conns));
+        if (conns == NULL){
+            perror("Error on allocating connections");
+            exit(1);
+        }
+        memset(conns + conns_cap, 0, (n - conns_cap) * sizeof(*conns));
+        conns_cap = n;
+    }
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL){
+        perror("Error on allocating connection");
+        exit(1);
+    }
+    conn->sock = fd;
+    conn->mode = MODE_BINARY;
+    conn->skip_line = 1;
+    conn->link = -1; // not a peer, and not a link before it is up
+    conn->dialing = i + 1;
+    cluster.dialing[i] = conn;
+    conns[fd] = conn;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// a link we opened is writable: up, or refused
+void cluster_connected(struct peer_conn *conn)
+{
+    int i = conn->dialing - 1, err = 0;
+    socklen_t len = sizeof(err);
+    struct epoll_event ev;
+
+    if (getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        close_peer(conn);
+        return;
+    }
+    cluster.dialing[i] = NULL;
+    conn->dialing = 0;
+    conn->link = 0;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sock, &ev);
+    cluster_link_up(conn, i);
+}
+
+// conn is the link to server i: it gets our members, the ring changes
+void cluster_link_up(struct peer_conn *conn, int i)
+{
+    char buffer[SIZE];
+    struct proto_out o;
+    struct peer_conn *member;
+    int id;
+
+    if (i < 0 || i >= cluster.n || i == cluster.self || cluster.links[i] != NULL) {
+        conn->link = -1; // not one of ours, or a second link
+        close_peer(conn);
+        return;
+    }
+    conn->link = i + 1;
+    cluster.links[i] = conn;
+    metric_add(&metrics[M_CLUSTER_LINKS], 1);
+    proto_init_out(&o, buffer, sizeof(buffer));
+    proto_begin(&o, PROTO_SERVER_HELLO, 0);
+    proto_put_u16(&o, cluster.self);
+    proto_end(&o);
+    send_peer(conn, o.buf, o.len);
+    for (id = 0; id < registry.next_id; id++) {
+        member = registry.by_id[id];
+        if (member != NULL && member->member && !member->moving)
+            cluster_member(PROTO_JOIN, member);
+    }
+    printf("Linked to server %d\n", i);
+    cluster_ring();
+    cluster_rebalance();
+}
+
+// the link to a server is gone: its members have CLUSTER_GRACE ms to come back through another server
+void cluster_link_down(struct peer_conn *conn)
+{
+    int i = conn->link - 1, n;
+
+    conn->link = 0;
+    if (cluster.links[i] != conn)
+        return;
+    cluster.links[i] = NULL;
+    metric_add(&metrics[M_CLUSTER_LINKS], -1);
+    for (n = 0; n < cluster.nremote; n++) {
+        if (cluster.remote[n].server == i && cluster.remote[n].gone_at == 0)
+            cluster.remote[n].gone_at = now_ms() + CLUSTER_GRACE;
+    }
+    printf("Server %d is gone\n", i);
+    cluster_ring();
+    cluster_rebalance();
+}
+
+// writes a frame to every link, or only to the one of server only (>= 0)
+void cluster_send(const char *frame, int len, int only)
+{
+    int i;
+
+    for (i = 0; i < cluster.n; i++) {
+        if (cluster.links[i] != NULL && (only < 0 || i == only))
+            send_peer(cluster.links[i], frame, len);
+    }
+}
+
+// tells the other servers that our member conn joined or left
+void cluster_member(int op, struct peer_conn *conn)
+{
+    char buffer[SIZE];
+    struct proto_out o;
+
+    if (cluster.n == 0)
+        return;
+    proto_init_out(&o, buffer, sizeof(buffer));
+    proto_begin(&o, PROTO_SERVER_MEMBER, 0);
+    proto_put_u8(&o, op);
+    proto_put_u32(&o, registry_gid(conn));
+    proto_put_u16(&o, conn->port);
+    proto_put_u32(&o, conn->addr);
+    proto_end(&o);
+    cluster_send(o.buf, o.len, -1);
+}
+
+// the member of another server on port, NULL if none
+struct remote_member *cluster_find(int port)
+{
+    int i;
+
+    for (i = 0; i < cluster.nremote; i++) {
+        if (cluster.remote[i].port == port)
+            return &cluster.remote[i];
+    }
+    return NULL;
+}
+
+// forgets a member of another server (it is ours now, or it left)
+void cluster_drop(struct remote_member *m)
+{
+    *m = cluster.remote[--cluster.nremote];
+    registry.dirty = 1;
+    metric_set(&metrics[M_CLUSTER_REMOTE], cluster.nremote);
+}
+
+// adds a member of server to the view, or moves it there
+struct remote_member *cluster_keep(int server, int id, int port, uint32_t addr)
+{
+    struct remote_member *m = cluster_find(port);
+
+    if (m == NULL) {
+        if (cluster.nremote == cluster.remote_cap) {
+            cluster.remote_cap = cluster.remote_cap ? cluster.remote_cap * 2 : 64;
+            cluster.remote = realloc(cluster.remote, cluster.remote_cap * sizeof(*cluster.remote));
+            if (cluster.remote == NULL){
+                perror("Error on allocating cluster members");
+                exit(1);
+            }
+        }
+        m = &cluster.remote[cluster.nremote++];
+        metric_set(&metrics[M_CLUSTER_REMOTE], cluster.nremote);
+    }
+    m->id = id;
+    m->port = port;
+    m->addr = addr;
+    m->server = server;
+    m->gone_at = 0;
+    m->moved = 0;
+    registry.dirty = 1;
+    return m;
+}
+
+// a join or leave of a member of server
+void cluster_remote(int server, int op, int id, int port, uint32_t addr)
+{
+    struct remote_member *m = cluster_find(port);
+    struct peer_conn *conn;
+    int i, known = m != NULL;
+
+    for (i = 0; i < registry.next_id && !known; i++) {
+        conn = registry.by_id[i];
+        if (conn != NULL && conn->member && conn->port == port) {
+            if (!conn->moving)
+                return; // ours, the other one is wrong
+            conn->member = 0; // the peer we redirected is there already, its old connection goes quietly
+            registry.members--;
+            known = 1;
+        }
+    }
+    if (op == PROTO_JOIN) {
+        cluster_keep(server, id, port, addr);
+        if (!known) // a new member of the chat, not one that moved
+            registry_push(id, port, addr, PROTO_JOIN, NULL);
+    }
+    else if (m != NULL && m->server == server) {
+        cluster_drop(m);
+        registry_push(id, port, addr, PROTO_LEAVE, NULL);
+    }
+}
+
+// our member conn, which we redirected, closed the connection: it has CLUSTER_GRACE ms to show up there
+void cluster_moved(struct peer_conn *conn)
+{
+    struct remote_member *m;
+
+    pthread_mutex_lock(&lock);
+    registry.members--;
+    pthread_mutex_unlock(&lock);
+    m = cluster_keep(conn->moving - 1, registry_gid(conn), conn->port, conn->addr);
+    m->gone_at = now_ms() + CLUSTER_GRACE;
+    m->moved = 1;
+}
+
+// sends a peer to server i of the cluster
+void cluster_redirect(struct peer_conn *conn, int i)
+{
+    char buffer[SIZE];
+    struct proto_out o;
+
+    proto_init_out(&o, buffer, sizeof(buffer));
+    proto_begin(&o, PROTO_REDIRECT, 0);
+    proto_put_u32(&o, ntohl(cluster.addr[i].sin_addr.s_addr));
+    proto_put_u16(&o, ntohs(cluster.addr[i].sin_port));
+    proto_end(&o);
+    send_peer(conn, o.buf, o.len);
+    conn->moving = i + 1;
+    metric_add(&metrics[M_REDIRECTS], 1);
+    printf("%d (port %d) goes to server %d\n", conn->id, conn->port, i);
+}
+
+// every member of a part of the ring that is not ours any more goes to its server
+void cluster_rebalance()
+{
+    int id, owner;
+    struct peer_conn *conn;
+
+    for (id = 0; id < registry.next_id; id++) {
+        conn = registry.by_id[id];
+        if (conn == NULL || !conn->member || conn->moving || conn->closed)
+            continue;
+        if ((owner = cluster_owner(conn->port)) != cluster.self && cluster.links[owner] != NULL)
+            cluster_redirect(conn, owner);
+    }
+}
+
+// passes a frame of our member on port to the other servers (or only to server only)
+void cluster_report(int port, const char *frame, int len, int only)
+{
+    char *buffer;
+    struct proto_out o;
+
+    if (cluster.n == 0 || (buffer = malloc(PROTO_HEADER + 2 + len)) == NULL)
+        return;
+    proto_init_out(&o, buffer, PROTO_HEADER + 2 + len);
+    proto_begin(&o, PROTO_SERVER_REPORT, 0);
+    proto_put_u16(&o, port);
+    proto_put(&o, frame, len);
+    if (proto_end(&o) >= 0)
+        cluster_send(o.buf, o.len, only);
+    free(buffer);
+}
+
+// a state report of our member goes to the history of every server
+void cluster_state(int option, char *message, uint64_t ts, int port, int entry)
+{
+    char buffer[SIZE*2];
+    struct proto_out o;
+
+    if (cluster.n == 0)
+        return;
+    proto_init_out(&o, buffer, sizeof(buffer));
+    proto_begin(&o, PROTO_STATE, 0);
+    proto_put_u8(&o, option);
+    proto_put_u64(&o, ts);
+    proto_put_u32(&o, entry);
+    proto_put_str(&o, message, strlen(message));
+    if (proto_end(&o) >= 0)
+        cluster_report(port, o.buf, o.len, -1);
+}
+
+// a frame of another server of the cluster
+void cluster_frame(struct peer_conn *conn, struct proto_frame *f)
+{
+    struct proto_in in;
+    struct proto_frame inner;
+    char message[SIZE];
+    int op, id, port, entry, option;
+    uint32_t addr;
+    uint64_t ts;
+
+    proto_init_in(&in, f);
+    if (f->kind == PROTO_SERVER_HELLO) { // a server linked to us, it is not a peer
+        if (conn->link > 0) // the answer of the server we linked to
+            return;
+        if (conn->link || conn->member || cluster.n == 0) { // a peer can not say it
+            close_peer(conn);
+            return;
+        }
+        registry_remove(conn);
+        metric_add(&metrics[M_PEERS], -1);
+        cluster_link_up(conn, proto_get_u16(&in));
+        return;
+    }
+    if (!conn->link)
+        return;
+    if (f->kind == PROTO_SERVER_MEMBER) {
+        op = proto_get_u8(&in);
+        id = proto_get_u32(&in);
+        port = proto_get_u16(&in);
+        addr = proto_get_u32(&in);
+        if (!in.err)
+            cluster_remote(conn->link - 1, op, id, port, addr);
+    }
+    else if (f->kind == PROTO_SERVER_REPORT) {
+        port = proto_get_u16(&in);
+        if (in.err || proto_parse(in.p, in.left, &inner) != 1)
+            return;
+        if (inner.kind == PROTO_STATE) {
+            proto_init_in(&in, &inner);
+            option = proto_get_u8(&in);
+            ts = proto_get_u64(&in);
+            entry = (int) proto_get_u32(&in);
+            proto_get_cstr(&in, message, SIZE);
+            if (!in.err)
+                state_report(option, message, ts, port, entry);
+        }
+        else if (inner.kind == PROTO_SNAP_STATE || inner.kind == PROTO_SNAP_CHANNEL)
+            snapshot_frame(port, &inner);
+    }
+}
+
+// links the servers that are missing, drops the members that did not come back, checks the ring
+void cluster_timers()
+{
+    int i;
+    long long now = now_ms();
+    struct remote_member *m;
+    char buffer[SIZE];
+    struct proto_out o;
+
+    for (i = 0; i < cluster.nremote; i++) {
+        m = &cluster.remote[i];
+        if (m->gone_at == 0 || now < m->gone_at)
+            continue;
+        printf("Member on port %d did not come back\n", m->port);
+        if (m->moved) { // the others think it is still ours
+            proto_init_out(&o, buffer, sizeof(buffer));
+            proto_begin(&o, PROTO_SERVER_MEMBER, 0);
+            proto_put_u8(&o, PROTO_LEAVE);
+            proto_put_u32(&o, m->id);
+            proto_put_u16(&o, m->port);
+            proto_put_u32(&o, m->addr);
+            proto_end(&o);
+            cluster_send(o.buf, o.len, -1);
+        }
+        registry_push(m->id, m->port, m->addr, PROTO_LEAVE, NULL);
+        cluster_drop(m);
+        i--; // the last one took its place
+    }
+    if (now < cluster.next_check)
+        return;
+    cluster.next_check = now + CLUSTER_RETRY;
+    for (i = 0; i < cluster.self; i++) {
+        if (cluster.dialing[i] != NULL) // no answer in CLUSTER_RETRY ms, it starts over
+            close_peer(cluster.dialing[i]);
+        if (cluster.links[i] == NULL)
+            cluster_dial(i);
+    }
+    cluster_rebalance();
+}
+
+// milliseconds until cluster_timers has something to do
+int cluster_next_timeout()
+{
+    long long next = cluster.next_check, now = now_ms();
+    int i;
+
+    for (i = 0; i < cluster.nremote; i++) {
+        if (cluster.remote[i].gone_at != 0 && cluster.remote[i].gone_at < next)
+            next = cluster.remote[i].gone_at;
+    }
+    return next > now ? (int) (next - now) : 0;
+}
+
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// server departing
+void signal_handler(int signnum){
+
+        printf("\nServer shutting down.. \n");  //the handler for the signal SIGINT ( ctrl-c )
+		
+        pthread_mutex_destroy(&lock);                                              
+        close(sockfd);
+        sleep(1);
+        exit(0);
+}
+
+// writes the rest of the trace (-T) when the server exits
+void trace_end()
+{
+    trace_close(&trace);
+}
+
+/* ---------- global consistent states (Chandy-Lamport snapshots) ----------
+The server starts a snapshot every snapshot_interval seconds (or on /snapshot) by sending PROTO_MARKER
+to every peer. A peer records its DB, multicasts the marker to the other peers and records the chat
+messages that reach it on every channel until the marker of that channel comes, chat goes on
+meanwhile. The server appends the reports to snapshots/snap-N.tmp as they arrive and renames it to
+snap-N.ckpt when every peer has finished. Every SNAPSHOT_FULL_EVERY snapshot is full, the others only
+have the entries that changed since the last one. Every report frame in the file follows a
+PROTO_HELLO frame with the port of the peer.
+With -r the server loads the chain (last full checkpoint and the ones after it) and a peer that
+reconnects gets the entries it is missing with PROTO_SYNC. */
+
+long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void snapshot_name(char *path, uint32_t id, const char *ext)
+{
+    snprintf(path, SIZE, "%s/snap-%06u.%s", snapshot_dir, id, ext);
+}
+
+// writes a frame to the checkpoint being built, after the port it comes from
+void snapshot_write(int port, const char *frame, uint32_t len)
+{
+    char buffer[SIZE];
+    struct proto_out o;
+
+    proto_init_out(&o, buffer, sizeof(buffer));
+    proto_begin(&o, PROTO_HELLO, 0);
+    proto_put_u16(&o, port);
+    proto_end(&o);
+    if (write(snap.fd, o.buf, o.len) != (int) o.len || write(snap.fd, frame, len) != (int) len)
+        snap.failed = 1;
+}
+
+// sends the markers of a new snapshot to every peer
+void snapshot_start()
+{
+    int n;
+    uint64_t seq;
+    char path[SIZE], buffer[SIZE*2];
+    struct proto_out o;
+    struct peer_conn *conn;
+    struct hist_rec *r;
+
+    if (snap.active)
+        return;
+    snap.id = next_snap_id++;
+    snap.full = (last_complete == 0 || snap.id % SNAPSHOT_FULL_EVERY == 0);
+    snap.expected = snap.reported = snap.failed = 0;
+    snap.deadline = now_ms() + SNAPSHOT_TIMEOUT;
+    snapshot_name(path, snap.id, "tmp");
+    snap.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (snap.fd < 0) {
+        perror("Error on creating snapshot");
+        return;
+    }
+    snap.active = 1;
+    snap.start = metric_now_ns();
+
+    /* header: the marker itself, then the state of the server */
+    proto_init_out(&o, buffer, sizeof(buffer));
+    proto_begin(&o, PROTO_MARKER, 0);
+    proto_put_u16(&o, 0);
+    proto_put_u32(&o, snap.id);
+    proto_put_u8(&o, snap.full);
+    proto_put_u32(&o, last_complete);
+    proto_end(&o);
+    snapshot_write(0, o.buf, o.len);
+    for (seq = history.next > history.cap ? history.next - history.cap : 0; seq < history.next; seq++) {
+        r = history_slot(seq);
+        snapshot_state(r->option, r->text, r->ts, r->port, r->entry);
+    }
+
+    for (n = 0; n < conns_cap; n++) {
+        conn = conns[n];
+        if (conn == NULL || conn->mode != MODE_BINARY || conn->port == 0)
+            continue;
+        conn->snap_id = snap.id; // its report is expected
+        snap.expected++;
+        send_peer(conn, o.buf, o.len);
+    }
+    for (n = 0; n < cluster.nremote; n++) { // their servers pass their reports on, the markers come from the peers
+        if (cluster.remote[n].gone_at == 0)
+            snap.expected++;
+    }
+    printf("Snapshot %u started (%s) with %d peers\n", snap.id, snap.full ? "full" : "incremental", snap.expected);
+    if (snap.expected == 0)
+        snapshot_finish();
+}
+
+// a report of the state of the server goes into the checkpoint as a PROTO_STATE frame
+void snapshot_state(int option, char *message, uint64_t ts, int port, int entry)
+{
+    char buffer[SIZE*2];
+    struct proto_out o;
+
+    proto_init_out(&o, buffer, sizeof(buffer));
+    proto_begin(&o, PROTO_STATE, 0);
+    proto_put_u8(&o, option);
+    proto_put_u64(&o, ts);
+    proto_put_u32(&o, entry);
+    proto_put_str(&o, message, strlen(message));
+    if (proto_end(&o) >= 0)
+        snapshot_write(port, o.buf, o.len);
+}
+
+// a part of the report of a peer, PROTO_SNAP_CHANNEL is the last one
+void snapshot_report(struct peer_conn *conn, struct proto_frame *f)
+{
+    if (!snap.active || conn->snap_id != snap.id)
+        return; // late report of a snapshot that was given up
+    if (f->kind == PROTO_SNAP_CHANNEL)
+        conn->snap_id = 0;
+    snapshot_frame(conn->port, f);
+}
+
+// a part of the report of the peer on port (ours, or of another server of the cluster)
+void snapshot_frame(int port, struct proto_frame *f)
+{
+    struct proto_in in;
+
+    proto_init_in(&in, f);
+    if (!snap.active || proto_get_u32(&in) != snap.id)
+        return;
+    snapshot_write(port, f->payload - PROTO_HEADER, PROTO_HEADER + f->len);
+    if (f->kind == PROTO_SNAP_CHANNEL) {
+        snap.reported++;
+        if (snap.reported >= snap.expected)
+            snapshot_finish();
+    }
+}
+
+// all the peers reported: the checkpoint becomes the latest one
+void snapshot_finish()
+{
+    char tmp[SIZE], path[SIZE];
+    uint32_t id;
+
+    snap.active = 0;
+    snapshot_name(tmp, snap.id, "tmp");
+    if (snap.failed || fsync(snap.fd) < 0) {
+        close(snap.fd);
+        unlink(tmp);
+        printf("Snapshot %u failed\n", snap.id);
+        return;
+    }
+    close(snap.fd);
+    snapshot_name(path, snap.id, "ckpt");
+    rename(tmp, path);
+    last_complete = snap.id;
+    metric_add(&metrics[M_SNAPSHOTS], 1);
+    metric_observe(&metrics[M_SNAPSHOT_TIME], metric_now_ns() - snap.start);
+    checkpoint_apply(snap.id, 0);
+    printf("Snapshot %u done with %d peers\n", snap.id, snap.reported);
+
+    if (snap.full) { // the older checkpoints are not needed any more
+        for (id = first_checkpoint; id < snap.id; id++) {
+            snapshot_name(path, id, "ckpt");
+            unlink(path);
+        }
+        first_checkpoint = snap.id;
+    }
+}
+
+// gives up a snapshot whose reports did not come in time
+void snapshot_timers()
+{
+    char tmp[SIZE];
+
+    if (snap.active && now_ms() >= snap.deadline) {
+        snap.active = 0;
+        close(snap.fd);
+        snapshot_name(tmp, snap.id, "tmp");
+        unlink(tmp);
+        printf("Snapshot %u timed out with %d of %d peers\n", snap.id, snap.reported, snap.expected);
+    }
+    if (snapshot_interval > 0 && now_ms() >= next_snap_at) {
+        next_snap_at = now_ms() + snapshot_interval * 1000LL;
+        if (cluster.n == 0 || cluster_leader() == cluster.self) // one snapshot of all the peers at a time
+            snapshot_start();
+    }
+}
+
+// milliseconds until the next snapshot or the timeout of the current one, -1 if none
+int snapshot_next_timeout()
+{
+    long long next = -1, now = now_ms();
+
+    if (snapshot_interval > 0)
+        next = next_snap_at;
+    if (snap.active && (next < 0 || snap.deadline < next))
+        next = snap.deadline;
+    if (next < 0)
+        return -1;
+    return next > now ? (int) (next - now) : 0;
+}
+
+// the DB image of a peer (by port) rebuilt from the checkpoints
+struct image *image_get(int port, int create)
+{
+    struct image *im;
+
+    for (im = images; im != NULL; im = im->next) {
+        if (im->port == port)
+            return im;
+    }
+    if (!create)
+        return NULL;
+    im = calloc(1, sizeof(*im));
+    if (im == NULL) {
+        perror("Error on allocating image");
+        exit(1);
+    }
+    im->port = port;
+    im->next = images;
+    images = im;
+    return im;
+}
+
+// makes room in the image for entry, -1 when it is far past the end (a corrupt report or checkpoint)
+int image_grow(struct image *im, uint32_t entry)
+{
+    size_t cap;
+
+    if (entry < im->cap)
+        return 0;
+    if (entry >= (uint64_t) im->key + SYNC_CHUNK)
+        return -1;
+    cap = im->cap ? im->cap : 1024;
+    while (cap <= entry)
+        cap *= 2;
+    if (cap > UINT32_MAX || cap > SIZE_MAX / sizeof(*im->entries))
+        return -1;
+    im->entries = realloc(im->entries, cap * sizeof(*im->entries));
+    if (im->entries == NULL) {
+        perror("Error on allocating image");
+        exit(1);
+    }
+    memset(im->entries + im->cap, 0, (cap - im->cap) * sizeof(*im->entries));
+    im->cap = cap;
+    return 0;
+}
+
+void image_set(struct image *im, uint32_t entry, uint32_t version, const char *text, uint32_t len)
+{
+    if (image_grow(im, entry) < 0)
+        return;
+    if (im->entries[entry].version > version)
+        return;
+    free(im->entries[entry].text);
+    im->entries[entry].text = malloc(len + 1);
+    if (im->entries[entry].text == NULL) {
+        perror("Error on allocating image");
+        exit(1);
+    }
+    memcpy(im->entries[entry].text, text, len);
+    im->entries[entry].text[len] = '\0';
+    im->entries[entry].version = version;
+    if (entry >= im->key)
+        im->key = entry + 1;
+}
+
+// applies a checkpoint file to the images, restore = also the state of the server
+int checkpoint_apply(uint32_t id, int restore)
+{
+    char path[SIZE], *data, message[SIZE];
+    struct stat st;
+    struct proto_frame f;
+    struct proto_in in;
+    struct image *im;
+    uint32_t off = 0, n, i, entry, version, len;
+    uint64_t ts;
+    int fd, port = 0, option, full = 0;
+    const char *text;
+
+    snapshot_name(path, id, "ckpt");
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    if (restore)
+        history_reset();
+    for (im = images; im != NULL; im = im->next)
+        im->npending = 0; // only the messages in flight of the latest checkpoint count
+    while (proto_parse(data + off, st.st_size - off, &f) == 1) {
+        off += PROTO_HEADER + f.len;
+        proto_init_in(&in, &f);
+        switch (f.kind) {
+        case PROTO_HELLO:
+            port = proto_get_u16(&in);
+            break;
+        case PROTO_MARKER:
+            proto_get_u16(&in);
+            proto_get_u32(&in);
+            full = proto_get_u8(&in);
+            if (full) { // a full checkpoint replaces the images
+                for (im = images; im != NULL; im = im->next) {
+                    for (i = 0; i < im->cap; i++)
+                        free(im->entries[i].text);
+                    memset(im->entries, 0, im->cap * sizeof(*im->entries));
+                    im->key = 0;
+                }
+            }
+            break;
+        case PROTO_STATE:
+            if (!restore)
+                break;
+            option = proto_get_u8(&in);
+            ts = proto_get_u64(&in);
+            entry = proto_get_u32(&in);
+            proto_get_cstr(&in, message, SIZE);
+            if (option == 1 || option == 2)
+                history_add(option, message, ts, port, entry);
+            break;
+        case PROTO_SNAP_STATE: // u32 id, u8 full, u64 lamport, u32 key, u32 n, n * (u32 entry, u32 version, str)
+            im = image_get(port, 1);
+            proto_get_u32(&in);
+            if (proto_get_u8(&in)) { // a full report of this peer
+                for (i = 0; i < im->cap; i++) {
+                    free(im->entries[i].text);
+                    im->entries[i].text = NULL;
+                    im->entries[i].version = 0;
+                }
+                im->key = 0;
+            }
+            im->lamport = proto_get_u64(&in);
+            entry = proto_get_u32(&in);
+            if (entry > im->key && image_grow(im, entry - 1) == 0) // else its entries move the key one by one
+                im->key = entry;
+            n = proto_get_u32(&in);
+            for (i = 0; i < n && !in.err; i++) {
+                entry = proto_get_u32(&in);
+                version = proto_get_u32(&in);
+                text = proto_get_str(&in, &len);
+                if (text != NULL)
+                    image_set(im, entry, version, text, len);
+            }
+            break;
+        case PROTO_SNAP_CHANNEL: // u32 id, u32 n, n * (u16 from, u64 ts, str): chat not yet in the DB
+            im = image_get(port, 1);
+            proto_get_u32(&in);
+            n = proto_get_u32(&in);
+            for (i = 0; i < n && !in.err; i++) {
+                if (im->npending == im->pending_cap) {
+                    im->pending_cap = im->pending_cap ? im->pending_cap * 2 : 64;
+                    im->pending = realloc(im->pending, im->pending_cap * sizeof(*im->pending));
+                    if (im->pending == NULL) {
+                        perror("Error on allocating image");
+                        exit(1);
+                    }
+                }
+                im->pending[im->npending].port = proto_get_u16(&in);
+                im->pending[im->npending].ts = proto_get_u64(&in);
+                proto_get_cstr(&in, im->pending[im->npending].text, SIZE);
+                im->npending++;
+            }
+            break;
+        }
+    }
+    munmap(data, st.st_size);
+    for (im = images; im != NULL; im = im->next) // in flight = after the DB, in total order
+        qsort(im->pending, im->npending, sizeof(*im->pending), compare_pending);
+    return 0;
+}
+
+int compare_pending(const void *a, const void *b)
+{
+    const struct pending_msg *x = a, *y = b;
+    if (x->ts != y->ts)
+        return x->ts < y->ts ? -1 : 1;
+    return x->port - y->port;
+}
+
+int compare_ids(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// finds the checkpoints on startup, recover = load the latest chain
+void checkpoints_load(int recover)
+{
+    DIR *dir;
+    struct dirent *de;
+    uint32_t *ids = NULL, id;
+    int n = 0, cap = 0, i, start = 0;
+    char path[SIZE], buffer[SIZE];
+    struct proto_frame f;
+    int fd;
+
+    if (mkdir(snapshot_dir, 0755) < 0 && errno != EEXIST) {
+        perror("Error on creating snapshot directory");
+        exit(1);
+    }
+    dir = opendir(snapshot_dir);
+    if (dir == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        if (sscanf(de->d_name, "snap-%u.ckpt", &id) != 1 || strstr(de->d_name, ".ckpt") == NULL)
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            ids = realloc(ids, cap * sizeof(*ids));
+        }
+        ids[n++] = id;
+    }
+    closedir(dir);
+    qsort(ids, n, sizeof(*ids), compare_ids);
+    if (n > 0)
+        next_snap_id = ids[n-1] + 1;
+    if (!recover || n == 0) {
+        free(ids);
+        return;
+    }
+
+    /* the chain starts at the last full checkpoint */
+    for (i = n - 1; i >= 0; i--) {
+        snapshot_name(path, ids[i], "ckpt");
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+            continue;
+        // the file starts with HELLO(0) and the marker
+        if (read(fd, buffer, sizeof(buffer)) > 0 && proto_parse(buffer, sizeof(buffer), &f) == 1
+            && proto_parse(buffer + PROTO_HEADER + f.len, sizeof(buffer) - PROTO_HEADER - f.len, &f) == 1
+            && f.kind == PROTO_MARKER && f.len >= 11 && f.payload[6]) {
+            close(fd);
+            start = i;
+            break;
+        }
+        close(fd);
+    }
+    for (i = start; i < n; i++)
+        checkpoint_apply(ids[i], i == n - 1);
+    first_checkpoint = ids[start];
+    last_complete = ids[n-1];
+    printf("Recovered from snapshot %u (%d checkpoints), %llu messages and edits\n", last_complete, n - start,
+           (unsigned long long) history.next);
+    free(ids);
+}
+
+// a peer (re)joined: sends the entries of its image it does not have
+void sync_peer(struct peer_conn *conn, uint32_t have)
+{
+    char *buffer;
+    struct proto_out o;
+    struct image *im = image_get(conn->port, 0);
+    uint32_t entry, n = 0, count = 0, sent = 0, pos = 0, i;
+
+    buffer = malloc(SYNC_CHUNK + SIZE*2);
+    if (buffer == NULL)
+        return;
+    proto_init_out(&o, buffer, SYNC_CHUNK + SIZE*2);
+    if (im != NULL) {
+        for (entry = 0; entry < im->key + im->npending; entry++) {
+            if (count == 0) { // a new chunk
+                proto_init_out(&o, buffer, SYNC_CHUNK + SIZE*2);
+                proto_begin(&o, PROTO_SYNC, 0);
+                proto_put_u64(&o, im->lamport);
+                pos = o.len;
+                proto_put_u32(&o, 0);
+            }
+            if (entry < im->key) { // the entries it misses and the edited ones
+                if (im->entries[entry].text == NULL || (entry < have && im->entries[entry].version <= 1))
+                    continue;
+                proto_put_u32(&o, entry);
+                proto_put_u32(&o, im->entries[entry].version);
+                proto_put_str(&o, im->entries[entry].text, strlen(im->entries[entry].text));
+            }
+            else { // messages that were in flight get the next entries
+                if (entry < have)
+                    continue;
+                i = entry - im->key;
+                proto_put_u32(&o, entry);
+                proto_put_u32(&o, 1);
+                proto_put_str(&o, im->pending[i].text, strlen(im->pending[i].text));
+            }
+            count++;
+            if (o.len >= SYNC_CHUNK) {
+                n = htonl(count);
+                memcpy(o.buf + pos, &n, 4);
+                proto_end(&o);
+                send_peer(conn, o.buf, o.len);
+                sent += count;
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            n = htonl(count);
+            memcpy(o.buf + pos, &n, 4);
+            proto_end(&o);
+            send_peer(conn, o.buf, o.len);
+            sent += count;
+        }
+    }
+    proto_init_out(&o, buffer, SIZE);
+    proto_begin(&o, PROTO_SYNC_DONE, 0);
+    proto_put_u32(&o, last_complete);
+    proto_put_u32(&o, sent);
+    proto_end(&o);
+    send_peer(conn, o.buf, o.len);
+    free(buffer);
+    if (sent > 0)
+        printf("%d resynced %u entries from snapshot %u\n", conn->id, sent, last_complete);
 }
@@ -0,0 +1,245 @@
+/*
+Shared memory between the peers of one host (-M), the datagrams of the reliable channel without the UDP stack.
+
+A peer with -M creates the POSIX shared memory /p2pchat-<port>: a header and SHM_SLOTS rings, each with one
+writer (a peer that sends to it, it claims a free slot with a compare-and-swap, or the slot of a process that
+is gone) and one reader (the owner). A record is u32 length and the bytes of a datagram, padded to 8 bytes;
+the writer copies it in and publishes the new head, the reader copies it out and publishes the tail, so a
+datagram costs two memcpy and no syscall. A ring that is full (or a peer that has no shared memory) is the
+business of the caller: it sends the datagram by UDP, the reliable channel puts them back in order.
+
+Wakeups: the reader says it is going to sleep (sleeping = 1) and looks at the rings once more; a writer that
+sees sleeping after publishing its record takes it back and bumps the futex bell. Under load nobody sleeps and
+there is no syscall at all; an idle reader costs the writer one FUTEX_WAKE. The thread that waits on the bell
+(shm_wait) turns it into an eventfd of the epoll loop of the peer.
+*/
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_MAGIC "P2PSHM1\n"
+#define SHM_SLOTS 64 // peers that may write to one peer, the others use UDP
+#define SHM_RING (1 << 18) // bytes of a ring (power of 2), the pages are only touched when used
+
+struct shm_ring { /*datagrams from one peer, head and tail on their own cache lines*/
+    uint64_t head __attribute__((aligned(64))); // bytes written, by the writer
+    uint64_t tail __attribute__((aligned(64))); // bytes read, by the reader
+    uint32_t owner __attribute__((aligned(64))); // port of the writer, 0 = free
+    uint32_t pid; // of the writer
+    char data[SHM_RING] __attribute__((aligned(64)));
+};
+
+struct shm_box { /*the shared memory of one peer, what the others write to it*/
+    char magic[8];
+    uint32_t port, pid;
+    uint32_t used; // slots given out so far, the reader looks at those
+    uint32_t sleeping __attribute__((aligned(64))); // 1: the reader is about to sleep, wake it
+    uint32_t bell; // futex, +1 for every wakeup
+    struct shm_ring rings[SHM_SLOTS] __attribute__((aligned(64)));
+};
+
+static inline void shm_name(char *name, int size, int port)
+{
+    snprintf(name, size, "/p2pchat-%d", port);
+}
+
+// the shared memory of our port, empty (NULL on error)
+static inline struct shm_box *shm_create(int port)
+{
+    char name[32];
+    struct shm_box *box;
+    int fd;
+
+    shm_name(name, sizeof(name), port);
+    shm_unlink(name); // one of a process that did not exit cleanly, its writers find the new one
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof(struct shm_box)) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    box = mmap(NULL, sizeof(struct shm_box), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (box == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    box->port = port;
+    box->pid = getpid();
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(box->magic, SHM_MAGIC, 8); // the writers may come in now
+    return box;
+}
+
+// removes the name of our shared memory at exit (the mapping goes with the process), the writers that
+// have it mapped write to nobody until they hear that we left
+static inline void shm_remove(int port)
+{
+    char name[32];
+
+    shm_name(name, sizeof(name), port);
+    shm_unlink(name);
+}
+
+// 1 when the process pid is there
+static inline int shm_alive(uint32_t pid)
+{
+    return pid != 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// maps the shared memory of the peer on port and claims a ring in it for us (from), NULL = none
+static inline struct shm_ring *shm_attach(int port, int from, struct shm_box **boxp)
+{
+    char name[32];
+    struct shm_box *box;
+    struct stat st;
+    uint32_t owner, i;
+    int fd;
+
+    shm_name(name, sizeof(name), port);
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size != sizeof(struct shm_box)) {
+        close(fd);
+        return NULL;
+    }
+    box = mmap(NULL, sizeof(struct shm_box), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (box == MAP_FAILED)
+        return NULL;
+    if (memcmp(box->magic, SHM_MAGIC, 8) != 0 || box->port != (uint32_t) port || !shm_alive(box->pid)) {
+        munmap(box, sizeof(*box));
+        return NULL;
+    }
+    for (i = 0; i < SHM_SLOTS; i++) { // ours from before, a free one, or one whose writer is gone
+        struct shm_ring *r = &box->rings[i];
+        owner = __atomic_load_n(&r->owner, __ATOMIC_ACQUIRE);
+        if (owner == (uint32_t) from || owner == 0 || !shm_alive(__atomic_load_n(&r->pid, __ATOMIC_ACQUIRE))) {
+            if (owner != (uint32_t) from
+                && !__atomic_compare_exchange_n(&r->owner, &owner, from, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                continue;
+            __atomic_store_n(&r->pid, getpid(), __ATOMIC_RELEASE);
+            while ((owner = __atomic_load_n(&box->used, __ATOMIC_ACQUIRE)) <= i // the reader looks up to used
+                   && !__atomic_compare_exchange_n(&box->used, &owner, i + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+                ;
+            *boxp = box;
+            return r;
+        }
+    }
+    munmap(box, sizeof(*box));
+    return NULL;
+}
+
+static inline void shm_detach(struct shm_box *box)
+{
+    munmap(box, sizeof(*box));
+}
+
+// copies n bytes at p into the ring at byte position pos (it wraps)
+static inline void shm_copy_in(struct shm_ring *r, uint64_t pos, const void *p, uint32_t n)
+{
+    uint32_t at = pos & (SHM_RING - 1), first = n < SHM_RING - at ? n : SHM_RING - at;
+
+    memcpy(r->data + at, p, first);
+    memcpy(r->data, (const char *) p + first, n - first);
+}
+
+static inline void shm_copy_out(struct shm_ring *r, uint64_t pos, void *p, uint32_t n)
+{
+    uint32_t at = pos & (SHM_RING - 1), first = n < SHM_RING - at ? n : SHM_RING - at;
+
+    memcpy(p, r->data + at, first);
+    memcpy((char *) p + first, r->data, n - first);
+}
+
+// writes one datagram (the iovecs one after the other) to the ring, -1 when it has no room
+static inline int shm_put(struct shm_ring *r, const struct iovec *iov, int iovcnt)
+{
+    uint64_t head = r->head, room = SHM_RING - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+    uint32_t len = 0, pos = 4;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (((4 + len + 7) & ~7u) > room)
+        return -1;
+    shm_copy_in(r, head, &len, 4);
+    for (i = 0; i < iovcnt; i++) {
+        shm_copy_in(r, head + pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    __atomic_store_n(&r->head, head + ((4 + len + 7) & ~7u), __ATOMIC_SEQ_CST); // then sleeping is read
+    return 0;
+}
+
+// after the records to box: wakes its reader if it said it sleeps
+static inline void shm_ring_bell(struct shm_box *box)
+{
+    if (__atomic_load_n(&box->sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&box->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&box->bell, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &box->bell, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// the next datagram of the ring into buf, its length, 0 when the ring is empty (a record bigger than cap is dropped)
+static inline int shm_get(struct shm_ring *r, char *buf, uint32_t cap)
+{
+    uint64_t tail = r->tail;
+    uint32_t len;
+
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+        return 0;
+    shm_copy_out(r, tail, &len, 4);
+    if (len <= cap)
+        shm_copy_out(r, tail + 4, buf, len);
+    __atomic_store_n(&r->tail, tail + ((4 + len + 7) & ~7u), __ATOMIC_RELEASE); // the writer may use the room
+    return len <= cap ? (int) len : 0;
+}
+
+// the reader is going to sleep: 1 when a ring has something after all (then it must not)
+static inline int shm_sleep(struct shm_box *box)
+{
+    uint32_t i, used;
+
+    __atomic_store_n(&box->sleeping, 1, __ATOMIC_SEQ_CST); // then used and the heads are read
+    used = __atomic_load_n(&box->used, __ATOMIC_SEQ_CST); // a slot claimed before this is looked at
+    for (i = 0; i < used; i++) {
+        if (__atomic_load_n(&box->rings[i].head, __ATOMIC_SEQ_CST) != box->rings[i].tail) {
+            __atomic_store_n(&box->sleeping, 0, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline void shm_awake(struct shm_box *box)
+{
+    __atomic_store_n(&box->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+// blocks until the bell is no longer seen, returns the new value (for a thread of the reader)
+static inline uint32_t shm_wait(struct shm_box *box, uint32_t seen)
+{
+    uint32_t now;
+
+    while ((now = __atomic_load_n(&box->bell, __ATOMIC_ACQUIRE)) == seen)
+        syscall(SYS_futex, &box->bell, FUTEX_WAIT, seen, NULL, NULL, 0);
+    return now;
+}
+
+#endif
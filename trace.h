@@ -0,0 +1,225 @@
+/*
+Traffic trace of the server or a peer (-T file), for replay (replay.c).
+
+The file is the header (TRACE_MAGIC, u8 role 'S' or 'P', u16 port of the peer, 0 for the server) and then one
+record per event: u64 ns since the start (monotonic), u8 kind, u32 connection, u16 port, u32 length and the
+bytes. Integers are in host order, a trace is replayed on the kind of machine that recorded it.
+- streams (TCP): TRACE_OPEN and TRACE_CLOSE of a connection, TRACE_IN the bytes of one recv, TRACE_OUT the
+  bytes of one write (what the program wanted to send, also when the socket queued part of it). The server
+  numbers a connection by its socket, the peer has only the one of the server (0)
+- datagrams of the peers: TRACE_DGRAM_IN and TRACE_DGRAM_OUT, port = the peer on the other side
+- TRACE_STDIN: a command line of a peer
+Records are copied into a buffer of TRACE_BUFFER bytes under a mutex (the threads of a peer share it) and
+written when it is full, at exit and by trace_tick once a second (a killed program loses at most that), so
+recording costs a memcpy per frame and about one write per MB.
+*/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "proto.h"
+
+#define TRACE_MAGIC "P2PTRC1\n"
+#define TRACE_FILE_HEADER 11 // magic, role, port
+#define TRACE_HEADER 19 // of a record
+#define TRACE_BUFFER (1 << 20)
+#define TRACE_MAX_RECORD (4 * PROTO_MAX_PAYLOAD) // a recv or write is bounded by a stream buffer of about two frames
+
+enum trace_kind {
+    TRACE_OPEN = 1,
+    TRACE_CLOSE,
+    TRACE_IN,
+    TRACE_OUT,
+    TRACE_DGRAM_IN,
+    TRACE_DGRAM_OUT,
+    TRACE_STDIN
+};
+
+struct trace_rec { /*a record read back, data points into the buffer of trace_read*/
+    uint64_t ns;
+    uint8_t kind;
+    uint32_t conn;
+    uint16_t port;
+    uint32_t len;
+    char *data;
+};
+
+struct trace { /*a trace being recorded, fd -1 = off*/
+    int fd;
+    pthread_mutex_t lock;
+    char *buf;
+    uint32_t len;
+    uint64_t start, flushed; // ns of trace_now_ns
+};
+
+static inline uint64_t trace_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline int trace_write_all(int fd, const char *p, uint32_t n)
+{
+    ssize_t w;
+
+    while (n > 0) {
+        if ((w = write(fd, p, n)) <= 0)
+            return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+// starts recording to path, role 'S' (server) or 'P' (peer on port), -1 on error
+static inline int trace_open(struct trace *t, const char *path, char role, uint16_t port)
+{
+    char header[TRACE_FILE_HEADER];
+
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    t->buf = malloc(TRACE_BUFFER);
+    if (t->fd < 0 || t->buf == NULL || pthread_mutex_init(&t->lock, NULL) != 0)
+        return -1;
+    memcpy(header, TRACE_MAGIC, 8);
+    header[8] = role;
+    memcpy(header + 9, &port, 2);
+    t->len = 0;
+    t->start = t->flushed = trace_now_ns();
+    return trace_write_all(t->fd, header, sizeof(header));
+}
+
+static inline void trace_flush_locked(struct trace *t)
+{
+    if (t->len > 0 && trace_write_all(t->fd, t->buf, t->len) < 0) {
+        perror("Error on writing trace");
+        close(t->fd);
+        t->fd = -1;
+    }
+    t->len = 0;
+}
+
+// one event, its bytes are a then b (a header and a body that were sent with one syscall)
+static inline void trace_add2(struct trace *t, int kind, uint32_t conn, uint16_t port,
+                              const void *a, uint32_t alen, const void *b, uint32_t blen)
+{
+    uint64_t ns;
+    uint32_t len = alen + blen;
+    char *p;
+
+    if (t->fd < 0)
+        return;
+    pthread_mutex_lock(&t->lock);
+    if (t->fd < 0) {
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+    if (t->len + TRACE_HEADER + len > TRACE_BUFFER)
+        trace_flush_locked(t);
+    ns = trace_now_ns() - t->start;
+    p = t->buf + t->len;
+    memcpy(p, &ns, 8);
+    p[8] = kind;
+    memcpy(p + 9, &conn, 4);
+    memcpy(p + 13, &port, 2);
+    memcpy(p + 15, &len, 4);
+    if (TRACE_HEADER + len > TRACE_BUFFER) { // bigger than the buffer: the header, then the bytes as they are
+        t->len = TRACE_HEADER;
+        trace_flush_locked(t);
+        if (t->fd >= 0 && (trace_write_all(t->fd, a, alen) < 0 || trace_write_all(t->fd, b, blen) < 0))
+            t->fd = -1;
+    }
+    else {
+        if (alen > 0)
+            memcpy(p + TRACE_HEADER, a, alen);
+        if (blen > 0)
+            memcpy(p + TRACE_HEADER + alen, b, blen);
+        t->len += TRACE_HEADER + len;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+static inline void trace_add(struct trace *t, int kind, uint32_t conn, uint16_t port, const void *data, uint32_t len)
+{
+    trace_add2(t, kind, conn, port, data, len, NULL, 0);
+}
+
+// from the loop of the program: writes the buffer when the last write is a second old
+static inline void trace_tick(struct trace *t)
+{
+    uint64_t now;
+
+    if (t->fd < 0 || (now = trace_now_ns()) - t->flushed < 1000000000ull)
+        return;
+    pthread_mutex_lock(&t->lock);
+    if (t->fd >= 0)
+        trace_flush_locked(t);
+    t->flushed = now;
+    pthread_mutex_unlock(&t->lock);
+}
+
+// writes what is buffered and stops recording
+static inline void trace_close(struct trace *t)
+{
+    if (t->fd < 0)
+        return;
+    pthread_mutex_lock(&t->lock);
+    trace_flush_locked(t);
+    if (t->fd >= 0)
+        close(t->fd);
+    t->fd = -1;
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* ---------- reading a trace ---------- */
+
+// checks the file header, fills role and port, -1 when f is not a trace
+static inline int trace_read_header(FILE *f, char *role, uint16_t *port)
+{
+    char header[TRACE_FILE_HEADER];
+
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, TRACE_MAGIC, 8) != 0)
+        return -1;
+    *role = header[8];
+    memcpy(port, header + 9, 2);
+    return 0;
+}
+
+// next record of f into r (the bytes in *buf, grown as needed), 1, 0 at the end, -1 when cut short or corrupt
+static inline int trace_read(FILE *f, struct trace_rec *r, char **buf, uint32_t *cap)
+{
+    char h[TRACE_HEADER];
+    size_t n = fread(h, 1, sizeof(h), f);
+
+    if (n == 0)
+        return 0;
+    if (n != sizeof(h))
+        return -1;
+    memcpy(&r->ns, h, 8);
+    r->kind = h[8];
+    memcpy(&r->conn, h + 9, 4);
+    memcpy(&r->port, h + 13, 2);
+    memcpy(&r->len, h + 15, 4);
+    if (r->len > TRACE_MAX_RECORD) // not a length we wrote, len + 1 would even wrap
+        return -1;
+    if (r->len + 1 > *cap) {
+        char *tmp = realloc(*buf, r->len + 1);
+        if (tmp == NULL)
+            return -1;
+        *buf = tmp;
+        *cap = r->len + 1;
+    }
+    if (fread(*buf, 1, r->len, f) != r->len)
+        return -1;
+    r->data = *buf;
+    return 1;
+}
+
+#endif